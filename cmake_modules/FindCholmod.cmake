@@ -0,0 +1,25 @@
+# Look for cholmod (of SuiteSparse)
+FIND_PATH(CHOLMOD_INCLUDE_DIR NAMES cholmod.h
+  PATHS
+  /usr/include/suitesparse
+  /usr/include
+  /opt/local/include
+  /usr/local/include
+  /sw/include
+  /usr/include/ufsparse
+  /opt/local/include/ufsparse
+  /usr/local/include/ufsparse
+  /sw/include/ufsparse
+  )
+
+FIND_LIBRARY(CHOLMOD_LIBRARY NAMES cholmod
+  PATHS
+  /usr/lib
+  /usr/local/lib
+  /opt/local/lib
+  /sw/lib
+  )
+
+include(FindPackageHandleStandardArgs)
+find_package_handle_standard_args(CHOLMOD DEFAULT_MSG
+  CHOLMOD_INCLUDE_DIR CHOLMOD_LIBRARY)
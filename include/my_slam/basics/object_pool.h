@@ -0,0 +1,212 @@
+/* @brief A pool of objects of one type, with generation-checked handles.
+ *      Objects are constructed in place in fixed-size chunks, which are never moved or freed before the pool,
+ *      so an object's address is stable. A destroyed slot is reused by the next `create`.
+ *      A handle is (slot index, generation). The generation of a slot is bumped when its object is destroyed,
+ *      so a handle to a destroyed object is detected by `get`, even after the slot is reused.
+ *      The control blocks of `share`d pointers are pooled too, so neither creating nor sharing calls the heap.
+ *      It's thread-safe.
+ */
+
+#ifndef MY_SLAM_OBJECT_POOL_H
+#define MY_SLAM_OBJECT_POOL_H
+
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <new>
+#include <type_traits>
+
+#include "my_slam/common_include.h"
+
+namespace my_slam
+{
+namespace basics
+{
+
+// Handle of an object in an ObjectPool. It's outside the class template, so a class can hold the handle to itself.
+struct PoolHandle
+{
+    uint32_t index = UINT32_MAX;
+    uint32_t generation = 0;
+    bool isNull() const { return index == UINT32_MAX; }
+    bool operator==(const PoolHandle &h) const { return index == h.index && generation == h.generation; }
+    bool operator!=(const PoolHandle &h) const { return !(*this == h); }
+};
+
+template <typename T>
+class ObjectPool
+{
+public:
+    typedef PoolHandle Handle;
+
+    explicit ObjectPool(size_t chunk_size = 1024) : chunk_size_(chunk_size) {}
+    ObjectPool(const ObjectPool &) = delete;
+    ObjectPool &operator=(const ObjectPool &) = delete;
+    ~ObjectPool()
+    {
+        for (size_t i = 0; i < is_alive_.size(); i++)
+            if (is_alive_[i])
+                slot_(i)->~T();
+    }
+
+    // Construct an object in a free slot. If T's constructor throws, the slot is freed and the exception is rethrown.
+    template <typename... Args>
+    Handle create(Args &&... args)
+    {
+        uint32_t index;
+        T *object;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            index = acquireSlot_();
+            object = slot_(index);
+        }
+        try
+        {
+            new (object) T(std::forward<Args>(args)...); // Outside the lock, since T's constructor may be slow.
+        }
+        catch (...)
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            free_slots_.push_back(index);
+            throw;
+        }
+        std::lock_guard<std::mutex> lock(mutex_);
+        is_alive_[index] = true;
+        Handle h;
+        h.index = index;
+        h.generation = generations_[index];
+        return h;
+    }
+
+    // Destroy the object, and free its slot. A stale handle is ignored.
+    void destroy(Handle h)
+    {
+        T *object;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (!isValid_(h))
+                return;
+            is_alive_[h.index] = false;
+            generations_[h.index]++;
+            object = slot_(h.index);
+        }
+        object->~T();
+        std::lock_guard<std::mutex> lock(mutex_);
+        free_slots_.push_back(h.index);
+    }
+
+    // Return nullptr if the object has been destroyed.
+    T *get(Handle h) const
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return isValid_(h) ? slot_(h.index) : nullptr;
+    }
+    bool isValid(Handle h) const
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return isValid_(h);
+    }
+
+    // Share the object by a shared_ptr, which destroys it in the pool when the last copy is gone.
+    //      The pool must outlive the shared_ptr.
+    std::shared_ptr<T> share(Handle h)
+    {
+        return std::shared_ptr<T>(get(h), [this, h](T *) { destroy(h); }, BlockAllocator<T>(this));
+    }
+
+    size_t size() const // number of alive objects
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return is_alive_.size() - free_slots_.size();
+    }
+    size_t capacity() const
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return chunks_.size() * chunk_size_;
+    }
+
+private:
+    typedef typename std::aligned_storage<sizeof(T), alignof(T)>::type Storage;
+
+    // Control blocks of shared_ptr are allocated from fixed-size blocks, which are reused like slots.
+    //      A larger request, which depends on the standard library, falls back to the heap.
+    static constexpr size_t kBlockBytes = 64;
+    typedef typename std::aligned_storage<kBlockBytes, alignof(std::max_align_t)>::type Block;
+
+    template <typename U>
+    struct BlockAllocator
+    {
+        typedef U value_type;
+        ObjectPool *pool;
+        explicit BlockAllocator(ObjectPool *p) : pool(p) {}
+        template <typename V>
+        BlockAllocator(const BlockAllocator<V> &a) : pool(a.pool) {}
+        U *allocate(size_t n) { return static_cast<U *>(pool->allocateBlock_(n * sizeof(U))); }
+        void deallocate(U *p, size_t n) { pool->deallocateBlock_(p, n * sizeof(U)); }
+        template <typename V>
+        bool operator==(const BlockAllocator<V> &a) const { return pool == a.pool; }
+        template <typename V>
+        bool operator!=(const BlockAllocator<V> &a) const { return pool != a.pool; }
+    };
+
+    void *allocateBlock_(size_t bytes)
+    {
+        if (bytes > kBlockBytes)
+            return ::operator new(bytes);
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (free_blocks_.empty())
+        {
+            block_chunks_.emplace_back(new Block[chunk_size_]);
+            for (size_t i = 0; i < chunk_size_; i++)
+                free_blocks_.push_back(&block_chunks_.back()[i]);
+        }
+        Block *block = free_blocks_.back();
+        free_blocks_.pop_back();
+        return block;
+    }
+    void deallocateBlock_(void *p, size_t bytes)
+    {
+        if (bytes > kBlockBytes)
+            return ::operator delete(p);
+        std::lock_guard<std::mutex> lock(mutex_);
+        free_blocks_.push_back(static_cast<Block *>(p));
+    }
+
+    T *slot_(size_t index) const
+    {
+        return reinterpret_cast<T *>(&chunks_[index / chunk_size_][index % chunk_size_]);
+    }
+    bool isValid_(Handle h) const
+    {
+        return h.index < is_alive_.size() && is_alive_[h.index] && generations_[h.index] == h.generation;
+    }
+    uint32_t acquireSlot_()
+    {
+        if (!free_slots_.empty())
+        {
+            const uint32_t index = free_slots_.back();
+            free_slots_.pop_back();
+            return index;
+        }
+        if (is_alive_.size() == chunks_.size() * chunk_size_)
+            chunks_.emplace_back(new Storage[chunk_size_]);
+        is_alive_.push_back(false);
+        generations_.push_back(0);
+        return is_alive_.size() - 1;
+    }
+
+private:
+    const size_t chunk_size_;
+    vector<std::unique_ptr<Storage[]>> chunks_;
+    vector<bool> is_alive_;
+    vector<uint32_t> generations_;
+    vector<uint32_t> free_slots_;
+    vector<std::unique_ptr<Block[]>> block_chunks_;
+    vector<Block *> free_blocks_;
+    mutable std::mutex mutex_;
+};
+
+} // namespace basics
+} // namespace my_slam
+
+#endif
@@ -38,6 +38,12 @@ public:
     cy_ = K.at<double>(1, 2);
     K_ = K;
   }
+
+  // The camera of the image resized by `scale`, the same as cv::resize, which keeps pixel centers: u' = (u + 0.5) * scale - 0.5.
+  Camera::Ptr scaled(double scale) const
+  {
+    return Camera::Ptr(new Camera(fx_ * scale, fy_ * scale, (cx_ + 0.5) * scale - 0.5, (cy_ + 0.5) * scale - 0.5));
+  }
 };
 } // namespace geometry
 } // namespace my_slam
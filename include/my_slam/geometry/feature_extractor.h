@@ -0,0 +1,93 @@
+/* @brief Keypoint extractor with adaptive FAST thresholds on a grid:
+ *      Each pyramid level is split into cells, and each cell has its own FAST threshold.
+ *      A cell keeps its strongest keypoints by FAST response, up to its share of the total number,
+ *      and then the level's share is selected from them by `distributeKeypointsByQuadtree`.
+ *      After each image, a cell's threshold is lowered if it detected too few, and raised if it detected too many,
+ *      so the next image of the video only detects about the needed number of corners.
+ *      The keypoints have octave, size and angle set in the same way as cv::ORB, so cv::ORB::compute can describe them.
+ */
+
+#ifndef MY_SLAM_FEATURE_EXTRACTOR_H
+#define MY_SLAM_FEATURE_EXTRACTOR_H
+
+#include "my_slam/common_include.h"
+
+namespace my_slam
+{
+namespace geometry
+{
+
+/* @brief Select the strongest keypoints spread over the area, like ORB-SLAM's octree distribution:
+ *      The area is split into a quadtree level by level, and the nodes with more keypoints first in a level,
+ *      until there are `num_wanted` non-empty nodes. Then each node keeps its keypoint of the highest response.
+ *      It takes O(N log N) for N keypoints, and has no state.
+ * @param area: the area of the keypoints, in the same coordinates as them.
+ * @return At most `num_wanted` keypoints. All of them if there are no more than that.
+ */
+vector<cv::KeyPoint> distributeKeypointsByQuadtree(const vector<cv::KeyPoint> &keypoints,
+                                                   const cv::Rect &area, int num_wanted);
+
+class GridFastExtractor
+{
+public:
+  typedef std::shared_ptr<GridFastExtractor> Ptr;
+
+  /* @param num_keypoints: total number over all levels. The share of a level decreases by scale_factor, the same as cv::ORB.
+   * @param scale_factor, num_levels: the image pyramid, the same as cv::ORB's.
+   * @param cell_size: side of a cell in pixels, at every level.
+   * @param init_threshold, min_threshold, max_threshold: FAST thresholds of a cell.
+   */
+  GridFastExtractor(int num_keypoints, double scale_factor, int num_levels,
+                    int cell_size, int init_threshold, int min_threshold, int max_threshold);
+
+  /* @brief Detect keypoints of an 8-bit gray or BGR image, and adapt the thresholds for the next image.
+   * @param mask: 8-bit, of the image size. Keypoints are only detected where it's non-zero.
+   *      Cells fully outside it are skipped, and their shares go to the other cells. Empty for no mask.
+   */
+  void detect(const cv::Mat &image, vector<cv::KeyPoint> &keypoints, const cv::Mat &mask = cv::Mat());
+
+  // Change the total number for the next images. The thresholds are kept.
+  void setNumKeypoints(int num_keypoints);
+  int numKeypoints() const { return num_keypoints_; }
+
+  int numLevels() const { return num_levels_; }
+  int numCells(int level) const { return thresholds_.empty() ? 0 : thresholds_[level].size(); }
+  int threshold(int level, int cell) const { return thresholds_[level][cell]; }
+
+public:
+  static constexpr int kBorder = 31;    // cv::ORB's default edgeThreshold. Keypoints closer to the border can't be described.
+  static constexpr int kPatchSize = 31; // cv::ORB's default patchSize.
+
+private:
+  // Reset the grid and the thresholds. Called on the first image, or when the image size changes.
+  void resetGrid_(const cv::Size &image_size);
+
+  // The number of keypoints of each level, from `num_keypoints_`.
+  void computeShares_();
+
+  // Detect keypoints in one cell, and adapt its threshold. Their coordinates are at the cell's level.
+  void detectInCell_(const cv::Mat &level_img, const cv::Rect &cell, int num_wanted, int &threshold,
+                     vector<cv::KeyPoint> &keypoints) const;
+
+  // Orientation by the intensity centroid of the circular patch, the same as cv::ORB.
+  float computeAngle_(const cv::Mat &level_img, const cv::Point2f &pt) const;
+
+private:
+  int num_keypoints_;
+  const double scale_factor_;
+  const int num_levels_;
+  const int cell_size_;
+  const int init_threshold_, min_threshold_, max_threshold_;
+
+  cv::Size image_size_;
+  vector<double> scales_;                 // scale_factor ^ level
+  vector<vector<cv::Rect>> cells_;        // of each level, in the level's coordinates
+  vector<vector<int>> thresholds_;        // of each cell
+  vector<int> num_keypoints_per_level_;
+  vector<int> umax_;                      // half width of each row of the circular patch
+};
+
+} // namespace geometry
+} // namespace my_slam
+
+#endif
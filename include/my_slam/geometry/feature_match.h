@@ -3,14 +3,23 @@
 #define MY_SLAM_FEATURE_MATCH_H
 
 #include "my_slam/common_include.h"
+#include "my_slam/geometry/vocabulary.h"
 
 namespace my_slam
 {
 namespace geometry
 {
 
+/* @brief Detect keypoints.
+ *      If `is_use_adaptive_fast_extractor`, by a GridFastExtractor whose thresholds are adapted over consecutive images.
+ *      Else, ORB detects `number_of_keypoints_to_extract` and `selectUniformKptsByQuadtree` keeps some of them.
+ * @param num_keypoints_wanted: at most this many are kept. If <= 0, `max_number_of_keypoints`.
+ * @param mask: 8-bit, of the image size. Keypoints are only detected where it's non-zero. Empty for no mask.
+ */
 void calcKeyPoints(const cv::Mat &image,
-                   vector<cv::KeyPoint> &keypoints);
+                   vector<cv::KeyPoint> &keypoints,
+                   int num_keypoints_wanted = 0,
+                   const cv::Mat &mask = cv::Mat());
 
 /* @brief Compute the descriptors of keypoints.
  *      Meanwhile, keypoints might be changed.
@@ -36,14 +45,28 @@ vector<cv::DMatch> matchByRadiusAndBruteForce(
     const cv::Mat1b &descriptors_2,
     float max_matching_pixel_dist);
 
+/* @brief Match descriptors by the feature vectors of a vocabulary:
+ *      Only descriptors under the same vocabulary node are compared, instead of all pairs.
+ *      A good match passes the ratio test, and its Hamming distance is <= `max_distance`.
+ *      Each descriptor in 2 is matched at most once, by the closest one in 1.
+ */
+void matchFeaturesByBoW(
+    const cv::Mat1b &descriptors_1, const FeatureVector &feat_vec_1,
+    const cv::Mat1b &descriptors_2, const FeatureVector &feat_vec_2,
+    vector<cv::DMatch> &matches,
+    float ratio = 0.7, int max_distance = 80);
+
 // Remove duplicate matches.
 // After cv's match func, many kpts in I1 might matched to a same kpt in I2.
 // Sorting the trainIdx(I2), and make the match unique.
 void removeDuplicatedMatches(vector<cv::DMatch> &matches);
 
-// Use a grid to remove the keypoints that are too close to each other.
-void selectUniformKptsByGrid(vector<cv::KeyPoint> &keypoints,
-                             int image_rows, int image_cols);
+/* @brief Keep `num_keypoints_wanted` (or `max_number_of_keypoints` if <= 0) strong keypoints spread over the image.
+ *      Each pyramid level gets a share like cv::ORB's, selected by `distributeKeypointsByQuadtree`.
+ */
+void selectUniformKptsByQuadtree(vector<cv::KeyPoint> &keypoints,
+                                 int image_rows, int image_cols,
+                                 int num_keypoints_wanted = 0);
 
 // --------------------- Other assistant functions ---------------------
 double computeMeanDistBetweenKeypoints(
@@ -0,0 +1,85 @@
+/* @brief Vocabulary tree for binary descriptors (bag of binary words), like DBoW2.
+ *      It's trained offline by hierarchical k-means, whose cluster center is the bitwise majority of its descriptors.
+ *      Each leaf is a word, weighted by its inverse document frequency in the training images.
+ *      An image is then converted to:
+ *          a BoW vector (word -> tf-idf weight) for fast comparison of images, and
+ *          a feature vector (node -> descriptors under it) for only matching descriptors under the same node.
+ */
+
+#ifndef MY_SLAM_VOCABULARY_H
+#define MY_SLAM_VOCABULARY_H
+
+#include "my_slam/common_include.h"
+#include <cstdint>
+
+namespace my_slam
+{
+namespace geometry
+{
+
+typedef std::map<int, double> BowVector;            // word id -> weight. L1 normalized.
+typedef std::map<int, vector<int>> FeatureVector;  // node id -> indices of descriptors under it.
+
+class Vocabulary
+{
+public:
+  typedef std::shared_ptr<Vocabulary> Ptr;
+
+  // A tree with `depth` levels below the root, and at most `branching` children for each node.
+  Vocabulary(int branching = 10, int depth = 5);
+
+  /* @brief Train the tree.
+   * @param training_descriptors: descriptors of each training image. CV_8U, one row per descriptor.
+   */
+  void create(const vector<cv::Mat> &training_descriptors);
+
+  // Compact binary format. `load` throws if the file is not a vocabulary.
+  void save(const string &filename) const;
+  void load(const string &filename);
+
+  bool empty() const { return words_.empty(); }
+  int numWords() const { return words_.size(); }
+
+  // Hash of the tree, i.e. the shape, parents, weights and descriptors of the nodes. Never 0.
+  //      BoW vectors computed by vocabularies of different signatures can't be compared.
+  uint64_t signature() const;
+
+  /* @brief Convert the descriptors of an image.
+   * @param levels_up: The feature vector groups descriptors by their ancestor node `levels_up` levels above the words.
+   *      Larger value gives fewer but larger groups.
+   */
+  void transform(const cv::Mat &descriptors, BowVector &bow_vec, FeatureVector &feat_vec, int levels_up) const;
+  void transform(const cv::Mat &descriptors, BowVector &bow_vec) const;
+
+  // Similarity of two BoW vectors in [0, 1], computed from their L1 distance.
+  static double score(const BowVector &v1, const BowVector &v2);
+
+private:
+  struct Node
+  {
+    int parent;
+    vector<int> children;
+    cv::Mat descriptor; // cluster center
+    double weight;      // idf weight. Only for words.
+    int word_id;        // -1 if not a leaf
+  };
+
+  // Split the descriptors of a node into its children, recursively.
+  void buildTree_(int node_id, const vector<cv::Mat> &descriptors, int level);
+  void computeWords_();
+  void computeWeights_(const vector<cv::Mat> &training_descriptors);
+
+  // Go down the tree to the word of a descriptor. Also return the node at `node_level` on the way.
+  int findWord_(const cv::Mat &descriptor, int node_level, int &node_id) const;
+
+private:
+  int branching_;
+  int depth_;
+  vector<Node> nodes_; // nodes_[0] is the root.
+  vector<int> words_;  // word id -> node id
+};
+
+} // namespace geometry
+} // namespace my_slam
+
+#endif
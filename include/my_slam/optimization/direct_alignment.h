@@ -0,0 +1,64 @@
+/* @brief Sparse direct image alignment:
+ *      Estimate the relative pose of the current image to a reference image,
+ *      by minimizing the photometric error of small patches around points whose depths are known in the reference.
+ *      No feature is extracted or matched.
+ *      It's a Gauss-Newton on SE3 in the inverse compositional form: Jacobians are computed once on the reference patches.
+ *      It's solved coarse-to-fine on the image pyramids, so it converges from a motion of several pixels.
+ */
+
+#ifndef MY_SLAM_DIRECT_ALIGNMENT_H
+#define MY_SLAM_DIRECT_ALIGNMENT_H
+
+#include "my_slam/common_include.h"
+
+#include "my_slam/optimization/motion_only_ba.h" // Vector6d, Matrix6d
+
+namespace my_slam
+{
+namespace optimization
+{
+
+struct DirectAlignmentSummary
+{
+    int num_points = 0;     // Points whose patches are inside both images at the finest level.
+    double rms_error = 0;   // Photometric error per pixel of these patches, in gray levels.
+    int num_iterations = 0; // Over all levels.
+    vector<double> point_rms_errors; // Of each point's patch at the finest level. -1 if it's not inside both images.
+};
+
+/* @brief Align the current image to the reference image.
+ * @param ref_pyramid, curr_pyramid: 8-bit gray images. Level 0 is the full image, and each level is half of the previous one.
+ *      The alignment starts at the coarsest level common to both.
+ * @param pts_ref: points in the reference camera frame.
+ * @param fx, fy, cx, cy: camera intrinsics at level 0.
+ * @param T_curr_ref: transformation from the reference camera to the current camera. Initial guess, refined in place.
+ * @param max_iters: maximum number of iterations at each level.
+ * @param patch_half_size: a patch is (2 * patch_half_size)^2 pixels.
+ */
+DirectAlignmentSummary alignSparseDirect(
+    const vector<cv::Mat> &ref_pyramid,
+    const vector<cv::Mat> &curr_pyramid,
+    const vector<Eigen::Vector3d> &pts_ref,
+    double fx, double fy, double cx, double cy,
+    Sophus::SE3 &T_curr_ref,
+    int max_iters = 30,
+    int patch_half_size = 2);
+
+/* @brief Same as above, but using OpenCV datatypes.
+ * @param pts_world: points in world frame.
+ * @param T_w_ref: pose of the reference camera in world frame.
+ * @param T_w_curr: pose of the current camera in world frame, which is the format of `Frame::T_w_c_`. Refined in place.
+ */
+DirectAlignmentSummary alignSparseDirect(
+    const vector<cv::Mat> &ref_pyramid,
+    const vector<cv::Mat> &curr_pyramid,
+    const vector<cv::Point3f> &pts_world,
+    const cv::Mat &K,
+    const cv::Mat &T_w_ref,
+    cv::Mat &T_w_curr,
+    int max_iters = 30,
+    int patch_half_size = 2);
+
+} // namespace optimization
+} // namespace my_slam
+#endif
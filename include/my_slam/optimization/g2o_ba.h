@@ -8,26 +8,186 @@ https://github.com/gaoxiang12/slambook/blob/master/ch7/pose_estimation_3d2d.cpp
 
 #include "my_slam/common_include.h"
 
+#include <chrono>
+
 namespace my_slam
 {
 namespace optimization
 {
 
-void optimizeSingleFrame(
+// Linear solver for the reduced camera system of BA.
+//      In all cases, map points are marginalized by Schur complement first,
+//      so the linear system to solve is only of size (6*num_poses)x(6*num_poses).
+enum class LinearSolverType
+{
+    AUTO,    // choose by problem size. See `chooseLinearSolver`.
+    DENSE,   // dense Cholesky. Fast for a few poses, but cubic in number of poses.
+    CSPARSE, // sparse Cholesky by CSparse.
+    CHOLMOD, // sparse supernodal Cholesky by CHOLMOD. Falls back to CSPARSE if not compiled with CHOLMOD.
+    EIGEN,   // sparse Cholesky by Eigen.
+    PCG      // preconditioned conjugate gradient. Iterative, for very large problems.
+};
+
+// Convert a string of "auto", "dense", "csparse", "cholmod", "eigen" or "pcg" to LinearSolverType.
+LinearSolverType str2LinearSolverType(const string &s);
+string linearSolverType2str(LinearSolverType type);
+
+// Choose the linear solver by the number of poses, which is the size of the reduced camera system.
+LinearSolverType chooseLinearSolver(int num_poses);
+
+// Which library solves bundle adjustment.
+enum class BABackend
+{
+    G2O,   // g2o's generic graph optimizer.
+    NATIVE // In-tree LM with fixed-size blocks and analytic Jacobians. See native_ba.h.
+};
+
+// Convert a string of "g2o" or "native" to BABackend.
+BABackend str2BABackend(const string &s);
+
+// Stopping criteria of BA. The optimization stops when any of them is met.
+struct BATermination
+{
+    int max_iters = 50;
+    double min_relative_decrease = 1e-6; // Stop if (prev_cost - cost) / prev_cost is smaller.
+    double min_step_norm = 1e-8;         // Stop if the norm of the update of all variables is smaller.
+    double max_time_ms = 0;              // Wall-clock budget. Stop if the next iteration would exceed it. <= 0 means no limit.
+};
+
+// Which criterion of BATermination stopped the optimization.
+enum class BAStopReason
+{
+    MAX_ITERS,
+    COST_CONVERGED,
+    STEP_CONVERGED,
+    TIME_BUDGET,
+    NO_PROGRESS // The solver failed to find a step that decreases the cost.
+};
+string baStopReason2str(BAStopReason reason);
+
+struct BASummary
+{
+    int iterations = 0;
+    double initial_cost = 0, final_cost = 0; // Robust chi2 of all observations
+    double time_ms = 0;
+    BAStopReason stop_reason = BAStopReason::MAX_ITERS;
+    int num_outliers = 0; // Observations rejected by the two-stage BA. See `BAOptions::is_remove_outliers`.
+    string toString() const;
+};
+
+/* @brief Check BATermination after each iteration of an optimizer.
+ *      The time budget is checked against the predicted end of the next iteration,
+ *      which is the duration of the slowest iteration so far.
+ */
+class BATerminationChecker
+{
+public:
+  BATerminationChecker(const BATermination &termination, double initial_cost);
+
+  // Call after each iteration. `step_norm` < 0 means it's unknown. Return true if the optimization should stop.
+  bool update(double cost, double step_norm);
+  const BASummary &getSummary() const { return summary_; }
+
+private:
+  const BATermination termination_;
+  BASummary summary_;
+  std::chrono::steady_clock::time_point t_start_, t_last_;
+  double max_iter_time_ms_ = 0;
+};
+
+// Settings of bundle adjustment.
+struct BAOptions
+{
+    BATermination termination;
+    LinearSolverType linear_solver = LinearSolverType::AUTO;
+    BABackend backend = BABackend::G2O;
+    int num_threads = 0; // For evaluating residuals and Jacobians in NATIVE backend. 0 means using all cores.
+    bool is_fix_first_pose = false; // Fix the 1st pose to remove the gauge freedom when points are optimized, too.
+
+    // Two-stage BA: optimize with the Huber kernel, deactivate observations whose chi2 > `outlier_chi2_threshold`,
+    //      and then optimize the inliers again without the kernel.
+    //      In the 2nd stage, the final cost in BASummary is the non-robust chi2 of inliers.
+    bool is_remove_outliers = false;
+    double outlier_chi2_threshold = 5.991; // chi2 with 2 dof, 95%
+};
+
+BASummary optimizeSingleFrame(
     const vector<cv::Point2f *> &points_2d,
     const cv::Mat &K,
     vector<cv::Point3f *> &points_3d,
     cv::Mat &cam_pose_in_world,
-    bool is_fix_map_pts, bool is_update_map_pts);
+    bool is_fix_map_pts, bool is_update_map_pts,
+    const BAOptions &options = BAOptions());
 
-void bundleAdjustment(
+BASummary bundleAdjustment(
     const vector<vector<cv::Point2f *>> &v_pts_2d,
     const vector<vector<int>> &v_pts_2d_to_3d_idx,
     const cv::Mat &K,
     std::unordered_map<int, cv::Point3f *> &pts_3d,
     vector<cv::Mat *> &v_camera_g2o_poses,
     const cv::Mat &information_matrix,
-    bool is_fix_map_pts = false, bool is_update_map_pts = true);
+    bool is_fix_map_pts = false, bool is_update_map_pts = true,
+    const BAOptions &options = BAOptions(),
+    vector<vector<bool>> *v_is_outlier = nullptr); // Output: same shape as v_pts_2d. Only set if `options.is_remove_outliers`.
+
+/* @brief A persistent g2o graph of a sliding window of keyframes.
+ *      Consecutive windowed BAs share almost all of their variables,
+ *      so instead of building a new graph for each call, keyframes and their observations are added incrementally,
+ *      the oldest keyframes are removed, and the optimization warm-starts from the previous solution.
+ *      Vertices and edges are only allocated for the new keyframes.
+ */
+class SlidingWindowBA
+{
+public:
+  typedef std::shared_ptr<SlidingWindowBA> Ptr;
+
+  /* @param max_num_keyframes: Expected window size. It's used for choosing the linear solver if it's AUTO.
+   */
+  SlidingWindowBA(const cv::Mat &K, const cv::Mat &information_matrix,
+                  bool is_fix_map_pts, int max_num_keyframes,
+                  const BAOptions &options = BAOptions());
+  ~SlidingWindowBA();
+
+  bool hasKeyFrame(int frame_id) const;
+  vector<int> getKeyFrameIds() const;
+  vector<int> getPointIds() const;
+
+  /* @brief Add a keyframe and its observations.
+   *      A point that is already in the window keeps its current estimation, unless points are fixed,
+   *      in which case it's reset to its position in `pts_3d`. A new point is added with its position in `pts_3d`.
+   */
+  void addKeyFrame(int frame_id, const cv::Mat &T_w_c,
+                   const vector<cv::Point2f> &pts_2d,
+                   const vector<int> &pts_2d_to_3d_idx,
+                   const std::unordered_map<int, cv::Point3f> &pts_3d);
+
+  // Remove a keyframe and its observations. Points no longer observed by the window are removed, too.
+  void removeKeyFrame(int frame_id);
+
+  // Remove a point (e.g. it has been deleted from the map) and its observations.
+  void removePoint(int pt_id);
+
+  // Overwrite the estimation of a keyframe's pose, e.g. after it's corrected outside the window.
+  void setPose(int frame_id, const cv::Mat &T_w_c);
+
+  // Overwrite the estimation of a point, e.g. after it's moved by fusion or loop correction. Needed if points are fixed.
+  void setPoint(int pt_id, const cv::Point3f &pos);
+
+  /* @brief Optimize the window. The oldest keyframe is fixed if the points are not fixed.
+   * @param outliers: Output. (frame id, point id) of the rejected observations if `is_remove_outliers` in the options.
+   *      They are removed from the window, and points without observations are removed, too.
+   */
+  BASummary optimize(const BATermination &termination = BATermination(),
+                     vector<std::pair<int, int>> *outliers = nullptr);
+
+  // Get results.
+  bool getPose(int frame_id, cv::Mat &T_w_c) const;
+  void getPoints(std::unordered_map<int, cv::Point3f> &pts_3d) const;
+
+private:
+  struct Impl; // g2o's datatypes, which are only included in g2o_ba.cpp
+  std::unique_ptr<Impl> impl_;
+};
 
 } // namespace optimization
 } // namespace my_slam
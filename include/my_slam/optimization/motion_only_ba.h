@@ -0,0 +1,54 @@
+/* @brief Motion-only bundle adjustment:
+ *      Refine a single camera pose against fixed 3d points.
+ *      It's a Gauss-Newton on SE3 with a Huber kernel, whose normal equation is a fixed-size 6x6 system.
+ *      So it's cheap enough to be called on every tracked frame, instead of the windowed BA.
+ */
+
+#ifndef MY_SLAM_MOTION_ONLY_BA_H
+#define MY_SLAM_MOTION_ONLY_BA_H
+
+#include "my_slam/common_include.h"
+
+#include <Eigen/Core>
+#include <sophus/se3.h>
+
+namespace my_slam
+{
+namespace optimization
+{
+
+typedef Eigen::Matrix<double, 6, 1> Vector6d;
+typedef Eigen::Matrix<double, 6, 6> Matrix6d;
+
+/* @brief Refine camera pose T_c_w by minimizing the reprojection error of fixed points.
+ * @param pts_2d: observed pixel positions.
+ * @param pts_3d: points in world frame. They are not changed.
+ * @param fx, fy, cx, cy: camera intrinsics.
+ * @param T_c_w: transformation from world to camera. Refined in place.
+ * @param is_inlier: output. Whether a 2d-3d pair's chi2 error is smaller than `chi2_threshold` after optimization.
+ * @return Number of inliers.
+ */
+int optimizePoseOnly(
+    const vector<Eigen::Vector2d> &pts_2d,
+    const vector<Eigen::Vector3d> &pts_3d,
+    double fx, double fy, double cx, double cy,
+    Sophus::SE3 &T_c_w,
+    vector<bool> &is_inlier,
+    int max_iters = 10,
+    double chi2_threshold = 5.991); // chi2 with 2 dof, 95%
+
+/* @brief Same as above, but using OpenCV datatypes.
+ * @param T_w_c: camera pose in world frame, which is the format of `Frame::T_w_c_`. Refined in place.
+ */
+int optimizePoseOnly(
+    const vector<cv::Point2f> &pts_2d,
+    const vector<cv::Point3f> &pts_3d,
+    const cv::Mat &K,
+    cv::Mat &T_w_c,
+    vector<bool> &is_inlier,
+    int max_iters = 10,
+    double chi2_threshold = 5.991);
+
+} // namespace optimization
+} // namespace my_slam
+#endif
@@ -0,0 +1,159 @@
+/* @brief An in-tree bundle adjuster, selected by `BAOptions::backend = BABackend::NATIVE`.
+ *      It solves the same problem as the g2o backend of `bundleAdjustment`,
+ *      but the problem structure is known at compile time:
+ *          - All blocks are fixed-size Eigen matrices: pose 6x6, point 3x3, pose-point 6x3,
+ *            and the Jacobians of a reprojection error are 2x6 and 2x3.
+ *          - The Jacobians are analytic. No auto-diff or numeric diff.
+ *          - Observations are stored contiguously and grouped by point,
+ *            and their residuals/Jacobians are evaluated by multiple threads.
+ *          - Points are eliminated by an explicit Schur complement,
+ *            and the reduced camera system is solved by a dense or sparse Cholesky, or by PCG.
+ *      The optimizer is Levenberg-Marquardt with a Huber kernel.
+ */
+
+#ifndef MY_SLAM_NATIVE_BA_H
+#define MY_SLAM_NATIVE_BA_H
+
+#include "my_slam/common_include.h"
+#include "my_slam/optimization/g2o_ba.h"
+
+#include <Eigen/Core>
+#include <Eigen/StdVector>
+#include <sophus/se3.h>
+
+namespace my_slam
+{
+namespace optimization
+{
+
+template <typename T>
+using AlignedVector = std::vector<T, Eigen::aligned_allocator<T>>;
+
+/* @brief Levenberg-Marquardt bundle adjustment of poses and points.
+ * @tparam kPoseDim, kPointDim, kResDim: Size of the blocks.
+ *      Only <6, 3, 2> (SE3 pose, 3d point, pixel error) is implemented,
+ *      but all matrices are declared from these constants, so that the block operations are unrolled by Eigen.
+ */
+template <int kPoseDim = 6, int kPointDim = 3, int kResDim = 2>
+class NativeBundleAdjuster
+{
+public:
+  typedef Eigen::Matrix<double, kPoseDim, 1> PoseVec;
+  typedef Eigen::Matrix<double, kPointDim, 1> PointVec;
+  typedef Eigen::Matrix<double, kResDim, 1> ResVec;
+  typedef Eigen::Matrix<double, kPoseDim, kPoseDim> PoseBlock;
+  typedef Eigen::Matrix<double, kPointDim, kPointDim> PointBlock;
+  typedef Eigen::Matrix<double, kPoseDim, kPointDim> PosePointBlock;
+  typedef Eigen::Matrix<double, kResDim, kPoseDim> PoseJacobian;
+  typedef Eigen::Matrix<double, kResDim, kPointDim> PointJacobian;
+  typedef Eigen::Matrix<double, kResDim, kResDim> InfoMatrix;
+
+  struct Observation
+  {
+    EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+    int pose_idx;
+    int point_idx;
+    ResVec uv;
+  };
+
+  /* @param huber_delta: Threshold of the Huber kernel on the whitened error. Non-positive means no kernel.
+   */
+  NativeBundleAdjuster(double fx, double fy, double cx, double cy,
+                       const InfoMatrix &information, double huber_delta = 1.0);
+
+  // Add variables. Return their index.
+  int addPose(const Sophus::SE3 &T_c_w, bool is_fixed = false);
+  int addPoint(const PointVec &pos, bool is_fixed = false);
+  void addObservation(int pose_idx, int point_idx, const ResVec &uv);
+
+  // For the two-stage BA: exclude outlier observations, and switch off the kernel.
+  void setObservationActive(int obs_idx, bool is_active) { is_obs_active_[obs_idx] = is_active; }
+  bool isObservationActive(int obs_idx) const { return is_obs_active_[obs_idx]; }
+  void setHuberDelta(double huber_delta) { huber_delta_ = huber_delta; }
+
+  // Whitened squared error of an observation at the current states. Infinity if the point is behind the camera.
+  double computeChi2(int obs_idx) const;
+  int numObservations() const { return observations_.size(); }
+
+  /* @brief Run LM until any of the stopping criteria is met.
+   * @param linear_solver: Solver for the reduced camera system. AUTO is resolved by `chooseLinearSolver`.
+   * @param num_threads: Number of threads for evaluating residuals and Jacobians. 0 means all cores.
+   */
+  BASummary optimize(const BATermination &termination = BATermination(),
+                     LinearSolverType linear_solver = LinearSolverType::AUTO, int num_threads = 0);
+
+  const Sophus::SE3 &getPose(int idx) const { return poses_[idx]; }
+  const PointVec &getPoint(int idx) const { return points_[idx]; }
+  int numPoses() const { return poses_.size(); }
+  int numPoints() const { return points_.size(); }
+
+private:
+  // Reprojection error of an observation, and its Jacobians wrt the left perturbation of pose and the point.
+  // Return false if the point is behind the camera.
+  bool linearizeOne_(const Sophus::SE3 &T_c_w, const PointVec &p_w, const ResVec &uv,
+                     ResVec &err, PoseJacobian *J_pose, PointJacobian *J_point) const;
+
+  // Robust weight of a whitened squared error, and its robust cost.
+  void robustify_(double chi2, double &weight, double &cost) const;
+
+  // Total robust cost of the given states. Evaluated in parallel.
+  double computeCost_(const AlignedVector<Sophus::SE3> &poses, const AlignedVector<PointVec> &points) const;
+
+  // Evaluate residuals, weights and Jacobians of all observations at the current states in parallel,
+  // and then accumulate them into the blocks of the normal equation.
+  void buildNormalEquation_();
+
+  // Eliminate points by Schur complement, solve the damped reduced camera system,
+  // and back-substitute the point updates. Return false if the system is not solvable.
+  bool solveDamped_(double lambda, LinearSolverType solver_type,
+                    AlignedVector<PoseVec> &dx_poses, AlignedVector<PointVec> &dx_points) const;
+
+  // Run func(begin, end) on `num_threads_` chunks of [0, n).
+  template <typename Func>
+  void parallelFor_(int n, const Func &func) const;
+
+private:
+  const double fx_, fy_, cx_, cy_;
+  const InfoMatrix information_;
+  double huber_delta_;
+  int num_threads_ = 1;
+
+  // Variables
+  AlignedVector<Sophus::SE3> poses_; // T_c_w
+  AlignedVector<PointVec> points_;   // in world frame
+  vector<bool> is_pose_fixed_, is_point_fixed_;
+  AlignedVector<Observation> observations_;
+  vector<bool> is_obs_active_;
+
+  // Observations grouped by point: indices into `observations_`, of point i is in [point_begin_[i], point_begin_[i+1]).
+  vector<int> obs_by_point_, point_begin_;
+  vector<int> pose_col_; // Block column of a pose in the reduced camera system. -1 if fixed.
+  int num_free_poses_ = 0;
+
+  // Linearization: per-observation Jacobians, and the blocks of the normal equation.
+  AlignedVector<PoseJacobian> J_poses_;
+  AlignedVector<PointJacobian> J_points_;
+  AlignedVector<ResVec> errs_;
+  vector<double> weights_;
+  AlignedVector<PoseBlock> H_pp_;
+  AlignedVector<PointBlock> H_ll_;
+  AlignedVector<PosePointBlock> H_pl_; // per observation
+  AlignedVector<PoseVec> b_p_;
+  AlignedVector<PointVec> b_l_;
+};
+
+// The NATIVE backend of `bundleAdjustment`. Same arguments.
+BASummary bundleAdjustmentNative(
+    const vector<vector<cv::Point2f *>> &v_pts_2d,
+    const vector<vector<int>> &v_pts_2d_to_3d_idx,
+    const cv::Mat &K,
+    std::unordered_map<int, cv::Point3f *> &pts_3d,
+    vector<cv::Mat *> &v_camera_g2o_poses,
+    const cv::Mat &information_matrix,
+    bool is_fix_map_pts, bool is_update_map_pts,
+    const BAOptions &options,
+    vector<vector<bool>> *v_is_outlier = nullptr);
+
+} // namespace optimization
+} // namespace my_slam
+#endif
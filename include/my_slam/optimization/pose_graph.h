@@ -0,0 +1,71 @@
+/* @brief Pose graph optimization of keyframes in Sim(3).
+ *      A monocular VO drifts in scale as well as in pose,
+ *      so the keyframes are optimized as similarity transformations when a loop is closed.
+ */
+
+#ifndef MY_SLAM_POSE_GRAPH_H
+#define MY_SLAM_POSE_GRAPH_H
+
+#include "my_slam/common_include.h"
+
+#include <Eigen/Core>
+#include <Eigen/Geometry>
+
+namespace my_slam
+{
+namespace optimization
+{
+
+// Similarity transformation: p2 = s * R * p1 + t
+struct Sim3
+{
+    Eigen::Matrix3d R = Eigen::Matrix3d::Identity();
+    Eigen::Vector3d t = Eigen::Vector3d::Zero();
+    double s = 1.0;
+
+    Sim3() {}
+    Sim3(const Eigen::Matrix3d &R, const Eigen::Vector3d &t, double s) : R(R), t(t), s(s) {}
+
+    Sim3 inverse() const
+    {
+        const Eigen::Matrix3d R_inv = R.transpose();
+        return Sim3(R_inv, -R_inv * t / s, 1.0 / s);
+    }
+    Sim3 operator*(const Sim3 &S) const { return Sim3(R * S.R, s * R * S.t + t, s * S.s); }
+    Eigen::Vector3d operator*(const Eigen::Vector3d &p) const { return s * R * p + t; }
+    cv::Point3f operator*(const cv::Point3f &p) const
+    {
+        const Eigen::Vector3d q = (*this) * Eigen::Vector3d(p.x, p.y, p.z);
+        return cv::Point3f(q(0), q(1), q(2));
+    }
+
+    // Convert between camera pose T_w_c and S_c_w, which is a rigid transform of scale 1.
+    static Sim3 fromCamPose(const cv::Mat &T_w_c);
+    // The inverse of `fromCamPose`. The scale is moved from the rotation into the translation,
+    //      i.e., the returned pose is the rigid transform in the corrected world scale.
+    cv::Mat toCamPose() const;
+};
+
+// Relative Sim3 constraint between two keyframes: S_to_from = S_to_w * S_from_w^-1
+struct Sim3Edge
+{
+    int id_from;
+    int id_to;
+    Sim3 S_to_from;
+};
+
+/* @brief Optimize keyframe poses S_c_w by Sim3 relative constraints.
+ * @param S_c_w: keyframe id -> S_c_w. Optimized in place.
+ * @param edges: relative constraints. All have the same weight.
+ * @param fixed_id: id of the keyframe that is fixed to remove the gauge freedom.
+ * @param max_iters: iterations of Levenberg-Marquardt.
+ */
+void optimizeSim3PoseGraph(std::map<int, Sim3> &S_c_w,
+                           const vector<Sim3Edge> &edges,
+                           int fixed_id,
+                           int max_iters);
+
+} // namespace optimization
+} // namespace my_slam
+
+#endif
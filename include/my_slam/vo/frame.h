@@ -5,6 +5,7 @@
 
 #include "my_slam/common_include.h"
 #include "my_slam/basics/opencv_funcs.h"
+#include "my_slam/basics/object_pool.h"
 #include "my_slam/geometry/camera.h"
 #include "my_slam/geometry/feature_match.h"
 
@@ -31,10 +32,16 @@ public:
 
   // -- image features
   cv::Mat rgb_img_;
+  cv::Size image_size_; // kept after rgb_img_ is released
+  cv::Mat mask_;        // 8-bit ROI of the image. Keypoints are only detected where it's non-zero. Empty for no mask.
+  cv::Mat full_res_img_; // The original image, if rgb_img_ is downsampled for processing. Only kept until the keypoints are refined.
   vector<cv::KeyPoint> keypoints_;
   cv::Mat descriptors_;
   vector<vector<unsigned char>> kpts_colors_; // rgb colors
 
+  // -- Gray image pyramid for KLT tracking and direct alignment. Built once, and shared by tracking into this frame and out of it.
+  vector<cv::Mat> optical_flow_pyramid_;
+
   // -- Matches with reference keyframe (for E/H or PnP)
   //  for (1) E/H at initialization stage and (2) triangulating 3d points at all stages.
   vector<cv::DMatch> matches_with_ref_;         // matches with reference frame
@@ -49,6 +56,10 @@ public:
   // -- Matches with map points (for PnP)
   vector<cv::DMatch> matches_with_map_; // inliers matches index with respect to all the points
 
+  // -- Bag of words. Only computed for keyframes, and if a vocabulary is loaded.
+  geometry::BowVector bow_vec_;
+  geometry::FeatureVector feat_vec_; // over the rows of descriptors_
+
   // -- Camera
   geometry::Camera::Ptr camera_;
 
@@ -60,6 +71,35 @@ public:
   ~Frame() {}
   static Frame::Ptr createFrame(cv::Mat rgb_img, geometry::Camera::Ptr camera, double time_stamp = -1);
 
+  // An empty frame in the pool. Its id is not assigned.
+  static Frame::Ptr create();
+
+  // All frames are allocated in this pool, and destroyed in it by the deleter of their Frame::Ptr.
+  static basics::ObjectPool<Frame> &pool();
+
+public: // Memory of old frames and keyframes
+  // Free the vectors only needed while the frame is being processed: matches, triangulation results and colors.
+  void releaseScratch();
+  void releaseImage()
+  {
+    rgb_img_.release();
+    full_res_img_.release();
+    releaseOpticalFlowPyramid();
+  }
+  void releaseOpticalFlowPyramid() { vector<cv::Mat>().swap(optical_flow_pyramid_); }
+
+  // Write descriptors_ to a file and free them. They are read back by `restoreDescriptors` or `readSpilledDescriptors`,
+  //      which throw if the file can't be read or its size doesn't match its header.
+  void spillDescriptors(const string &filename);
+  void restoreDescriptors();
+  cv::Mat readSpilledDescriptors() const;
+  bool isDescriptorsSpilled() const { return !spilled_descriptors_file_.empty(); }
+
+  // Approximate heap memory in bytes, for reporting and the memory budget.
+  size_t memoryBytes() const;
+
+  string spilled_descriptors_file_; // empty if descriptors_ are in memory
+
 public: // Below are deprecated. These were used in the two-frame-matching vo.
   void clearNoUsed()
   {
@@ -70,10 +110,17 @@ public: // Below are deprecated. These were used in the two-frame-matching vo.
     inliers_matches_for_3d_.clear();
     matches_with_map_.clear();
   }
-  void calcKeyPoints()
+  void calcKeyPoints(int num_keypoints_wanted = 0) // <= 0 for `max_number_of_keypoints`
   {
-    geometry::calcKeyPoints(rgb_img_, keypoints_);
+    geometry::calcKeyPoints(rgb_img_, keypoints_, num_keypoints_wanted, mask_);
   }
+
+  // Refine keypoints_ by cv::cornerSubPix on the gray full_res_img_, and then release it. Nothing is done if it's empty.
+  //    A keypoint which moves by more than a pixel of rgb_img_ keeps its position.
+  //    If descriptors_ have been computed, they are recomputed at the refined positions, and the keypoints' indices,
+  //    which map point associations refer to, are kept. If ORB would drop a refined keypoint near the border,
+  //    all keypoints keep their unrefined positions, so they still match descriptors_. kpts_colors_ are not updated.
+  void refineKeyPointsAtFullResolution();
   void calcDescriptors()
   {
     geometry::calcDescriptors(rgb_img_, keypoints_, descriptors_);
@@ -84,6 +131,10 @@ public: // Below are deprecated. These were used in the two-frame-matching vo.
       kpts_colors_.push_back(basics::getPixelAt(rgb_img_, x, y));
     }
   };
+  void computeBoW(const geometry::Vocabulary &vocabulary);
+
+  // Build optical_flow_pyramid_ from rgb_img_ by `cv::buildOpticalFlowPyramid`, if not built yet. Level i is 1/2^i of the image.
+  void buildOpticalFlowPyramid(const cv::Size &win_size, int max_level);
   cv::Point2f projectWorldPointToImage(const cv::Point3f &p_world);
   bool isInFrame(const cv::Point3f &p_world);
   bool isInFrame(const cv::Mat &p_world);
@@ -0,0 +1,48 @@
+/* @brief Inverted-file database of keyframes' BoW vectors, for place recognition.
+ *      Each word keeps the keyframes containing it,
+ *      so a query only scores the keyframes sharing enough words with it.
+ */
+
+#ifndef MY_SLAM_KEYFRAME_DATABASE_H
+#define MY_SLAM_KEYFRAME_DATABASE_H
+
+#include <functional>
+
+#include "my_slam/common_include.h"
+#include "my_slam/geometry/vocabulary.h"
+
+namespace my_slam
+{
+namespace vo
+{
+
+class KeyFrameDatabase
+{
+public:
+  typedef std::shared_ptr<KeyFrameDatabase> Ptr;
+
+  KeyFrameDatabase() {}
+
+  void add(int keyframe_id, const geometry::BowVector &bow_vec);
+  void erase(int keyframe_id);
+  int size() const { return bow_vecs_.size(); }
+
+  /* @brief Find the keyframes most similar to `bow_vec`.
+   * @param max_results: Return at most this many (keyframe id, score), sorted by score in descending order.
+   * @param is_candidate: Keyframes for which it returns false are ignored. If empty, all are considered.
+   * @param min_common_words_ratio: Only score the keyframes sharing at least this ratio
+   *      of the max number of words shared by a keyframe.
+   */
+  vector<std::pair<int, double>> query(const geometry::BowVector &bow_vec, int max_results,
+                                       const std::function<bool(int)> &is_candidate = nullptr,
+                                       double min_common_words_ratio = 0.8) const;
+
+private:
+  std::unordered_map<int, std::list<int>> inverted_file_; // word id -> keyframe ids
+  std::unordered_map<int, geometry::BowVector> bow_vecs_; // keyframe id -> its BoW vector
+};
+
+} // namespace vo
+} // namespace my_slam
+
+#endif
@@ -0,0 +1,114 @@
+/* @brief Loop detection over keyframes.
+ *      Each new keyframe is copied into a snapshot, and processed by a background thread:
+ *      (1) Place recognition: query the BoW database for the most similar old keyframes.
+ *          Without a vocabulary, every old keyframe is scored by brute-force descriptor matching.
+ *      (2) Verification: estimate a Sim3 from the matched map points by RANSAC,
+ *          and count the inliers by reprojection into both keyframes.
+ *      A verified loop is fetched by `getLoop` without blocking.
+ *      The Sim3 pose graph optimization and the correction of the map are done by VisualOdometry.
+ */
+
+#ifndef MY_SLAM_LOOP_CLOSING_H
+#define MY_SLAM_LOOP_CLOSING_H
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+#include "my_slam/common_include.h"
+#include "my_slam/vo/frame.h"
+#include "my_slam/vo/map.h"
+#include "my_slam/vo/keyframe_database.h"
+#include "my_slam/geometry/vocabulary.h"
+#include "my_slam/optimization/pose_graph.h"
+
+namespace my_slam
+{
+namespace vo
+{
+
+class LoopClosing
+{
+public:
+  typedef std::shared_ptr<LoopClosing> Ptr;
+
+  // A verified loop between the current keyframe and an old one.
+  struct Loop
+  {
+    int curr_id;
+    int loop_id;
+    int num_inliers;
+    optimization::Sim3 S_loop_curr; // Relative Sim3 from the current keyframe's camera frame to the loop keyframe's.
+  };
+
+  // Settings are read from config. The thread starts here. `vocabulary` can be nullptr.
+  LoopClosing(geometry::Vocabulary::Ptr vocabulary);
+  ~LoopClosing(); // Stop and join the thread.
+
+  // Copy the keyframe's pose, descriptors, BoW vectors and observed map points, and queue it for detection.
+  void addKeyFrame(const Frame::Ptr &keyframe, const Map::Ptr &map);
+
+  // Pop a verified loop. Return false if there is none.
+  bool getLoop(Loop &loop);
+
+  // Remove a keyframe, e.g. a culled one, so it's never a candidate again.
+  //      A queued keyframe is dropped at once. Otherwise the thread removes it from the database before its next detection.
+  void eraseKeyFrame(int keyframe_id);
+
+private:
+  // What the thread needs of a keyframe. Only keypoints associated with map points are kept.
+  struct KeyFrameSnapshot
+  {
+    int id;
+    cv::Mat T_c_w;
+    cv::Mat K;
+    vector<cv::Point2f> pts_2d;
+    vector<cv::Point3f> pts_3d; // in world frame at the time of the snapshot
+    cv::Mat descriptors;        // row i is the descriptor of pts_2d[i]
+    geometry::BowVector bow_vec;       // of all keypoints
+    geometry::FeatureVector feat_vec;  // over the rows of descriptors
+  };
+
+  void run_();
+  void eraseFromDatabase_(int keyframe_id);
+  bool detectLoop_(const KeyFrameSnapshot &curr, Loop &loop);
+  void matchDescriptors_(const KeyFrameSnapshot &kf1, const KeyFrameSnapshot &kf2, vector<cv::DMatch> &matches);
+
+  // RANSAC on 3d-3d matches. S_w2_w1 maps points of kf1's world frame into kf2's. Return the number of inliers.
+  int computeSim3_(const KeyFrameSnapshot &kf1, const KeyFrameSnapshot &kf2,
+                   const vector<cv::DMatch> &matches, optimization::Sim3 &S_w2_w1);
+  int countSim3Inliers_(const KeyFrameSnapshot &kf1, const KeyFrameSnapshot &kf2,
+                        const vector<cv::DMatch> &matches, const optimization::Sim3 &S_w2_w1,
+                        vector<bool> &is_inlier);
+
+private:
+  // Parameters
+  int min_keyframes_gap_;   // Candidates are at least this many keyframes older. Also, no detection this soon after a loop.
+  int num_candidates_;      // Verify at most this many candidates, the most similar first.
+  int min_matches_;         // Descriptor matches required by a candidate.
+  int min_inliers_;         // Sim3 inliers required by a loop.
+  double max_reproj_err_;   // Pixel threshold of a Sim3 inlier.
+  int num_ransac_iters_;
+
+  geometry::Vocabulary::Ptr vocabulary_;
+
+  // Only accessed by the thread
+  vector<KeyFrameSnapshot> database_; // in the order of insertion
+  KeyFrameDatabase keyframe_database_; // Only used with a vocabulary.
+  std::unordered_map<int, int> database_index_; // keyframe id -> index in database_
+  int num_keyframes_since_loop_;
+
+  // Shared
+  std::deque<KeyFrameSnapshot> queue_;
+  std::deque<Loop> loops_;
+  vector<int> keyframes_to_erase_;
+  bool is_stop_ = false;
+  std::mutex mutex_;
+  std::condition_variable cond_;
+  std::thread thread_;
+};
+
+} // namespace vo
+} // namespace my_slam
+
+#endif
@@ -17,10 +17,13 @@ public:
     typedef std::shared_ptr<Map> Ptr;
     std::unordered_map<int, Frame::Ptr> keyframes_;
     std::unordered_map<int, MapPoint::Ptr> map_points_;
+    std::shared_ptr<void> storage_; // Memory-mapped file of a loaded map, which its descriptors point into.
+    uint64_t bow_key_ = 0;          // Key of the vocabulary of the loaded keyframes' BoW vectors, or 0 if none is loaded.
 
     Map() {}
 
     void insertKeyFrame(Frame::Ptr frame);
+    void eraseKeyFrame(int frame_id);
     void insertMapPoint(MapPoint::Ptr map_point);
     Frame::Ptr findKeyFrame(int frame_id);
     bool hasKeyFrame(int frame_id);
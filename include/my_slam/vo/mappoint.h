@@ -4,6 +4,7 @@
 
 #include "my_slam/common_include.h"
 #include "my_slam/vo/frame.h"
+#include "my_slam/basics/object_pool.h"
 
 namespace my_slam
 {
@@ -15,9 +16,11 @@ class MapPoint
 {
 public: // Basics Properties
     typedef std::shared_ptr<MapPoint> Ptr;
+    typedef basics::PoolHandle Handle;
 
     static int factory_id_;
     int id_;
+    Handle handle_; // slot in the pool, if created by `create`
     cv::Point3f pos_;
     cv::Mat norm_;                    // Vector pointing from camera center to the point
     vector<unsigned char> color_; // r,g,b
@@ -28,10 +31,43 @@ public:                 // Properties for constructing local mapping
     int matched_times_; // being an inliner in pose estimation
     int visible_times_; // being visible in current frame
 
+public: // Observations by keyframes, and the properties computed from them
+    std::map<int, int> observations_; // keyframe id -> keypoint index
+    // Scale invariance range: the distances to a camera, at which the point can be seen at the pyramid levels of ORB.
+    //      Both are 0 until computed by `computeFromObservations`. Until then, any distance is accepted.
+    float min_distance_ = 0, max_distance_ = 0;
+
 public: // Functions
     MapPoint(const cv::Point3f &pos, const cv::Mat &descriptor, const cv::Mat &norm,
              unsigned char r = 0, unsigned char g = 0, unsigned char b = 0);
+
+    // Construct a map point in the pool. Prefer this to `new`, which allocates each point separately.
+    static MapPoint::Ptr create(const cv::Point3f &pos, const cv::Mat &descriptor, const cv::Mat &norm,
+                                unsigned char r = 0, unsigned char g = 0, unsigned char b = 0);
+
+    // All map points created by `create` are in this pool. A point is found by its handle with `pool().get(handle)`.
+    static basics::ObjectPool<MapPoint> &pool();
     void setPos(const cv::Point3f &pos);
+
+    void addObservation(int keyframe_id, int kpt_idx) { observations_[keyframe_id] = kpt_idx; }
+    void eraseObservation(int keyframe_id) { observations_.erase(keyframe_id); }
+
+    // Is the distance to a camera within the scale invariance range, enlarged by a tolerance on both sides.
+    bool isInScaleRange(float dist, float tolerance = 0.2f) const
+    {
+        return max_distance_ <= 0 || (dist >= (1 - tolerance) * min_distance_ && dist <= (1 + tolerance) * max_distance_);
+    }
+
+    /* @brief Compute the properties of a point from its observations:
+     *      descriptor: the one with the least median Hamming distance to the others;
+     *      norm: the mean viewing direction, from the camera centers to the point;
+     *      min/max_distance: scaled from the distance to `ref_cam_center`, where the point is seen at `ref_octave`.
+     *      It doesn't access any map point, so it can run in a background thread.
+     */
+    static void computeFromObservations(
+        const cv::Point3f &pos, const vector<cv::Mat> &descriptors, const vector<cv::Point3f> &cam_centers,
+        const cv::Point3f &ref_cam_center, int ref_octave, double scale_factor, int num_levels,
+        cv::Mat &descriptor, cv::Mat &norm, float &min_distance, float &max_distance);
 };
 
 } // namespace vo
@@ -3,6 +3,10 @@
 #ifndef MY_SLAM_VO_H
 #define VO_H
 
+// std
+#include <future>
+#include <chrono>
+
 // cv
 #include <opencv2/core/core.hpp>
 #include <opencv2/highgui/highgui.hpp>
@@ -18,12 +22,15 @@
 #include "my_slam/geometry/camera.h"
 #include "my_slam/geometry/feature_match.h"
 #include "my_slam/geometry/motion_estimation.h"
+#include "my_slam/optimization/g2o_ba.h"
+#include "my_slam/optimization/pose_graph.h"
 
 #include "my_slam/common_include.h"
 #include "my_slam/vo/frame.h"
 #include "my_slam/vo/map.h"
 #include "my_slam/vo/mappoint.h"
 #include "my_slam/vo/vo_commons.h"
+#include "my_slam/vo/loop_closing.h"
 
 namespace my_slam
 {
@@ -39,10 +46,30 @@ public:
 
   void addFrame(vo::Frame::Ptr frame); // Add a new frame to the visual odometry system and compute its pose.
 
-  bool isInitialized();                         // Is visual odometry initialized.
+  /* @brief Localization-only mode: track the following frames against a fixed, prebuilt map, such as one from `loadMap`.
+   *      No triangulation, keyframe insertion, map point culling, BA or loop closing is done.
+   *      Each frame is only matched to the map points projected into its view, and then solved by PnP and motion-only BA.
+   *      The first frame, and any frame after tracking fails, is relocalized against the map's keyframes,
+   *      which needs a vocabulary to search the whole map. Without it, only the map's latest keyframes are tried.
+   */
+  void setLocalizationMap(Map::Ptr map);
+
+  bool isInitialized();                         // Is visual odometry initialized. It's still true when lost.
+  bool isLost() { return vo_state_ == LOST; }   // Is tracking lost, and waiting for relocalization.
+  bool isLocalizationOnly() { return is_localization_only_; }
+
+  /* @brief Time budget of `addFrame`, from `frame_deadline_ms` by default. <= 0 means no deadline.
+   *      Tracking always runs. Mapping work that can wait, i.e., map point fusion and culling of a new keyframe,
+   *      is deferred when the frame is over its deadline, and done when a later frame finishes early.
+   */
+  void setFrameDeadline(double deadline_ms) { frame_deadline_ms_ = deadline_ms; }
   Frame::Ptr getPrevRef() { return prev_ref_; } // for run_vo.cpp to draw result
   Map::Ptr getMap() { return map_; }            // for run_vo.cpp to draw result
 
+  // Identifies the vocabulary and `bow_node_levels_up` of keyframes' BoW and feature vectors, for `saveMap`.
+  //      0 if there is no vocabulary.
+  uint64_t getBoWKey() const;
+
 private:
   enum VOState
   {
@@ -52,6 +79,7 @@ private:
     LOST
   };
   VOState vo_state_;
+  bool is_localization_only_ = false; // Set by `setLocalizationMap`. The map is not changed then.
 
 private:
   // Frame
@@ -62,10 +90,60 @@ private:
   Frame::Ptr newest_frame_ = nullptr; // temporarily store the newest frame
   cv::Mat prev_T_w_c_;                // pos of previous frame
   std::deque<Frame::Ptr> frames_buff_;
+  std::deque<Frame::Ptr> keyframes_buff_; // previous keyframes, which are the window of bundle adjustment
+
+  // (map point id, rms patch error) of the points aligned by `alignToPrevFrameDirectly_` for curr_. Empty if not converged.
+  vector<std::pair<int, double>> direct_alignment_point_errors_;
 
   // Map
   Map::Ptr map_;
 
+  // Map points to be checked by `maintainMapPoints_`, in the order of change, by id and pool handle.
+  //    A point destroyed while in the queue is skipped by its stale handle, without a lookup in the map.
+  //    Map points are only owned by the tracking thread, so a point found by its handle is not destroyed while checked.
+  std::deque<std::pair<int, MapPoint::Handle>> map_points_to_check_;
+  std::unordered_set<int> map_points_in_queue_;
+
+  // Map points whose observations have changed, and need `callMapPointUpdate_`. Id -> pool handle.
+  std::unordered_map<int, MapPoint::Handle> map_points_to_update_;
+
+  // Update of map points' descriptors, norms and scale ranges from their observations.
+  //    Like BA, a job owns a copy of the observations, and its result is written back by `applyMapPointUpdate_`.
+  struct MapPointUpdateJob
+  {
+    struct Item
+    {
+      MapPoint::Handle handle;
+      cv::Point3f pos;
+      vector<cv::Mat> descriptors;       // of the observing keypoints
+      vector<cv::Point3f> cam_centers;   // of the observing keyframes
+      cv::Point3f ref_cam_center;        // of the oldest observing keyframe
+      int ref_octave;
+      cv::Mat descriptor, norm;          // Output
+      float min_distance, max_distance;  // Output
+    };
+    vector<Item> items;
+  };
+  std::shared_ptr<MapPointUpdateJob> map_point_update_job_ = nullptr;
+  std::future<void> map_point_update_future_;
+
+  // Memory of keyframes. See `manageKeyFrameMemory_`.
+  std::deque<Frame::Ptr> keyframes_with_image_;       // the latest keyframes, which still have their images
+  std::deque<Frame::Ptr> keyframes_with_descriptors_; // older keyframes whose descriptors are in memory, oldest first
+
+  // Deadline of each frame. See `setFrameDeadline`.
+  double frame_deadline_ms_;
+  std::chrono::steady_clock::time_point frame_start_time_; // when `addFrame` of curr_ started
+  std::deque<Frame::Ptr> keyframes_to_fuse_;              // keyframes whose fusion is deferred, oldest first
+  bool is_keyframe_culling_pending_ = false;
+
+  // Adaptive keypoint budget. See `adaptKeypointBudget_`.
+  int keypoint_budget_;       // Number of keypoints to extract from the next frame.
+  double frame_time_ms_ = 0;  // Moving average of the time of `addFrame`.
+
+  // Vocabulary of binary words. nullptr if `vocabulary_file` is not set in config.
+  geometry::Vocabulary::Ptr vocabulary_ = nullptr;
+
   // Map features
   vector<cv::KeyPoint> keypoints_curr_;
   cv::Mat descriptors_curr_;
@@ -73,6 +151,56 @@ private:
   vector<cv::Point3f> matched_pts_3d_in_map_;
   vector<int> matched_pts_2d_idx_;
 
+  // Bundle adjustment
+  //    A BA job owns a copy of the poses and points to optimize,
+  //    so it can run off the tracking thread, and its result is written back by `applyBundleAdjustmentResult_`.
+  struct BundleAdjustmentJob
+  {
+    vector<Frame::Ptr> frames;
+    vector<cv::Mat> poses; // T_w_c of each frame
+    vector<vector<cv::Point2f>> pts_2d;
+    vector<vector<int>> pts_2d_to_3d_idx;
+    std::unordered_map<int, cv::Point3f> pts_3d;
+    bool is_update_map_pts = true; // If false, points are fixed.
+
+    // For the sliding window BA.
+    //    Observations are only copied for the frames not yet in the window.
+    vector<bool> is_new_in_window;
+    vector<int> frame_ids_to_remove;
+    vector<int> pt_ids_to_remove;
+    std::unordered_map<int, cv::Point3f> fixed_pts_to_reset; // If points are fixed, their current positions in the map.
+
+    optimization::BASummary summary; // Output: iterations, cost, time, and why it stopped.
+    vector<std::pair<int, int>> outliers; // Output: (frame id, map point id) of the rejected observations.
+  };
+  std::shared_ptr<BundleAdjustmentJob> ba_job_ = nullptr;
+  std::future<void> ba_future_;
+  optimization::SlidingWindowBA::Ptr sliding_window_ba_ = nullptr; // Only accessed by the BA job.
+
+  // Relocalization
+  KeyFrameDatabase keyframe_database_; // BoW vectors of all keyframes. Only used with a vocabulary.
+  struct RelocalizationResult
+  {
+    Frame::Ptr keyframe = nullptr;
+    cv::Mat T_w_c;
+    vector<std::pair<int, int>> inliers; // (keypoint idx in curr_, map point id)
+  };
+
+  // Loop closing
+  //    Loops are detected by `loop_closing_` in its own thread.
+  //    Then, the Sim3 pose graph of all keyframes is optimized in a background job like BA.
+  struct LoopCorrectionJob
+  {
+    std::map<int, optimization::Sim3> S_c_w_before; // keyframe id -> pose when the job is created
+    std::map<int, optimization::Sim3> S_c_w;        // Output: optimized poses
+    vector<optimization::Sim3Edge> edges;
+    int fixed_id;
+  };
+  LoopClosing::Ptr loop_closing_ = nullptr;
+  vector<optimization::Sim3Edge> loop_edges_; // All verified loops, which are kept in later pose graphs.
+  std::shared_ptr<LoopCorrectionJob> loop_job_ = nullptr;
+  std::future<void> loop_future_;
+
   // Parameters
   const int kBuffSize_ = 20; // How much prev frames to store.
 
@@ -84,6 +212,12 @@ private: // functions
     if (frames_buff_.size() > kBuffSize_)
       frames_buff_.pop_front();
   }
+  void pushKeyFrameToBuff_(Frame::Ptr keyframe)
+  {
+    keyframes_buff_.push_back(keyframe);
+    if (keyframes_buff_.size() > kBuffSize_)
+      keyframes_buff_.pop_front();
+  }
 
   // Initialization
   void estimateMotionAnd3DPoints_();
@@ -97,20 +231,164 @@ private: // functions
 
 public: // ------------------------------- Tracking -------------------------------
   bool checkLargeMoveForAddKeyFrame_(Frame::Ptr curr, Frame::Ptr ref);
-  void optimizeMap_();
+
+  /* @brief Incremental map maintenance: check the map points in `map_points_to_check_`, and erase the bad ones.
+   *      Points are queued when they are created or their matched/visible statistics change,
+   *      so only recently changed points are checked. A point is bad if it has been visible at least
+   *      `map_point_min_visible_times`, but matched less than `map_point_min_match_ratio` of those times.
+   *      Points out of the current view are kept. Each call stops after `map_maintenance_max_points` points
+   *      or `map_maintenance_max_time_ms`, and the rest are left in the queue for later frames.
+   */
+  void maintainMapPoints_();
+  void queueMapPointCheck_(const MapPoint *pt)
+  {
+    if (map_points_in_queue_.insert(pt->id_).second)
+      map_points_to_check_.push_back(std::make_pair(pt->id_, pt->handle_));
+  }
+  // Match the ORB features of curr_ to the map points in view, and solve the pose by `solvePnPFromMatches_`.
   bool poseEstimationPnP_();
 
+  /* @brief KLT tracking of a non-keyframe, enabled by `is_enable_klt_tracking`.
+   *      The previous frame's observations of map points are tracked into curr_ by pyramidal Lucas-Kanade,
+   *      and become the keypoints of curr_, which are used by PnP directly. No ORB feature is extracted.
+   *      Return false, and leave curr_ without keypoints, if fewer than `klt_min_tracked_points` are tracked or
+   *      are PnP inliers, or if a keyframe is needed. Then the frame is tracked by ORB features as usual.
+   *      If `is_pose_predicted`, the points are projected by curr_'s pose as the initial flow.
+   */
+  bool trackByOpticalFlow_(bool is_pose_predicted = false);
+
+  /* @brief Sparse direct alignment of curr_ to prev_, enabled by `is_enable_direct_alignment`.
+   *      Patches around prev_'s observations of map points are aligned to curr_ photometrically, coarse-to-fine
+   *      on the KLT pyramids, which gives the pose of curr_ without features.
+   *      Return true if it converges, i.e., at least `direct_alignment_min_points` points are inside curr_,
+   *      and their error is within `direct_alignment_max_rms_error`. Then curr_->T_w_c_ is the aligned pose.
+   */
+  bool alignToPrevFrameDirectly_();
+
+  // Time since `addFrame` of curr_ started, and whether it's over the frame deadline.
+  double getFrameTimeMs_() const
+  {
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - frame_start_time_).count();
+  }
+  bool isOverFrameDeadline_() const { return frame_deadline_ms_ > 0 && getFrameTimeMs_() > frame_deadline_ms_; }
+
+  // Do the deferred fusion and culling of keyframes, until they are all done or the frame is over its deadline.
+  //    If too many keyframes are waiting, the oldest ones are fused anyway.
+  void runDeferredMapping_();
+
+  /* @brief After direct alignment, make curr_'s keypoints and observations from the projections of prev_'s map points.
+   *      Only the points whose patch error at the aligned pose is within `direct_alignment_max_point_error` are kept,
+   *      and their visible and matched times are increased. The matches are like KLT's: (index in the kept points, keypoint).
+   *      Return false, and leave curr_ without keypoints, if fewer than `direct_alignment_min_points` are kept.
+   */
+  bool observeMapPointsByProjection_();
+
+  /* @brief Adapt the number of keypoints to extract from the next frame, enabled by `is_adaptive_keypoint_budget`.
+   *      If the average frame time is over the frame deadline, the budget is lowered, to keep up with the video.
+   *      Else, it's raised if curr_ has fewer than `keypoint_budget_min_inliers` PnP inliers,
+   *      and lowered slowly if it has more than `keypoint_budget_healthy_inliers`, since fewer keypoints are enough.
+   *      When lost, the budget is the maximum for relocalization. It's always within [keypoint_budget_min, keypoint_budget_max].
+   */
+  void adaptKeypointBudget_(double frame_time_ms);
+
+  // PnP RANSAC and motion-only BA on curr_->matches_with_map_ (query: index in the candidates, train: keypoint in curr_).
+  //    The inliers are kept in the matches, and become the connections of curr_.
+  bool solvePnPFromMatches_(const vector<MapPoint *> &candidate_mappoints_in_map);
+
 public: // ------------------------------- Mapping -------------------------------
   void addKeyFrame_(Frame::Ptr keyframe);
+
+  /* @brief Bound the memory of keyframes. Called after a keyframe is inserted.
+   *      A keyframe keeps its image and scratch vectors only while it's one of the latest `num_keyframes_with_image`.
+   *      If the keyframes use more than `keyframe_memory_budget_mb`, and `is_spill_keyframes_to_disk`,
+   *      descriptors of the oldest keyframes are written to `keyframe_spill_folder` until it's within the budget.
+   *      They are read back when the keyframe is used again, e.g. by relocalization.
+   */
+  void manageKeyFrameMemory_(Frame::Ptr keyframe);
+
+  /* @brief Remove redundant keyframes in the local window, so the number of keyframes grows with the explored space, not time.
+   *      A keyframe is redundant if at least `keyframe_culling_redundant_ratio` of its map points
+   *      are observed by at least `keyframe_culling_min_observers` other keyframes in the window.
+   *      The newest keyframes, the reference keyframe, the first keyframe and keyframes of loops are kept.
+   *      A removed keyframe's observations go with it, and it's removed from the BA window and the BoW database.
+   */
+  void cullRedundantKeyFrames_();
   void pushCurrPointsToMap_();
+
+  /* @brief Fuse duplicated map points into the new keyframe.
+   *      Map points observed by the local keyframes in `keyframes_buff_`, but not by this keyframe,
+   *      are projected into it, and matched to the nearest keypoints
+   *      within `fusion_search_radius` pixels by descriptor distance.
+   *      If the keypoint has no map point, the point gets a new observation.
+   *      If it has another map point, the two are the same landmark: the one matched less often is merged into the other,
+   *      and all its observations by keyframes are moved to the kept one.
+   */
+  void fuseMapPoints_(Frame::Ptr keyframe);
+
+  // Add/erase an observation of a map point by a keyframe, and queue the point for `callMapPointUpdate_`.
+  void addObservation_(MapPoint *pt, int keyframe_id, int kpt_idx);
+  void eraseObservation_(MapPoint *pt, int keyframe_id);
+
+  /* @brief Recompute the representative descriptor, norm and scale range of the map points in `map_points_to_update_`,
+   *      in a background job. Only points whose observations have changed are updated, so the cost grows with
+   *      the new keyframes, not the map. If the previous job is still running, the points wait for the next call.
+   *      Descriptors of keyframes spilled to disk are skipped. Disabled by `is_update_map_point_descriptors`.
+   */
+  void callMapPointUpdate_();
+
+  // If the update job has finished, write its result back to the map points that still exist.
+  void applyMapPointUpdate_(bool is_wait = false);
+  // The candidates are raw pointers to avoid the refcount traffic. They are valid until the map is changed.
   void getMappointsInCurrentView_(
-      vector<MapPoint::Ptr> &candidate_mappoints_in_map,
+      vector<MapPoint *> &candidate_mappoints_in_map,
       vector<cv::Point2f> &candidate_mappoints_in_2d_image,
       cv::Mat &corresponding_mappoints_descriptors);
-  double getViewAngle_(Frame::Ptr frame, MapPoint::Ptr point);
+  double getViewAngle_(const Frame::Ptr &frame, const MapPoint *point);
 
 public: // ------------------------------- BundleAdjustment -------------------------------
+  // Run BA on the previous keyframes. If `is_ba_in_background`, it returns immediately.
   void callBundleAdjustment_();
+
+  // If the BA job has finished, write its result back to the frames and map points.
+  //    If `is_wait`, block until the job finishes.
+  void applyBundleAdjustmentResult_(bool is_wait = false);
+
+  /* @brief Offline refinement after the whole sequence has been processed:
+   *      BA over all keyframes in the map and all their map points, with the first keyframe fixed.
+   *      Settings are the `global_ba_*` keys in config, others are the same as the windowed BA.
+   *      It blocks until finished.
+   */
+  void globalBundleAdjustment();
+
+public: // ------------------------------- Relocalization -------------------------------
+  // Find the pose of curr_ by the candidate keyframes, which are tried in parallel.
+  //    If succeeded, curr_ has the pose and 2d-3d associations like a tracked frame, and ref_ is the best candidate.
+  bool relocalize_();
+
+private:
+  // PnP RANSAC against a keyframe's map points, and then a guided search by projecting them. Thread-safe.
+  RelocalizationResult relocalizeByKeyFrame_(Frame::Ptr keyframe, int min_matches, double search_radius,
+                                             int motion_only_ba_iters) const;
+
+public: // ------------------------------- Loop closing -------------------------------
+  // If a loop has been detected, start the pose graph optimization of all keyframes in background.
+  void callLoopCorrection_();
+
+  // If the pose graph optimization has finished, correct keyframes, map points and the previous frame.
+  //    It waits for the running BA, whose result is based on the poses before correction.
+  //    If not `is_wait`, it returns immediately when either job is still running.
+  void applyLoopCorrection_(bool is_wait = false);
+
+private:
+  static optimization::BAOptions getBAOptionsFromConfig_();
+  static cv::Mat getBAInformationMatrixFromConfig_();
+
+  // Append a frame's pose, and if `is_copy_observations`, its 2d-3d observations of existing map points to a BA job.
+  void addFrameToBundleAdjustmentJob_(BundleAdjustmentJob &job, Frame::Ptr frame, bool is_copy_observations);
+
+  // Solve a BA job by `optimization::bundleAdjustment`. It only touches the job's data, so it's thread-safe.
+  static void solveBundleAdjustmentJob_(BundleAdjustmentJob &job, const cv::Mat &information_matrix,
+                                        const optimization::BAOptions &options);
 };
 
 } // namespace vo
@@ -6,6 +6,7 @@
 
 #include "my_slam/common_include.h"
 #include "my_slam/basics/yaml.h"
+#include "my_slam/vo/map.h"
 
 namespace my_slam
 {
@@ -28,6 +29,36 @@ cv::Mat readCameraIntrinsics(const basics::Yaml &config, bool is_print_res = tru
 //      Numbers of each row: x, y, z, 1st row of R, 2nd row of R, 3rd row of R
 void writePoseToFile(const string filename, vector<cv::Mat> list_T);
 
+// Write colored points to a .ply file in ASCII format, which can be opened by PCL, MeshLab, etc.
+//      `colors` is in the order of RGB, the same as MapPoint::color_. It can be empty.
+void writePointCloudToFile(const string filename,
+                           const vector<cv::Point3f> &pts,
+                           const vector<vector<unsigned char>> &colors);
+
+/* @brief Write the map to a versioned binary file in a flat layout, which can be memory mapped:
+ *      A header of counts and section offsets, and then 8-byte aligned contiguous arrays of
+ *      keyframe records (id, pose, range of keypoints), keypoints, keyframe descriptors,
+ *      point ids, positions, normals, colors, descriptors, counters, scale invariance ranges,
+ *      and the observation lists of points, i.e. (keyframe index, keypoint index), indexed by per-point offsets.
+ *      All keyframes share one camera, whose intrinsics are in the header.
+ *      It throws if a keyframe's descriptors don't match its keypoints, or a point has no descriptor of the same size,
+ *      or if any section isn't written at its offset in the header.
+ * @param bow_key: VisualOdometry::getBoWKey of the vocabulary that computed the keyframes' BoW and feature vectors.
+ *      If it's not 0 and every keyframe has a BoW vector, they are also written, with the key in the header,
+ *      so that they don't need to be computed again when loaded for the same vocabulary.
+ */
+void saveMap(const string filename, const Map::Ptr &map, uint64_t bow_key = 0);
+
+/* @brief Load a map saved by `saveMap` by memory mapping the file.
+ *      Only descriptors are zero-copy: they point into the mapped memory, which is kept alive by the returned map.
+ *      Keypoints, poses, points and observations are still copied into a Frame or MapPoint each,
+ *      so loading is linear in the size of the map.
+ *      Keyframes have no image. Id factories of Frame and MapPoint are moved past the loaded ids.
+ *      BoW and feature vectors of keyframes are loaded if they were saved, and `Map::bow_key_` is set to their key.
+ *      It throws if the file is not a map, of another version, or if any section or index is out of range.
+ */
+Map::Ptr loadMap(const string filename);
+
 // Read pose from file
 //      Numbers of each row: x, y, z, 1st row of R, 2nd row of R, 3rd row of R
 vector<cv::Mat> readPoseFromFile(const string filename);
@@ -9,10 +9,13 @@
 #include <sstream>
 #include <iomanip>
 #include <unistd.h>
+#include <chrono>
+#include <thread>
 
 // cv
 #include <opencv2/core/core.hpp>
 #include <opencv2/highgui/highgui.hpp>
+#include <opencv2/imgproc/imgproc.hpp>
 #include <opencv2/features2d/features2d.hpp>
 
 // my
@@ -45,9 +48,15 @@ display::PclViewer::Ptr setUpPclDisplay();
 bool drawResultByPcl(basics::Yaml config_dataset,
                      const vo::VisualOdometry::Ptr vo,
                      vo::Frame::Ptr frame,
+                     int img_id,
                      display::PclViewer::Ptr pcl_displayer);
 void waitPclKeyPress(display::PclViewer::Ptr pcl_displayer);
 
+// Global BA over all keyframes, and then save the refined trajectory and map points.
+void refineByGlobalBundleAdjustment(vo::VisualOdometry::Ptr vo,
+                                    const vector<int> &frame_id_history,
+                                    const vector<cv::Mat> &cam_pose_history);
+
 // ========================================
 // =============== Settings ===============
 // ========================================
@@ -96,6 +105,23 @@ int main(int argc, char **argv)
     // Init a camera class to store K, and might be used to provide common transformations
     geometry::Camera::Ptr camera(new geometry::Camera(K));
 
+    // -- Reduced resolution: images are downsampled for processing, and the camera is scaled with them.
+    static const double processing_scale = basics::Config::get<double>("processing_scale");
+    static const bool is_refine_keyframes_at_full_resolution =
+        basics::Config::getBool("is_refine_keyframes_at_full_resolution");
+    if (processing_scale != 1.0)
+        camera = camera->scaled(processing_scale);
+
+    // -- ROI mask at the full resolution, e.g. to exclude the car's hood. It's resized with the first image.
+    static const string roi_mask_file = basics::Config::get<string>("roi_mask_file");
+    cv::Mat roi_mask;
+    if (!roi_mask_file.empty())
+    {
+        roi_mask = cv::imread(roi_mask_file, cv::IMREAD_GRAYSCALE);
+        if (roi_mask.data == nullptr)
+            throw std::runtime_error("run_vo.cpp::main: Failed to read the ROI mask " + roi_mask_file);
+    }
+
     // -- Prepare PCL and CV display
     display::PclViewer::Ptr pcl_displayer = setUpPclDisplay(); // PCL display
     cv::namedWindow(IMAGE_WINDOW_NAME, cv::WINDOW_AUTOSIZE);   // CV display
@@ -104,11 +130,43 @@ int main(int argc, char **argv)
     // -- Setup for vo
     vo::VisualOdometry::Ptr vo(new vo::VisualOdometry);
 
+    // -- Real-time mode: images arrive at a fixed rate, and a frame should be done before the next one arrives.
+    static const bool is_real_time_mode = basics::Config::getBool("is_real_time_mode");
+    static const double real_time_fps = basics::Config::get<double>("real_time_fps");
+    const double frame_period_ms = 1000.0 / real_time_fps;
+    if (is_real_time_mode && basics::Config::get<double>("frame_deadline_ms") <= 0)
+        vo->setFrameDeadline(frame_period_ms);
+    const auto t_start = std::chrono::steady_clock::now();
+    auto getTimeMs = [&t_start]() {
+        return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t_start).count();
+    };
+    int num_processed = 0, num_dropped = 0, num_deadline_misses = 0;
+    double sum_latency_ms = 0, max_latency_ms = 0;
+
     // -- Main loop: Iterate through images
     int max_num_imgs_to_proc = basics::Config::get<int>("max_num_imgs_to_proc");
+    const int num_imgs = std::min(max_num_imgs_to_proc, (int)image_paths.size());
     vector<cv::Mat> cam_pose_history;
-    for (int img_id = 0; img_id < std::min(max_num_imgs_to_proc, (int)image_paths.size()); img_id++)
+    vector<int> frame_id_history;
+    for (int img_id = 0; img_id < num_imgs; img_id++)
     {
+        // In real-time mode, process the newest image that has arrived, and drop the stale ones before it.
+        //      A dropped image keeps the latest pose in the trajectory, which is what a live user would get.
+        double arrival_time_ms = 0;
+        if (is_real_time_mode)
+        {
+            const int newest_img_id = std::min(num_imgs - 1, (int)(getTimeMs() / frame_period_ms));
+            for (; img_id < newest_img_id; img_id++)
+            {
+                num_dropped++;
+                cam_pose_history.push_back(cam_pose_history.empty() ? cv::Mat::eye(4, 4, CV_64F)
+                                                                    : cam_pose_history.back().clone());
+                frame_id_history.push_back(-1);
+            }
+            arrival_time_ms = img_id * frame_period_ms;
+            if (getTimeMs() < arrival_time_ms) // Ahead of the camera. Wait for the image.
+                std::this_thread::sleep_for(std::chrono::duration<double, std::milli>(arrival_time_ms - getTimeMs()));
+        }
 
         // Read image.
         cv::Mat rgb_img = cv::imread(image_paths[img_id]);
@@ -118,13 +176,37 @@ int main(int argc, char **argv)
             break;
         }
 
+        // Downsample for processing. The full resolution is only kept for refining keyframes' keypoints.
+        cv::Mat img = rgb_img;
+        if (processing_scale != 1.0)
+            cv::resize(rgb_img, img, cv::Size(), processing_scale, processing_scale, cv::INTER_AREA);
+        if (!roi_mask.empty() && roi_mask.size() != img.size())
+            cv::resize(roi_mask, roi_mask, img.size(), 0, 0, cv::INTER_NEAREST);
+
         // run vo
-        vo::Frame::Ptr frame = vo::Frame::createFrame(rgb_img, camera);
+        vo::Frame::Ptr frame = vo::Frame::createFrame(img, camera);
+        frame->mask_ = roi_mask; // shared by all frames
+        if (processing_scale != 1.0 && is_refine_keyframes_at_full_resolution)
+            frame->full_res_img_ = rgb_img; // Not copied. It's converted to gray only if the frame becomes a keyframe.
         vo->addFrame(frame); // This is the core of my VO !!!
 
+        // Latency from the arrival of the image to its pose
+        if (is_real_time_mode)
+        {
+            const double latency_ms = getTimeMs() - arrival_time_ms;
+            num_processed++;
+            sum_latency_ms += latency_ms;
+            max_latency_ms = std::max(max_latency_ms, latency_ms);
+            if (latency_ms > frame_period_ms)
+            {
+                num_deadline_misses++;
+                printf("Deadline miss: image %d took %.1f ms, over %.1f ms.\n", img_id, latency_ms, frame_period_ms);
+            }
+        }
+
         // Display
-        bool cv2_draw_good = drawResultByOpenCV(rgb_img, frame, vo);
-        bool pcl_draw_good = drawResultByPcl(config_dataset, vo, frame, pcl_displayer);
+        bool cv2_draw_good = drawResultByOpenCV(img, frame, vo);
+        bool pcl_draw_good = drawResultByPcl(config_dataset, vo, frame, img_id, pcl_displayer);
         static const bool is_pcl_wait_for_keypress = basics::Config::getBool("is_pcl_wait_for_keypress");
         if (is_pcl_wait_for_keypress)
             waitPclKeyPress(pcl_displayer);
@@ -138,15 +220,34 @@ int main(int argc, char **argv)
         // Return
         // cout << "Finished an image" << endl;
         cam_pose_history.push_back(frame->T_w_c_.clone());
+        frame_id_history.push_back(frame->id_);
         frame->clearNoUsed();
         // if (img_id == 10+3)
         //     break;
     }
 
+    if (is_real_time_mode && num_processed > 0)
+        printf("\nReal-time mode at %.1f fps: processed %d images, dropped %d, missed the deadline %d times. "
+               "Latency: mean %.1f ms, max %.1f ms.\n",
+               real_time_fps, num_processed, num_dropped, num_deadline_misses,
+               sum_latency_ms / num_processed, max_latency_ms);
+
     // Save camera trajectory
     const string save_predicted_traj_to = basics::Config::get<string>("save_predicted_traj_to");
     vo::writePoseToFile(save_predicted_traj_to, cam_pose_history);
 
+    // Offline refinement, and save the map for a later run. Not for a prebuilt map.
+    if (!vo->isLocalizationOnly())
+    {
+        static const bool is_run_global_ba = basics::Config::getBool("is_run_global_ba");
+        if (is_run_global_ba)
+            refineByGlobalBundleAdjustment(vo, frame_id_history, cam_pose_history);
+
+        static const string save_map_to = basics::Config::get<string>("save_map_to");
+        if (!save_map_to.empty())
+            vo::saveMap(save_map_to, vo->getMap(), vo->getBoWKey());
+    }
+
     // Wait for user close
     while (!pcl_displayer->isStopped())
         pcl_displayer->spinOnce(10);
@@ -190,7 +291,7 @@ bool drawResultByOpenCV(const cv::Mat &rgb_img, const vo::Frame::Ptr frame, cons
     static const string output_folder = basics::Config::get<string>("output_folder");
     bool first_time_vo_init = vo->isInitialized() && !is_vo_initialized_in_prev_frame;
 
-    if (img_id != 0 && // draw matches during initialization stage
+    if (img_id != 0 && !vo->isLocalizationOnly() && // draw matches during initialization stage
         (!vo->isInitialized() || first_time_vo_init))
     {
         drawMatches(vo->getPrevRef()->rgb_img_, vo->getPrevRef()->keypoints_, // keywords: feature matching / matched features
@@ -202,7 +303,7 @@ bool drawResultByOpenCV(const cv::Mat &rgb_img, const vo::Frame::Ptr frame, cons
     { // draw all & inlier keypoints in the current frame
         cv::Scalar color_g(0, 255, 0), color_b(255, 0, 0), color_r(0, 0, 255);
         vector<cv::KeyPoint> inliers_kpt;
-        if (!vo->isInitialized() || first_time_vo_init)
+        if (!vo->isLocalizationOnly() && (!vo->isInitialized() || first_time_vo_init))
         {
             for (auto &m : frame->matches_with_ref_)
                 inliers_kpt.push_back(frame->keypoints_[m.trainIdx]);
@@ -233,6 +334,7 @@ bool drawResultByOpenCV(const cv::Mat &rgb_img, const vo::Frame::Ptr frame, cons
 bool drawResultByPcl(basics::Yaml config_dataset,
                      const vo::VisualOdometry::Ptr vo,
                      vo::Frame::Ptr frame,
+                     int img_id,
                      display::PclViewer::Ptr pcl_displayer)
 {
 
@@ -244,12 +346,13 @@ bool drawResultByPcl(basics::Yaml config_dataset,
                                     vo->getMap()->hasKeyFrame(frame->id_)); // If it's keyframe, draw a red dot. Otherwise, white dot.
 
     // -- Update truth camera pose
+    // (Not in localization-only mode, where the frame ids don't start from 0, and the map has its own scale.)
     static const bool is_draw_true_traj = config_dataset.getBool("is_draw_true_traj");
-    if (is_draw_true_traj)
+    if (is_draw_true_traj && !vo->isLocalizationOnly())
     {
         static const string true_traj_filename = config_dataset.get<string>("true_traj_filename");
         static const vector<cv::Mat> truth_poses = vo::readPoseFromFile(true_traj_filename);
-        cv::Mat truth_T = truth_poses[frame->id_], truth_R_vec, truth_t;
+        cv::Mat truth_T = truth_poses[img_id], truth_R_vec, truth_t; // Not frame->id_, since images may be dropped.
         basics::getRtFromT(truth_T, truth_R_vec, truth_t);
 
         // Start drawing only when visual odometry has been initialized. (i.e. The first few frames are not drawn.)
@@ -321,3 +424,44 @@ void waitPclKeyPress(display::PclViewer::Ptr pcl_displayer)
         pcl_displayer->spinOnce(10);
     }
 }
+
+void refineByGlobalBundleAdjustment(vo::VisualOdometry::Ptr vo,
+                                    const vector<int> &frame_id_history,
+                                    const vector<cv::Mat> &cam_pose_history)
+{
+    static const string save_refined_traj_to = basics::Config::get<string>("save_refined_traj_to");
+    static const string save_refined_map_to = basics::Config::get<string>("save_refined_map_to");
+    const vo::Map::Ptr map = vo->getMap();
+
+    // -- Optimize. Keep the keyframe poses before it, to correct the other frames.
+    std::unordered_map<int, cv::Mat> keyframe_poses_before;
+    for (const auto &it : map->keyframes_)
+        keyframe_poses_before[it.first] = it.second->T_w_c_.clone();
+    vo->globalBundleAdjustment();
+
+    // -- Trajectory. A non-keyframe moves rigidly with its previous keyframe:
+    //      T_w_c_new = T_w_kf_new * T_w_kf_old^-1 * T_w_c_old
+    vector<cv::Mat> refined_poses;
+    cv::Mat T_correction = cv::Mat::eye(4, 4, CV_64F);
+    for (int i = 0; i < cam_pose_history.size(); i++)
+    {
+        const int frame_id = frame_id_history[i];
+        auto it = keyframe_poses_before.find(frame_id);
+        if (it != keyframe_poses_before.end())
+            T_correction = map->findKeyFrame(frame_id)->T_w_c_ * it->second.inv();
+        refined_poses.push_back(T_correction * cam_pose_history[i]);
+    }
+    vo::writePoseToFile(save_refined_traj_to, refined_poses);
+
+    // -- Map points
+    vector<cv::Point3f> vec_pos;
+    vector<vector<unsigned char>> vec_color;
+    for (const auto &it : map->map_points_)
+    {
+        vec_pos.push_back(it.second->pos_);
+        vec_color.push_back(it.second->color_);
+    }
+    vo::writePointCloudToFile(save_refined_map_to, vec_pos, vec_color);
+    printf("Refined trajectory is saved to %s, and map points are saved to %s\n",
+           save_refined_traj_to.c_str(), save_refined_map_to.c_str());
+}
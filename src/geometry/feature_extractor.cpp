@@ -0,0 +1,324 @@
+
+#include "my_slam/geometry/feature_extractor.h"
+
+#include <opencv2/imgproc/imgproc.hpp>
+
+#include <queue>
+#include <tuple>
+
+namespace my_slam
+{
+namespace geometry
+{
+
+namespace
+{
+struct QuadtreeNode
+{
+    float x0, y0, x1, y1;
+    int depth;
+    vector<int> kpts; // indices of the keypoints inside
+};
+} // namespace
+
+vector<cv::KeyPoint> distributeKeypointsByQuadtree(const vector<cv::KeyPoint> &keypoints,
+                                                   const cv::Rect &area, int num_wanted)
+{
+    constexpr float kMinNodeSize = 1.0; // pixel. The keypoints of a smaller node are at the same place.
+    if (num_wanted <= 0)
+        return vector<cv::KeyPoint>();
+    if (keypoints.size() <= num_wanted)
+        return keypoints;
+
+    // -- Roots: a row of roughly square nodes over the area
+    vector<QuadtreeNode> nodes;
+    const int num_roots = std::max(1, cvRound((double)area.width / std::max(1, area.height)));
+    const float root_width = (float)area.width / num_roots;
+    for (int i = 0; i < num_roots; i++)
+        nodes.push_back(QuadtreeNode{area.x + i * root_width, (float)area.y,
+                                     area.x + (i + 1) * root_width, (float)(area.y + area.height), 0, vector<int>()});
+    for (int i = 0; i < keypoints.size(); i++)
+    {
+        const int root = std::min(num_roots - 1, std::max(0, (int)((keypoints[i].pt.x - area.x) / root_width)));
+        nodes[root].kpts.push_back(i);
+    }
+
+    // -- Split nodes level by level, and the ones with more keypoints first in a level,
+    //      until there are enough non-empty nodes. So a sparse area gets its nodes before a dense area is split finely.
+    typedef std::tuple<int, int, int> Priority; // (-depth, number of keypoints, node index)
+    std::priority_queue<Priority> splittable;
+    int num_leaves = 0;
+    for (int i = 0; i < nodes.size(); i++)
+    {
+        num_leaves += !nodes[i].kpts.empty();
+        if (nodes[i].kpts.size() > 1)
+            splittable.push(Priority(0, nodes[i].kpts.size(), i));
+    }
+    while (num_leaves < num_wanted && !splittable.empty())
+    {
+        const int idx = std::get<2>(splittable.top());
+        splittable.pop();
+        if (nodes[idx].x1 - nodes[idx].x0 < 2 * kMinNodeSize && nodes[idx].y1 - nodes[idx].y0 < 2 * kMinNodeSize)
+            continue; // Can't split any more. It stays a leaf.
+        const QuadtreeNode parent = std::move(nodes[idx]);
+        nodes[idx].kpts.clear();
+        const float xm = (parent.x0 + parent.x1) / 2, ym = (parent.y0 + parent.y1) / 2;
+        const int depth = parent.depth + 1;
+        QuadtreeNode children[4] = {{parent.x0, parent.y0, xm, ym, depth, vector<int>()},
+                                    {xm, parent.y0, parent.x1, ym, depth, vector<int>()},
+                                    {parent.x0, ym, xm, parent.y1, depth, vector<int>()},
+                                    {xm, ym, parent.x1, parent.y1, depth, vector<int>()}};
+        for (int i : parent.kpts)
+            children[(keypoints[i].pt.x >= xm) + 2 * (keypoints[i].pt.y >= ym)].kpts.push_back(i);
+        num_leaves--;
+        for (QuadtreeNode &child : children)
+        {
+            if (child.kpts.empty())
+                continue;
+            num_leaves++;
+            if (child.kpts.size() > 1)
+                splittable.push(Priority(-depth, child.kpts.size(), nodes.size()));
+            nodes.push_back(std::move(child));
+        }
+    }
+
+    // -- The strongest keypoint of each leaf. The last split may give up to 3 more than wanted.
+    vector<cv::KeyPoint> selected;
+    for (const QuadtreeNode &node : nodes)
+    {
+        if (node.kpts.empty())
+            continue;
+        int best = node.kpts[0];
+        for (int i : node.kpts)
+            if (keypoints[i].response > keypoints[best].response)
+                best = i;
+        selected.push_back(keypoints[best]);
+    }
+    if (selected.size() > num_wanted)
+    {
+        std::nth_element(selected.begin(), selected.begin() + num_wanted, selected.end(),
+                         [](const cv::KeyPoint &k1, const cv::KeyPoint &k2) { return k1.response > k2.response; });
+        selected.resize(num_wanted);
+    }
+    return selected;
+}
+
+constexpr int GridFastExtractor::kBorder;
+constexpr int GridFastExtractor::kPatchSize;
+
+GridFastExtractor::GridFastExtractor(int num_keypoints, double scale_factor, int num_levels,
+                                     int cell_size, int init_threshold, int min_threshold, int max_threshold)
+    : num_keypoints_(num_keypoints), scale_factor_(scale_factor), num_levels_(num_levels),
+      cell_size_(cell_size), init_threshold_(init_threshold), min_threshold_(min_threshold), max_threshold_(max_threshold)
+{
+    if (num_levels_ < 1 || cell_size_ < 1 || min_threshold_ > max_threshold_)
+        throw std::runtime_error("feature_extractor.cpp::GridFastExtractor: invalid arguments.");
+
+    // The circular patch for the orientation, the same as cv::ORB.
+    const int half_patch = kPatchSize / 2;
+    umax_.resize(half_patch + 2);
+    const int vmax = cvFloor(half_patch * std::sqrt(2.f) / 2 + 1);
+    const int vmin = cvCeil(half_patch * std::sqrt(2.f) / 2);
+    for (int v = 0; v <= vmax; ++v)
+        umax_[v] = cvRound(std::sqrt((double)half_patch * half_patch - v * v));
+    for (int v = half_patch, v0 = 0; v >= vmin; --v) // Make it symmetric.
+    {
+        while (umax_[v0] == umax_[v0 + 1])
+            ++v0;
+        umax_[v] = v0;
+        ++v0;
+    }
+}
+
+void GridFastExtractor::setNumKeypoints(int num_keypoints)
+{
+    if (num_keypoints == num_keypoints_)
+        return;
+    num_keypoints_ = num_keypoints;
+    if (!cells_.empty())
+        computeShares_();
+}
+
+void GridFastExtractor::resetGrid_(const cv::Size &image_size)
+{
+    image_size_ = image_size;
+    scales_.assign(num_levels_, 1.0);
+    cells_.assign(num_levels_, vector<cv::Rect>());
+    thresholds_.assign(num_levels_, vector<int>());
+    for (int level = 0; level < num_levels_; level++)
+    {
+        scales_[level] = std::pow(scale_factor_, level);
+        const int width = cvRound(image_size.width / scales_[level]) - 2 * kBorder;
+        const int height = cvRound(image_size.height / scales_[level]) - 2 * kBorder;
+        if (width < cell_size_ / 2 || height < cell_size_ / 2)
+            continue; // too small to detect anything
+
+        // Split the area inside the border evenly
+        const int cols = std::max(1, cvRound((double)width / cell_size_));
+        const int rows = std::max(1, cvRound((double)height / cell_size_));
+        for (int r = 0; r < rows; r++)
+            for (int c = 0; c < cols; c++)
+            {
+                const int x0 = kBorder + width * c / cols, x1 = kBorder + width * (c + 1) / cols;
+                const int y0 = kBorder + height * r / rows, y1 = kBorder + height * (r + 1) / rows;
+                cells_[level].push_back(cv::Rect(x0, y0, x1 - x0, y1 - y0));
+            }
+        thresholds_[level].assign(cells_[level].size(), init_threshold_);
+    }
+    computeShares_();
+}
+
+void GridFastExtractor::computeShares_()
+{
+    num_keypoints_per_level_.assign(num_levels_, 0);
+
+    // The share of each level, the same as cv::ORB
+    const double factor = 1.0 / scale_factor_;
+    double num_at_level = num_keypoints_ * (1 - factor) / (1 - std::pow(factor, num_levels_));
+    for (int level = 0; level < num_levels_; level++, num_at_level *= factor)
+    {
+        if (cells_[level].empty())
+            continue;
+        num_keypoints_per_level_[level] = cvRound(num_at_level);
+    }
+}
+
+void GridFastExtractor::detect(const cv::Mat &image, vector<cv::KeyPoint> &keypoints, const cv::Mat &mask)
+{
+    keypoints.clear();
+    if (image.empty())
+        return;
+    if (image.size() != image_size_)
+        resetGrid_(image.size());
+
+    // -- Pyramid of the gray image
+    cv::Mat level_img;
+    if (image.channels() == 3)
+        cv::cvtColor(image, level_img, cv::COLOR_BGR2GRAY);
+    else
+        level_img = image;
+
+    for (int level = 0; level < num_levels_; level++)
+    {
+        if (level > 0)
+        {
+            const cv::Size size(cvRound(image.cols / scales_[level]), cvRound(image.rows / scales_[level]));
+            cv::resize(level_img, level_img, size, 0, 0, cv::INTER_LINEAR);
+        }
+        if (cells_[level].empty())
+            continue;
+
+        // -- Cells inside the mask, which share the level's number. Their shares are rounded up.
+        const double scale = scales_[level];
+        vector<int> active_cells;
+        for (int i = 0; i < cells_[level].size(); i++)
+        {
+            const cv::Rect &cell = cells_[level][i];
+            if (!mask.empty())
+            {
+                const cv::Rect cell_at_level_0 = cv::Rect(cvFloor(cell.x * scale), cvFloor(cell.y * scale),
+                                                          cvCeil(cell.width * scale), cvCeil(cell.height * scale)) &
+                                                 cv::Rect(0, 0, mask.cols, mask.rows);
+                if (cell_at_level_0.area() == 0 || cv::countNonZero(mask(cell_at_level_0)) == 0)
+                    continue;
+            }
+            active_cells.push_back(i);
+        }
+        if (active_cells.empty())
+            continue;
+        const int num_keypoints_per_cell = std::ceil((double)num_keypoints_per_level_[level] / active_cells.size());
+
+        // -- Detect in each cell by its own threshold, and keep its strongest ones.
+        vector<cv::KeyPoint> level_keypoints, cell_keypoints;
+        for (int i : active_cells)
+        {
+            detectInCell_(level_img, cells_[level][i], num_keypoints_per_cell, thresholds_[level][i], cell_keypoints);
+            for (const cv::KeyPoint &kpt : cell_keypoints)
+                if (mask.empty() || mask.at<uchar>(std::min(mask.rows - 1, cvRound(kpt.pt.y * scale)),
+                                                   std::min(mask.cols - 1, cvRound(kpt.pt.x * scale))))
+                    level_keypoints.push_back(kpt);
+        }
+
+        // -- The cells' shares are rounded up. Select the level's share, spread over the level.
+        const cv::Rect level_area(kBorder, kBorder, level_img.cols - 2 * kBorder, level_img.rows - 2 * kBorder);
+        level_keypoints = distributeKeypointsByQuadtree(level_keypoints, level_area, num_keypoints_per_level_[level]);
+
+        // -- Orientation, and the coordinates and size at level 0, the same as cv::ORB
+        for (cv::KeyPoint &kpt : level_keypoints)
+        {
+            kpt.angle = computeAngle_(level_img, kpt.pt);
+            kpt.pt *= scale;
+            kpt.size = kPatchSize * scale;
+            kpt.octave = level;
+            keypoints.push_back(kpt);
+        }
+    }
+}
+
+void GridFastExtractor::detectInCell_(const cv::Mat &level_img, const cv::Rect &cell, int num_wanted, int &threshold,
+                                      vector<cv::KeyPoint> &keypoints) const
+{
+    constexpr int kFastRadius = 3;    // FAST doesn't detect within 3 pixels of the image border.
+    constexpr int kTooManyRatio = 4;  // Raise the threshold if a cell detects this many times of what it wants.
+    const cv::Rect roi(cell.x - kFastRadius, cell.y - kFastRadius,
+                       cell.width + 2 * kFastRadius, cell.height + 2 * kFastRadius);
+    const cv::Mat cell_img = level_img(roi);
+
+    keypoints.clear();
+    cv::FAST(cell_img, keypoints, threshold, true);
+    const int num_detected = keypoints.size();
+
+    // -- Adapt the threshold for the next image: about one step of 25% per image.
+    const int step = std::max(1, threshold / 4);
+    const int last_threshold = threshold;
+    if (num_detected < num_wanted)
+        threshold = std::max(min_threshold_, threshold - step);
+    else if (num_detected > kTooManyRatio * num_wanted)
+        threshold = std::min(max_threshold_, threshold + step);
+
+    // -- Too few in this image. Try again with the lowest threshold, e.g. when the scene just changed.
+    if (num_detected < num_wanted && last_threshold > min_threshold_)
+    {
+        keypoints.clear();
+        cv::FAST(cell_img, keypoints, min_threshold_, true);
+    }
+
+    // -- Keep the strongest ones, in the level's coordinates.
+    if (keypoints.size() > num_wanted)
+    {
+        std::nth_element(keypoints.begin(), keypoints.begin() + num_wanted, keypoints.end(),
+                         [](const cv::KeyPoint &k1, const cv::KeyPoint &k2) { return k1.response > k2.response; });
+        keypoints.resize(num_wanted);
+    }
+    for (cv::KeyPoint &kpt : keypoints)
+    {
+        kpt.pt.x += roi.x;
+        kpt.pt.y += roi.y;
+    }
+}
+
+float GridFastExtractor::computeAngle_(const cv::Mat &level_img, const cv::Point2f &pt) const
+{
+    const int half_patch = kPatchSize / 2;
+    const uchar *center = &level_img.at<uchar>(cvRound(pt.y), cvRound(pt.x));
+    const int step = level_img.step1();
+    int m_01 = 0, m_10 = 0;
+    for (int u = -half_patch; u <= half_patch; ++u) // the center row
+        m_10 += u * center[u];
+    for (int v = 1; v <= half_patch; ++v) // two rows at a time
+    {
+        int v_sum = 0;
+        const int d = umax_[v];
+        for (int u = -d; u <= d; ++u)
+        {
+            const int val_plus = center[u + v * step], val_minus = center[u - v * step];
+            v_sum += (val_plus - val_minus);
+            m_10 += u * (val_plus + val_minus);
+        }
+        m_01 += v * v_sum;
+    }
+    return cv::fastAtan2((float)m_01, (float)m_10);
+}
+
+} // namespace geometry
+} // namespace my_slam
@@ -1,8 +1,12 @@
 
 #include "my_slam/geometry/feature_match.h"
+#include "my_slam/geometry/feature_extractor.h"
 #include "my_slam/basics/opencv_funcs.h"
 #include "my_slam/basics/config.h"
 
+#include <limits>
+#include <cmath>
+
 namespace my_slam
 {
 namespace geometry
@@ -10,13 +14,31 @@ namespace geometry
 
 void calcKeyPoints(
     const cv::Mat &image,
-    vector<cv::KeyPoint> &keypoints)
+    vector<cv::KeyPoint> &keypoints,
+    int num_keypoints_wanted,
+    const cv::Mat &mask)
 {
     // -- Set arguments
     static const int num_keypoints = basics::Config::get<int>("number_of_keypoints_to_extract");
     static const double scale_factor = basics::Config::get<double>("scale_factor");
     static const int level_pyramid = basics::Config::get<int>("level_pyramid");
     static const int score_threshold = basics::Config::get<int>("score_threshold");
+    static const bool is_use_adaptive_fast_extractor = basics::Config::getBool("is_use_adaptive_fast_extractor");
+
+    // -- Extract only the needed number, by adaptive FAST thresholds on a grid.
+    //      The thresholds are adapted from one image to the next one.
+    if (is_use_adaptive_fast_extractor)
+    {
+        static const int max_num_keypoints = basics::Config::get<int>("max_number_of_keypoints");
+        static const int cell_size = basics::Config::get<int>("adaptive_fast_cell_size");
+        static const int min_threshold = basics::Config::get<int>("adaptive_fast_min_threshold");
+        static const int max_threshold = basics::Config::get<int>("adaptive_fast_max_threshold");
+        static GridFastExtractor extractor(max_num_keypoints, scale_factor, level_pyramid,
+                                           cell_size, score_threshold, min_threshold, max_threshold);
+        extractor.setNumKeypoints(num_keypoints_wanted > 0 ? num_keypoints_wanted : max_num_keypoints);
+        extractor.detect(image, keypoints, mask);
+        return;
+    }
 
     // -- Create ORB
     static cv::Ptr<cv::ORB> orb = cv::ORB::create(num_keypoints, scale_factor, level_pyramid,
@@ -31,8 +53,8 @@ void calcKeyPoints(
     //          int 	fastThreshold = 20
 
     // compute
-    orb->detect(image, keypoints);
-    selectUniformKptsByGrid(keypoints, image.rows, image.cols);
+    orb->detect(image, keypoints, mask);
+    selectUniformKptsByQuadtree(keypoints, image.rows, image.cols, num_keypoints_wanted);
 }
 
 void calcDescriptors(
@@ -48,39 +70,40 @@ void calcDescriptors(
     orb->compute(image, keypoints, descriptors);
 }
 
-void selectUniformKptsByGrid(
+void selectUniformKptsByQuadtree(
     vector<cv::KeyPoint> &keypoints,
-    int image_rows, int image_cols)
+    int image_rows, int image_cols,
+    int num_keypoints_wanted)
 {
     // -- Set arguments
-    static const int max_num_keypoints = basics::Config::get<int>("max_number_of_keypoints");
-    static const int kpts_uniform_selection_grid_size = basics::Config::get<int>("kpts_uniform_selection_grid_size");
-    static const int kpts_uniform_selection_max_pts_per_grid = basics::Config::get<int>("kpts_uniform_selection_max_pts_per_grid");
-    static const int rows = image_rows / kpts_uniform_selection_grid_size, cols = image_cols / kpts_uniform_selection_grid_size;
-
-    // Create an empty grid
-    static vector<vector<int>> grid(rows, vector<int>(cols, 0));
-    for (auto &row : grid) //clear grid
-        std::fill(row.begin(), row.end(), 0);
-
-    // Insert keypoints to grid. If not full, insert this cv::KeyPoint to result
-    vector<cv::KeyPoint> tmp_keypoints;
-    int cnt = 0;
-    for (auto &kpt : keypoints)
+    static const int max_number_of_keypoints = basics::Config::get<int>("max_number_of_keypoints");
+    const int max_num_keypoints = num_keypoints_wanted > 0 ? num_keypoints_wanted : max_number_of_keypoints;
+    static const double scale_factor = basics::Config::get<double>("scale_factor");
+    static const int level_pyramid = basics::Config::get<int>("level_pyramid");
+
+    // -- Group keypoints by pyramid level
+    int num_levels = level_pyramid;
+    for (const cv::KeyPoint &kpt : keypoints)
+        num_levels = std::max(num_levels, kpt.octave + 1);
+    vector<vector<cv::KeyPoint>> kpts_of_levels(num_levels);
+    for (const cv::KeyPoint &kpt : keypoints)
+        kpts_of_levels[std::max(0, kpt.octave)].push_back(kpt);
+
+    // -- Select the share of each level, the same as cv::ORB's. What a level can't use goes to the next level.
+    const double factor = 1.0 / scale_factor;
+    double share = max_num_keypoints * (1 - factor) / (1 - std::pow(factor, num_levels));
+    int num_left = max_num_keypoints;
+    double num_carried = 0;
+    keypoints.clear();
+    for (int level = 0; level < num_levels && num_left > 0; level++, share *= factor)
     {
-        int row = ((int)kpt.pt.y) / kpts_uniform_selection_grid_size, col = ((int)kpt.pt.x) / kpts_uniform_selection_grid_size;
-        if (grid[row][col] < kpts_uniform_selection_max_pts_per_grid)
-        {
-            tmp_keypoints.push_back(kpt);
-            grid[row][col]++;
-            cnt++;
-            if (cnt > max_num_keypoints)
-                break;
-        }
+        const int num_wanted = level == num_levels - 1 ? num_left : std::min<int>(num_left, cvRound(share + num_carried));
+        const vector<cv::KeyPoint> selected = distributeKeypointsByQuadtree(
+            kpts_of_levels[level], cv::Rect(0, 0, image_cols, image_rows), num_wanted);
+        keypoints.insert(keypoints.end(), selected.begin(), selected.end());
+        num_carried = share + num_carried - selected.size();
+        num_left -= selected.size();
     }
-
-    // return
-    keypoints = tmp_keypoints;
 }
 
 vector<cv::DMatch> matchByRadiusAndBruteForce(
@@ -238,6 +261,59 @@ void matchFeatures(
     }
 }
 
+void matchFeaturesByBoW(
+    const cv::Mat1b &descriptors_1, const FeatureVector &feat_vec_1,
+    const cv::Mat1b &descriptors_2, const FeatureVector &feat_vec_2,
+    vector<cv::DMatch> &matches,
+    float ratio, int max_distance)
+{
+    std::unordered_map<int, cv::DMatch> best_match_of_2; // idx in 2 -> its best match
+    auto it1 = feat_vec_1.begin(), it2 = feat_vec_2.begin();
+    while (it1 != feat_vec_1.end() && it2 != feat_vec_2.end())
+    {
+        if (it1->first < it2->first)
+        {
+            it1++;
+            continue;
+        }
+        if (it2->first < it1->first)
+        {
+            it2++;
+            continue;
+        }
+
+        // Same node
+        for (int i : it1->second)
+        {
+            int best_idx = -1, best_dist = std::numeric_limits<int>::max(), second_best_dist = best_dist;
+            for (int j : it2->second)
+            {
+                const int dist = cv::norm(descriptors_1.row(i), descriptors_2.row(j), cv::NORM_HAMMING);
+                if (dist < best_dist)
+                {
+                    second_best_dist = best_dist;
+                    best_dist = dist;
+                    best_idx = j;
+                }
+                else if (dist < second_best_dist)
+                    second_best_dist = dist;
+            }
+            if (best_idx < 0 || best_dist > max_distance || best_dist >= ratio * second_best_dist)
+                continue;
+            auto it_best = best_match_of_2.find(best_idx);
+            if (it_best == best_match_of_2.end() || best_dist < it_best->second.distance)
+                best_match_of_2[best_idx] = cv::DMatch(i, best_idx, static_cast<float>(best_dist));
+        }
+        it1++, it2++;
+    }
+
+    matches.clear();
+    for (const auto &it : best_match_of_2)
+        matches.push_back(it.second);
+    std::sort(matches.begin(), matches.end(),
+              [](const cv::DMatch &m1, const cv::DMatch &m2) { return m1.queryIdx < m2.queryIdx; });
+}
+
 void removeDuplicatedMatches(vector<cv::DMatch> &matches)
 {
     // Sort res by "trainIdx".
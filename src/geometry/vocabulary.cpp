@@ -0,0 +1,348 @@
+#include "my_slam/geometry/vocabulary.h"
+
+#include <fstream>
+#include <random>
+#include <cstring>
+#include <cstdint>
+#include <limits>
+
+namespace my_slam
+{
+namespace geometry
+{
+
+namespace
+{
+const char kMagic[8] = {'M', 'Y', 'S', 'L', 'A', 'M', 'V', 'C'};
+const uint32_t kVersion = 1;
+
+inline int hammingDistance(const cv::Mat &d1, const cv::Mat &d2)
+{
+    return cv::norm(d1, d2, cv::NORM_HAMMING);
+}
+
+// Bitwise majority of the descriptors. It's the "mean" of binary descriptors.
+cv::Mat majorityDescriptor(const vector<cv::Mat> &descriptors, const vector<int> &indices)
+{
+    const int num_bytes = descriptors[indices[0]].cols;
+    vector<int> counts(num_bytes * 8, 0);
+    for (int idx : indices)
+    {
+        const uchar *p = descriptors[idx].ptr<uchar>();
+        for (int b = 0; b < num_bytes; b++)
+            for (int bit = 0; bit < 8; bit++)
+                counts[b * 8 + bit] += (p[b] >> (7 - bit)) & 1;
+    }
+    cv::Mat center = cv::Mat::zeros(1, num_bytes, CV_8U);
+    uchar *q = center.ptr<uchar>();
+    for (int b = 0; b < num_bytes; b++)
+        for (int bit = 0; bit < 8; bit++)
+            if (2 * counts[b * 8 + bit] > (int)indices.size())
+                q[b] |= 1 << (7 - bit);
+    return center;
+}
+} // namespace
+
+Vocabulary::Vocabulary(int branching, int depth) : branching_(branching), depth_(depth)
+{
+    if (branching_ < 2 || depth_ < 1)
+        throw std::runtime_error("vocabulary.cpp::Vocabulary: branching should be >= 2, and depth >= 1.");
+}
+
+void Vocabulary::create(const vector<cv::Mat> &training_descriptors)
+{
+    vector<cv::Mat> descriptors;
+    for (const cv::Mat &image_descriptors : training_descriptors)
+        for (int i = 0; i < image_descriptors.rows; i++)
+            descriptors.push_back(image_descriptors.row(i));
+    if (descriptors.empty())
+        throw std::runtime_error("vocabulary.cpp::create: no training descriptors.");
+
+    nodes_.clear();
+    nodes_.push_back(Node{-1, {}, cv::Mat::zeros(1, descriptors[0].cols, CV_8U), 0.0, -1});
+    buildTree_(0, descriptors, 0);
+    computeWords_();
+    computeWeights_(training_descriptors);
+}
+
+void Vocabulary::buildTree_(int node_id, const vector<cv::Mat> &descriptors, int level)
+{
+    if (level >= depth_ || descriptors.size() <= 1)
+        return;
+
+    // Few descriptors: each one is a child
+    vector<vector<int>> clusters;
+    vector<cv::Mat> centers;
+    if (descriptors.size() <= branching_)
+    {
+        for (int i = 0; i < descriptors.size(); i++)
+        {
+            clusters.push_back(vector<int>{i});
+            centers.push_back(descriptors[i]);
+        }
+    }
+    else
+    {
+        // k-means++ seeding
+        std::mt19937 rng(node_id);
+        centers.push_back(descriptors[std::uniform_int_distribution<int>(0, descriptors.size() - 1)(rng)]);
+        vector<double> min_dists(descriptors.size(), std::numeric_limits<double>::max());
+        while (centers.size() < branching_)
+        {
+            for (int i = 0; i < descriptors.size(); i++)
+            {
+                const double d = hammingDistance(descriptors[i], centers.back());
+                min_dists[i] = std::min(min_dists[i], d * d);
+            }
+            if (*std::max_element(min_dists.begin(), min_dists.end()) == 0)
+                break; // All descriptors are the same as the centers.
+            std::discrete_distribution<int> weighted(min_dists.begin(), min_dists.end());
+            centers.push_back(descriptors[weighted(rng)]);
+        }
+
+        // k-means with bitwise majority as the center
+        constexpr int kMaxIters = 20;
+        vector<int> assignments(descriptors.size(), -1);
+        for (int iter = 0; iter < kMaxIters; iter++)
+        {
+            bool is_changed = false;
+            for (int i = 0; i < descriptors.size(); i++)
+            {
+                int best = 0, best_dist = std::numeric_limits<int>::max();
+                for (int c = 0; c < centers.size(); c++)
+                {
+                    const int d = hammingDistance(descriptors[i], centers[c]);
+                    if (d < best_dist)
+                        best = c, best_dist = d;
+                }
+                is_changed |= assignments[i] != best;
+                assignments[i] = best;
+            }
+            clusters.assign(centers.size(), vector<int>());
+            for (int i = 0; i < descriptors.size(); i++)
+                clusters[assignments[i]].push_back(i);
+            if (!is_changed)
+                break;
+            for (int c = 0; c < centers.size(); c++)
+                if (!clusters[c].empty())
+                    centers[c] = majorityDescriptor(descriptors, clusters[c]);
+        }
+    }
+
+    // Create children, and split them further
+    for (int c = 0; c < clusters.size(); c++)
+    {
+        if (clusters[c].empty())
+            continue;
+        const int child_id = nodes_.size();
+        nodes_.push_back(Node{node_id, {}, centers[c].clone(), 0.0, -1});
+        nodes_[node_id].children.push_back(child_id);
+
+        vector<cv::Mat> child_descriptors;
+        for (int i : clusters[c])
+            child_descriptors.push_back(descriptors[i]);
+        buildTree_(child_id, child_descriptors, level + 1);
+    }
+}
+
+void Vocabulary::computeWords_()
+{
+    words_.clear();
+    for (int i = 1; i < nodes_.size(); i++)
+    {
+        nodes_[i].word_id = -1;
+        if (nodes_[i].children.empty())
+        {
+            nodes_[i].word_id = words_.size();
+            words_.push_back(i);
+        }
+    }
+}
+
+void Vocabulary::computeWeights_(const vector<cv::Mat> &training_descriptors)
+{
+    // idf = log(N / Ni), where Ni is the number of images containing the word.
+    vector<int> num_images_of_word(words_.size(), 0);
+    for (const cv::Mat &image_descriptors : training_descriptors)
+    {
+        std::set<int> words_in_image;
+        int node_id;
+        for (int i = 0; i < image_descriptors.rows; i++)
+            words_in_image.insert(findWord_(image_descriptors.row(i), 0, node_id));
+        for (int word_id : words_in_image)
+            num_images_of_word[word_id]++;
+    }
+    const double N = training_descriptors.size();
+    for (int w = 0; w < words_.size(); w++)
+        nodes_[words_[w]].weight = num_images_of_word[w] > 0 ? log(N / num_images_of_word[w]) : 0.0;
+}
+
+int Vocabulary::findWord_(const cv::Mat &descriptor, int node_level, int &node_id) const
+{
+    int id = 0, level = 0;
+    node_id = 0;
+    while (!nodes_[id].children.empty())
+    {
+        int best = nodes_[id].children[0], best_dist = std::numeric_limits<int>::max();
+        for (int child : nodes_[id].children)
+        {
+            const int d = hammingDistance(descriptor, nodes_[child].descriptor);
+            if (d < best_dist)
+                best = child, best_dist = d;
+        }
+        id = best;
+        level++;
+        if (level <= node_level)
+            node_id = id;
+    }
+    return nodes_[id].word_id;
+}
+
+void Vocabulary::transform(const cv::Mat &descriptors, BowVector &bow_vec, FeatureVector &feat_vec, int levels_up) const
+{
+    bow_vec.clear();
+    feat_vec.clear();
+    if (empty())
+        throw std::runtime_error("vocabulary.cpp::transform: the vocabulary is empty.");
+
+    const int node_level = std::max(1, depth_ - levels_up);
+    for (int i = 0; i < descriptors.rows; i++)
+    {
+        int node_id;
+        const int word_id = findWord_(descriptors.row(i), node_level, node_id);
+        const double weight = nodes_[words_[word_id]].weight;
+        if (weight > 0) // Words in all training images are useless.
+        {
+            bow_vec[word_id] += weight; // tf * idf, where tf is normalized below
+            feat_vec[node_id].push_back(i);
+        }
+    }
+
+    double sum = 0;
+    for (const auto &it : bow_vec)
+        sum += it.second;
+    if (sum > 0)
+        for (auto &it : bow_vec)
+            it.second /= sum;
+}
+
+void Vocabulary::transform(const cv::Mat &descriptors, BowVector &bow_vec) const
+{
+    FeatureVector feat_vec;
+    transform(descriptors, bow_vec, feat_vec, 0);
+}
+
+double Vocabulary::score(const BowVector &v1, const BowVector &v2)
+{
+    // For L1 normalized vectors: 1 - 0.5 * |v1 - v2| = -0.5 * sum over common words of (|a - b| - |a| - |b|)
+    double s = 0;
+    auto it1 = v1.begin(), it2 = v2.begin();
+    while (it1 != v1.end() && it2 != v2.end())
+    {
+        if (it1->first == it2->first)
+        {
+            const double a = it1->second, b = it2->second;
+            s += fabs(a - b) - fabs(a) - fabs(b);
+            it1++, it2++;
+        }
+        else if (it1->first < it2->first)
+            it1 = v1.lower_bound(it2->first);
+        else
+            it2 = v2.lower_bound(it1->first);
+    }
+    return -0.5 * s;
+}
+
+uint64_t Vocabulary::signature() const
+{
+    // FNV-1a of what `save` writes
+    uint64_t hash = 14695981039346656037ULL;
+    auto add = [&hash](const void *data, size_t bytes) {
+        const uchar *p = static_cast<const uchar *>(data);
+        for (size_t i = 0; i < bytes; i++)
+            hash = (hash ^ p[i]) * 1099511628211ULL;
+    };
+    const int32_t header[3] = {branching_, depth_, (int32_t)nodes_.size()};
+    add(header, sizeof(header));
+    for (const Node &node : nodes_)
+    {
+        const int32_t parent = node.parent;
+        const float weight = node.weight;
+        add(&parent, sizeof(parent));
+        add(&weight, sizeof(weight));
+        if (!node.descriptor.empty())
+            add(node.descriptor.ptr<uchar>(), node.descriptor.cols);
+    }
+    return hash != 0 ? hash : 1;
+}
+
+void Vocabulary::save(const string &filename) const
+{
+    // Header, and then each node: parent, weight, descriptor. Children and words are recovered by the order of nodes.
+    std::ofstream fout(filename, std::ios::binary);
+    if (!fout.is_open())
+        throw std::runtime_error("vocabulary.cpp::save: cannot open " + filename);
+    const int32_t header[4] = {branching_, depth_, (int32_t)nodes_.size(), nodes_.empty() ? 0 : nodes_[0].descriptor.cols};
+    fout.write(kMagic, sizeof(kMagic));
+    fout.write(reinterpret_cast<const char *>(&kVersion), sizeof(kVersion));
+    fout.write(reinterpret_cast<const char *>(header), sizeof(header));
+    for (const Node &node : nodes_)
+    {
+        const int32_t parent = node.parent;
+        const float weight = node.weight;
+        fout.write(reinterpret_cast<const char *>(&parent), sizeof(parent));
+        fout.write(reinterpret_cast<const char *>(&weight), sizeof(weight));
+        fout.write(reinterpret_cast<const char *>(node.descriptor.ptr<uchar>()), header[3]);
+    }
+}
+
+void Vocabulary::load(const string &filename)
+{
+    std::ifstream fin(filename, std::ios::binary);
+    if (!fin.is_open())
+        throw std::runtime_error("vocabulary.cpp::load: cannot open " + filename);
+    char magic[sizeof(kMagic)];
+    uint32_t version;
+    int32_t header[4];
+    fin.read(magic, sizeof(magic));
+    fin.read(reinterpret_cast<char *>(&version), sizeof(version));
+    fin.read(reinterpret_cast<char *>(header), sizeof(header));
+    if (!fin || memcmp(magic, kMagic, sizeof(kMagic)) != 0 || version != kVersion)
+        throw std::runtime_error("vocabulary.cpp::load: not a vocabulary file of version " +
+                                 std::to_string(kVersion) + ": " + filename);
+
+    branching_ = header[0];
+    depth_ = header[1];
+    const int num_nodes = header[2], num_bytes = header[3];
+
+    // The sizes are checked against the file, before allocating by them.
+    const std::streamoff data_begin = fin.tellg();
+    fin.seekg(0, std::ios::end);
+    const int64_t data_bytes = static_cast<int64_t>(fin.tellg() - data_begin);
+    fin.seekg(data_begin);
+    const int64_t node_bytes = sizeof(int32_t) + sizeof(float) + static_cast<int64_t>(num_bytes);
+    if (branching_ <= 0 || depth_ <= 0 || num_nodes <= 0 || num_bytes <= 0 || num_nodes > data_bytes / node_bytes)
+        throw std::runtime_error("vocabulary.cpp::load: wrong sizes in the header, or file is truncated: " + filename);
+    nodes_.assign(num_nodes, Node{-1, {}, cv::Mat(), 0.0, -1});
+    for (int i = 0; i < num_nodes; i++)
+    {
+        int32_t parent;
+        float weight;
+        nodes_[i].descriptor = cv::Mat::zeros(1, num_bytes, CV_8U);
+        fin.read(reinterpret_cast<char *>(&parent), sizeof(parent));
+        fin.read(reinterpret_cast<char *>(&weight), sizeof(weight));
+        fin.read(reinterpret_cast<char *>(nodes_[i].descriptor.ptr<uchar>()), num_bytes);
+        if (i > 0 && (parent < 0 || parent >= i))
+            throw std::runtime_error("vocabulary.cpp::load: parent of a node should be before it: " + filename);
+        nodes_[i].parent = parent;
+        nodes_[i].weight = weight;
+        if (parent >= 0)
+            nodes_[parent].children.push_back(i);
+    }
+    if (!fin)
+        throw std::runtime_error("vocabulary.cpp::load: file is truncated: " + filename);
+    computeWords_();
+}
+
+} // namespace geometry
+} // namespace my_slam
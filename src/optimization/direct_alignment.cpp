@@ -0,0 +1,190 @@
+
+#include "my_slam/optimization/direct_alignment.h"
+
+#include "my_slam/basics/eigen_funcs.h"
+
+namespace my_slam
+{
+namespace optimization
+{
+
+namespace
+{
+// Bilinear interpolation of an 8-bit gray image. (x, y) must be in [0, cols - 1) x [0, rows - 1).
+inline double interpolate(const cv::Mat &img, double x, double y)
+{
+    const int x0 = floor(x), y0 = floor(y);
+    const double dx = x - x0, dy = y - y0;
+    const uchar *p = img.ptr<uchar>(y0) + x0;
+    const size_t step = img.step;
+    return (1 - dx) * (1 - dy) * p[0] + dx * (1 - dy) * p[1] + (1 - dx) * dy * p[step] + dx * dy * p[step + 1];
+}
+} // namespace
+
+DirectAlignmentSummary alignSparseDirect(
+    const vector<cv::Mat> &ref_pyramid,
+    const vector<cv::Mat> &curr_pyramid,
+    const vector<Eigen::Vector3d> &pts_ref,
+    double fx, double fy, double cx, double cy,
+    Sophus::SE3 &T_curr_ref,
+    int max_iters,
+    int patch_half_size)
+{
+    constexpr double kHuberDelta = 10.0;  // gray levels
+    constexpr int kMinPoints = 6;         // for the 6 dof
+    const int N = pts_ref.size();
+    const int patch_area = 4 * patch_half_size * patch_half_size;
+    const int num_levels = std::min(ref_pyramid.size(), curr_pyramid.size());
+    DirectAlignmentSummary summary;
+    summary.point_rms_errors.assign(N, -1);
+
+    for (int level = num_levels - 1; level >= 0; level--)
+    {
+        const cv::Mat &ref_img = ref_pyramid[level], &curr_img = curr_pyramid[level];
+        const double scale = 1.0 / (1 << level);
+        const double fx_l = fx * scale, fy_l = fy * scale, cx_l = cx * scale, cy_l = cy * scale;
+
+        // A patch, its gradients, and the bilinear interpolation are inside the image.
+        const int margin = patch_half_size + 2;
+        auto isInside = [margin](const cv::Mat &img, double u, double v) {
+            return u >= margin && v >= margin && u < img.cols - margin && v < img.rows - margin;
+        };
+
+        // -- Reference patches and their Jacobians, which are fixed in the inverse compositional form.
+        //      The Jacobian of a pixel wrt the perturbation of the reference pose is its image gradient
+        //      times the Jacobian of the projection of the point, which is shared by the patch.
+        vector<bool> is_valid(N, false);
+        vector<double> ref_patches(N * patch_area);
+        vector<Vector6d, Eigen::aligned_allocator<Vector6d>> jacobians(N * patch_area);
+        for (int i = 0; i < N; i++)
+        {
+            const double x = pts_ref[i](0), y = pts_ref[i](1), z = pts_ref[i](2);
+            if (z < 1e-6)
+                continue;
+            const double inv_z = 1.0 / z, inv_z2 = inv_z * inv_z;
+            const double u = fx_l * x * inv_z + cx_l, v = fy_l * y * inv_z + cy_l;
+            if (!isInside(ref_img, u, v))
+                continue;
+            is_valid[i] = true;
+            Eigen::Matrix<double, 2, 6> J_proj;
+            J_proj << fx_l * inv_z, 0, -fx_l * x * inv_z2, -fx_l * x * y * inv_z2, fx_l + fx_l * x * x * inv_z2, -fx_l * y * inv_z,
+                0, fy_l * inv_z, -fy_l * y * inv_z2, -fy_l - fy_l * y * y * inv_z2, fy_l * x * y * inv_z2, fy_l * x * inv_z;
+            int k = i * patch_area;
+            for (int dy = -patch_half_size; dy < patch_half_size; dy++)
+                for (int dx = -patch_half_size; dx < patch_half_size; dx++, k++)
+                {
+                    const double uu = u + dx, vv = v + dy;
+                    ref_patches[k] = interpolate(ref_img, uu, vv);
+                    const Eigen::Vector2d grad(0.5 * (interpolate(ref_img, uu + 1, vv) - interpolate(ref_img, uu - 1, vv)),
+                                               0.5 * (interpolate(ref_img, uu, vv + 1) - interpolate(ref_img, uu, vv - 1)));
+                    jacobians[k] = J_proj.transpose() * grad;
+                }
+        }
+
+        // -- Photometric residuals of the current image under the pose T, and the normal equation H * dx = b
+        //      Optionally, the rms error of each point.
+        auto buildProblem = [&](const Sophus::SE3 &T, Matrix6d &H, Vector6d &b, int &num_points, double &sum_sq_error,
+                                vector<double> *point_rms_errors) {
+            H.setZero();
+            b.setZero();
+            num_points = 0;
+            sum_sq_error = 0;
+            for (int i = 0; i < N; i++)
+            {
+                if (!is_valid[i])
+                    continue;
+                const Eigen::Vector3d pc = T * pts_ref[i];
+                if (pc(2) < 1e-6)
+                    continue;
+                const double u = fx_l * pc(0) / pc(2) + cx_l, v = fy_l * pc(1) / pc(2) + cy_l;
+                if (!isInside(curr_img, u, v))
+                    continue;
+                num_points++;
+                int k = i * patch_area;
+                double point_sq_error = 0;
+                for (int dy = -patch_half_size; dy < patch_half_size; dy++)
+                    for (int dx = -patch_half_size; dx < patch_half_size; dx++, k++)
+                    {
+                        const double r = interpolate(curr_img, u + dx, v + dy) - ref_patches[k];
+                        const double w = std::abs(r) <= kHuberDelta ? 1.0 : kHuberDelta / std::abs(r);
+                        H.noalias() += w * jacobians[k] * jacobians[k].transpose();
+                        b.noalias() += w * r * jacobians[k];
+                        point_sq_error += r * r;
+                    }
+                sum_sq_error += point_sq_error;
+                if (point_rms_errors != nullptr)
+                    (*point_rms_errors)[i] = sqrt(point_sq_error / patch_area);
+            }
+        };
+
+        // -- Gauss-Newton.
+        //      dx moves the reference point so its patch matches the current image, I_ref(exp(dx) * p) = I_curr(T * p),
+        //      so the pose is updated by the inverse of it.
+        Matrix6d H;
+        Vector6d b;
+        int num_points;
+        double sum_sq_error, last_error = std::numeric_limits<double>::max();
+        Sophus::SE3 T_last = T_curr_ref;
+        for (int iter = 0; iter < max_iters; iter++)
+        {
+            buildProblem(T_curr_ref, H, b, num_points, sum_sq_error, nullptr);
+            if (num_points < kMinPoints)
+                break;
+            const double error = sum_sq_error / (num_points * patch_area);
+            if (error > last_error)
+            {
+                T_curr_ref = T_last; // The error increases. Keep the previous estimation.
+                break;
+            }
+            last_error = error;
+            const Vector6d dx = H.ldlt().solve(b);
+            if (!dx.allFinite())
+                break;
+            T_last = T_curr_ref;
+            T_curr_ref = T_curr_ref * Sophus::SE3::exp(dx).inverse();
+            summary.num_iterations++;
+            if (dx.norm() < 1e-5)
+                break; // converged
+        }
+
+        // -- The error at the finest level
+        if (level == 0)
+        {
+            buildProblem(T_curr_ref, H, b, num_points, sum_sq_error, &summary.point_rms_errors);
+            summary.num_points = num_points;
+            summary.rms_error = num_points > 0 ? sqrt(sum_sq_error / (num_points * patch_area)) : 0;
+        }
+    }
+    return summary;
+}
+
+DirectAlignmentSummary alignSparseDirect(
+    const vector<cv::Mat> &ref_pyramid,
+    const vector<cv::Mat> &curr_pyramid,
+    const vector<cv::Point3f> &pts_world,
+    const cv::Mat &K,
+    const cv::Mat &T_w_ref,
+    cv::Mat &T_w_curr,
+    int max_iters,
+    int patch_half_size)
+{
+    // Change data format from OpenCV to Eigen
+    const Sophus::SE3 T_ref_w = basics::transT_cv2sophus(T_w_ref).inverse();
+    vector<Eigen::Vector3d> pts_ref;
+    for (const cv::Point3f &p : pts_world)
+        pts_ref.push_back(T_ref_w * Eigen::Vector3d(p.x, p.y, p.z));
+    Sophus::SE3 T_curr_ref = basics::transT_cv2sophus(T_w_curr).inverse() * T_ref_w.inverse();
+
+    // Align
+    DirectAlignmentSummary summary = alignSparseDirect(
+        ref_pyramid, curr_pyramid, pts_ref,
+        K.at<double>(0, 0), K.at<double>(1, 1), K.at<double>(0, 2), K.at<double>(1, 2),
+        T_curr_ref, max_iters, patch_half_size);
+
+    // Change data format back to OpenCV
+    T_w_curr = basics::transT_sophus2cv(T_ref_w.inverse() * T_curr_ref.inverse());
+    return summary;
+}
+
+} // namespace optimization
+} // namespace my_slam
@@ -3,6 +3,7 @@ https://github.com/gaoxiang12/slambook/blob/master/ch7/pose_estimation_3d2d.cpp
 */
 
 #include "my_slam/optimization/g2o_ba.h"
+#include "my_slam/optimization/native_ba.h"
 
 #include "my_slam/basics/eigen_funcs.h"
 
@@ -14,16 +15,22 @@ https://github.com/gaoxiang12/slambook/blob/master/ch7/pose_estimation_3d2d.cpp
 #include <g2o/types/sba/types_six_dof_expmap.h>
 
 #include <g2o/solvers/dense/linear_solver_dense.h>
+#include <g2o/solvers/eigen/linear_solver_eigen.h>
+#include <g2o/solvers/pcg/linear_solver_pcg.h>
+#ifdef MY_SLAM_WITH_CHOLMOD
+#include <g2o/solvers/cholmod/linear_solver_cholmod.h>
+#endif
 #include <g2o/core/robust_kernel.h>
 #include <g2o/core/robust_kernel_impl.h>
-
-#include <chrono> // timer
+#include <g2o/core/hyper_graph_action.h>
 
 namespace my_slam
 {
 namespace optimization
 {
 
+typedef g2o::BlockSolver<g2o::BlockSolverTraits<6, 3>> Block; // dim(pose) = 6, dim(landmark) = 3
+
 Eigen::Matrix2d mat2eigen(const cv::Mat &mat)
 {
     Eigen::Matrix2d mat_eigen;
@@ -31,12 +38,272 @@ Eigen::Matrix2d mat2eigen(const cv::Mat &mat)
     return mat_eigen;
 }
 
-void optimizeSingleFrame(
+LinearSolverType str2LinearSolverType(const string &s)
+{
+    if (s == "auto")
+        return LinearSolverType::AUTO;
+    else if (s == "dense")
+        return LinearSolverType::DENSE;
+    else if (s == "csparse")
+        return LinearSolverType::CSPARSE;
+    else if (s == "cholmod")
+        return LinearSolverType::CHOLMOD;
+    else if (s == "eigen")
+        return LinearSolverType::EIGEN;
+    else if (s == "pcg")
+        return LinearSolverType::PCG;
+    else
+        throw std::runtime_error("g2o_ba.cpp::str2LinearSolverType: wrong solver name: " + s);
+}
+
+string linearSolverType2str(LinearSolverType type)
+{
+    switch (type)
+    {
+    case LinearSolverType::AUTO:
+        return "auto";
+    case LinearSolverType::DENSE:
+        return "dense";
+    case LinearSolverType::CSPARSE:
+        return "csparse";
+    case LinearSolverType::CHOLMOD:
+        return "cholmod";
+    case LinearSolverType::EIGEN:
+        return "eigen";
+    case LinearSolverType::PCG:
+        return "pcg";
+    }
+    return "";
+}
+
+BABackend str2BABackend(const string &s)
+{
+    if (s == "g2o")
+        return BABackend::G2O;
+    else if (s == "native")
+        return BABackend::NATIVE;
+    else
+        throw std::runtime_error("g2o_ba.cpp::str2BABackend: wrong backend name: " + s);
+}
+
+string baStopReason2str(BAStopReason reason)
+{
+    switch (reason)
+    {
+    case BAStopReason::MAX_ITERS:
+        return "max_iters";
+    case BAStopReason::COST_CONVERGED:
+        return "cost_converged";
+    case BAStopReason::STEP_CONVERGED:
+        return "step_converged";
+    case BAStopReason::TIME_BUDGET:
+        return "time_budget";
+    case BAStopReason::NO_PROGRESS:
+        return "no_progress";
+    }
+    return "";
+}
+
+string BASummary::toString() const
+{
+    char buf[256];
+    snprintf(buf, sizeof(buf), "iterations = %d, cost: %.3f -> %.3f, time = %.2f ms, stopped by %s, outliers = %d",
+             iterations, initial_cost, final_cost, time_ms, baStopReason2str(stop_reason).c_str(), num_outliers);
+    return buf;
+}
+
+BATerminationChecker::BATerminationChecker(const BATermination &termination, double initial_cost)
+    : termination_(termination)
+{
+    summary_.initial_cost = summary_.final_cost = initial_cost;
+    t_start_ = t_last_ = std::chrono::steady_clock::now();
+}
+
+bool BATerminationChecker::update(double cost, double step_norm)
+{
+    typedef std::chrono::duration<double, std::milli> Ms;
+    const std::chrono::steady_clock::time_point t_curr = std::chrono::steady_clock::now();
+    max_iter_time_ms_ = std::max(max_iter_time_ms_, Ms(t_curr - t_last_).count());
+    t_last_ = t_curr;
+    summary_.time_ms = Ms(t_curr - t_start_).count();
+    summary_.iterations++;
+
+    const double prev_cost = summary_.final_cost;
+    if (cost >= prev_cost)
+    {
+        summary_.stop_reason = BAStopReason::NO_PROGRESS;
+        return true; // The solver keeps its previous estimation.
+    }
+    summary_.final_cost = cost;
+
+    if (prev_cost - cost < termination_.min_relative_decrease * prev_cost)
+        summary_.stop_reason = BAStopReason::COST_CONVERGED;
+    else if (step_norm >= 0 && step_norm < termination_.min_step_norm)
+        summary_.stop_reason = BAStopReason::STEP_CONVERGED;
+    else if (summary_.iterations >= termination_.max_iters)
+        summary_.stop_reason = BAStopReason::MAX_ITERS;
+    else if (termination_.max_time_ms > 0 && summary_.time_ms + max_iter_time_ms_ > termination_.max_time_ms)
+        summary_.stop_reason = BAStopReason::TIME_BUDGET;
+    else
+        return false;
+    return true;
+}
+
+// Check the stopping criteria after each iteration of g2o, and stop it by its force-stop flag.
+class TerminationAction : public g2o::HyperGraphAction
+{
+public:
+    TerminationAction(g2o::SparseOptimizer &optimizer, BATerminationChecker &checker, bool *stop_flag)
+        : optimizer_(optimizer), checker_(checker), stop_flag_(stop_flag)
+    {
+        getEstimates_(prev_estimates_);
+    }
+
+    HyperGraphAction *operator()(const g2o::HyperGraph *graph, Parameters *parameters = 0) override
+    {
+        // Norm of the change of all estimates. For SE3Quat, it's on the quaternion and translation.
+        getEstimates_(curr_estimates_);
+        double step_norm = -1;
+        if (curr_estimates_.size() == prev_estimates_.size())
+            step_norm = (Eigen::Map<Eigen::VectorXd>(curr_estimates_.data(), curr_estimates_.size()) -
+                         Eigen::Map<Eigen::VectorXd>(prev_estimates_.data(), prev_estimates_.size()))
+                            .norm();
+        prev_estimates_.swap(curr_estimates_);
+
+        optimizer_.computeActiveErrors();
+        if (checker_.update(optimizer_.activeRobustChi2(), step_norm))
+            *stop_flag_ = true;
+        return this;
+    }
+
+private:
+    void getEstimates_(vector<double> &estimates) const
+    {
+        estimates.clear();
+        for (g2o::OptimizableGraph::Vertex *v : optimizer_.activeVertices())
+        {
+            if (v->fixed())
+                continue;
+            const int offset = estimates.size();
+            estimates.resize(offset + v->estimateDimension());
+            v->getEstimateData(&estimates[offset]);
+        }
+    }
+
+    g2o::SparseOptimizer &optimizer_;
+    BATerminationChecker &checker_;
+    bool *stop_flag_;
+    vector<double> prev_estimates_, curr_estimates_;
+};
+
+// Run g2o until any of the stopping criteria is met. `initializeOptimization` should have been called.
+BASummary optimizeUntilTermination(g2o::SparseOptimizer &optimizer, const BATermination &termination)
+{
+    optimizer.computeActiveErrors();
+    BATerminationChecker checker(termination, optimizer.activeRobustChi2());
+    bool is_stop = false;
+    TerminationAction action(optimizer, checker, &is_stop);
+    optimizer.setForceStopFlag(&is_stop);
+    optimizer.addPostIterationAction(&action);
+    optimizer.optimize(termination.max_iters);
+    optimizer.removePostIterationAction(&action);
+    optimizer.setForceStopFlag(nullptr);
+    return checker.getSummary();
+}
+
+// Two-stage optimization of a graph whose edges all have a robust kernel:
+//      Optimize, set edges whose chi2 > `chi2_threshold` to level 1, remove the kernel of all edges,
+//      and then optimize level 0 again. Outliers are left in the graph at level 1.
+//      `initializeOptimization` should have been called.
+BASummary optimizeAndRejectOutliers(g2o::SparseOptimizer &optimizer, const BATermination &termination,
+                                    double chi2_threshold)
+{
+    BASummary summary = optimizeUntilTermination(optimizer, termination);
+
+    // Classify by chi2. Outliers are excluded from the 2nd stage.
+    auto rejectOutliers = [&optimizer, chi2_threshold]() {
+        int num_outliers = 0;
+        for (g2o::OptimizableGraph::Edge *edge : optimizer.activeEdges())
+        {
+            edge->computeError();
+            if (edge->chi2() > chi2_threshold)
+            {
+                edge->setLevel(1);
+                num_outliers++;
+            }
+            edge->setRobustKernel(nullptr);
+        }
+        return num_outliers;
+    };
+    summary.num_outliers = rejectOutliers();
+
+    // Optimize inliers without the kernel, within the remaining time budget
+    BATermination termination2 = termination;
+    if (termination.max_time_ms > 0)
+    {
+        termination2.max_time_ms = termination.max_time_ms - summary.time_ms;
+        if (termination2.max_time_ms <= 0)
+            return summary;
+    }
+    optimizer.initializeOptimization(0);
+    const BASummary summary2 = optimizeUntilTermination(optimizer, termination2);
+    summary.iterations += summary2.iterations;
+    summary.time_ms += summary2.time_ms;
+    summary.final_cost = summary2.final_cost;
+    summary.stop_reason = summary2.stop_reason;
+    summary.num_outliers += rejectOutliers(); // Some may become outliers after the refinement.
+    return summary;
+}
+
+LinearSolverType chooseLinearSolver(int num_poses)
+{
+    // The reduced camera system after Schur complement is (6*num_poses)x(6*num_poses).
+    // Dense Cholesky is cubic in its size, but has the least overhead for small windows.
+    // Sparse Cholesky exploits that only covisible poses are connected.
+    // For thousands of poses, the fill-in of the factorization is too large, so use PCG.
+    constexpr int kMaxPosesForDense = 20;
+    constexpr int kMaxPosesForCholesky = 2000;
+    if (num_poses <= kMaxPosesForDense)
+        return LinearSolverType::DENSE;
+    else if (num_poses <= kMaxPosesForCholesky)
+#ifdef MY_SLAM_WITH_CHOLMOD
+        return LinearSolverType::CHOLMOD;
+#else
+        return LinearSolverType::CSPARSE;
+#endif
+    else
+        return LinearSolverType::PCG;
+}
+
+// Create the linear solver for the reduced camera system.
+Block::LinearSolverType *createLinearSolver(LinearSolverType type)
+{
+    switch (type)
+    {
+    case LinearSolverType::DENSE:
+        return new g2o::LinearSolverDense<Block::PoseMatrixType>();
+    case LinearSolverType::CHOLMOD:
+#ifdef MY_SLAM_WITH_CHOLMOD
+        return new g2o::LinearSolverCholmod<Block::PoseMatrixType>();
+#endif
+    case LinearSolverType::CSPARSE:
+        return new g2o::LinearSolverCSparse<Block::PoseMatrixType>();
+    case LinearSolverType::EIGEN:
+        return new g2o::LinearSolverEigen<Block::PoseMatrixType>();
+    case LinearSolverType::PCG:
+        return new g2o::LinearSolverPCG<Block::PoseMatrixType>();
+    default:
+        throw std::runtime_error("g2o_ba.cpp::createLinearSolver: solver type should be chosen before.");
+    }
+}
+
+BASummary optimizeSingleFrame(
     const vector<cv::Point2f *> &points_2d,
     const cv::Mat &K,
     vector<cv::Point3f *> &points_3d,
     cv::Mat &pose_src,
-    bool is_fix_map_pts, bool is_update_map_pts)
+    bool is_fix_map_pts, bool is_update_map_pts,
+    const BAOptions &options)
 {
     const cv::Mat pose_src0 = pose_src.clone();
 
@@ -45,7 +312,6 @@ void optimizeSingleFrame(
     Sophus::SE3 T_cam_to_world = basics::transT_cv2sophus(T_cam_to_world_cv);
 
     // Init g2o
-    typedef g2o::BlockSolver<g2o::BlockSolverTraits<6, 3>> Block;                                  // dim(pose) = 6, dim(landmark) = 3
     Block::LinearSolverType *linearSolver = new g2o::LinearSolverCSparse<Block::PoseMatrixType>(); // solver for linear equation
     Block *solver_ptr = new Block(linearSolver);                                                   // solver for matrix block
     g2o::OptimizationAlgorithmLevenberg *solver = new g2o::OptimizationAlgorithmLevenberg(solver_ptr);
@@ -101,22 +367,11 @@ void optimizeSingleFrame(
 
     // -- Optimize
     const bool is_print_time = false;
-    int optimize_iters = 50;
+    optimizer.setVerbose(is_print_time);
+    optimizer.initializeOptimization();
+    const BASummary summary = optimizeUntilTermination(optimizer, options.termination);
     if (is_print_time)
-    {
-        std::chrono::steady_clock::time_point t1 = std::chrono::steady_clock::now();
-        optimizer.setVerbose(true);
-        optimizer.initializeOptimization();
-        optimizer.optimize(optimize_iters);
-        std::chrono::steady_clock::time_point t2 = std::chrono::steady_clock::now();
-        std::chrono::duration<double> time_used = std::chrono::duration_cast<std::chrono::duration<double>>(t2 - t1);
-        cout << "optimization costs time: " << time_used.count() << " seconds." << endl;
-    }
-    else
-    {
-        optimizer.initializeOptimization();
-        optimizer.optimize(optimize_iters);
-    }
+        cout << "optimization: " << summary.toString() << endl;
 
     // -- Final: get the result from solver
 
@@ -142,6 +397,7 @@ void optimizeSingleFrame(
     printf("Point 0: Before:{%.5f,%.5f,%.5f}, After:{%.5f,%.5f,%.5f}\n",
            point_src0.x, point_src0.y, point_src0.z,
            point_dst0(0, 0), point_dst0(1, 0), point_dst0(2, 0));
+    return summary;
 }
 
 //------------------------------------------------------------------------------------------
@@ -169,15 +425,21 @@ void optimizeSingleFrame(
 //------------------------------------------------------------------------------------------
 //------------------------------------------------------------------------------------------
 
-void bundleAdjustment(
+BASummary bundleAdjustment(
     const vector<vector<cv::Point2f *>> &v_pts_2d,
     const vector<vector<int>> &v_pts_2d_to_3d_idx,
     const cv::Mat &K,
     std::unordered_map<int, cv::Point3f *> &pts_3d,
     vector<cv::Mat *> &v_camera_g2o_poses,
     const cv::Mat &information_matrix,
-    bool is_fix_map_pts, bool is_update_map_pts)
+    bool is_fix_map_pts, bool is_update_map_pts,
+    const BAOptions &options,
+    vector<vector<bool>> *v_is_outlier)
 {
+    if (options.backend == BABackend::NATIVE)
+        return bundleAdjustmentNative(v_pts_2d, v_pts_2d_to_3d_idx, K, pts_3d, v_camera_g2o_poses,
+                                      information_matrix, is_fix_map_pts, is_update_map_pts, options,
+                                      v_is_outlier);
 
     // Change pose format from OpenCV to Sophus::SE3
     int num_frames = v_camera_g2o_poses.size();
@@ -190,11 +452,11 @@ void bundleAdjustment(
     }
 
     // Init g2o
-    typedef g2o::BlockSolver<g2o::BlockSolverTraits<6, 3>> Block; // dim(pose) = 6, dim(landmark) = 3
-    Block::LinearSolverType *linearSolver;
-    // linearSolver = new g2o::LinearSolverCSparse<Block::PoseMatrixType>(); // solver for linear equation
-    linearSolver = new g2o::LinearSolverDense<Block::PoseMatrixType>();
-    Block *solver_ptr = new Block(linearSolver); // solver for matrix block
+    LinearSolverType solver_type = options.linear_solver;
+    if (solver_type == LinearSolverType::AUTO)
+        solver_type = chooseLinearSolver(num_frames);
+    Block::LinearSolverType *linearSolver = createLinearSolver(solver_type); // solver for linear equation
+    Block *solver_ptr = new Block(linearSolver);                              // solver for matrix block
     g2o::OptimizationAlgorithmLevenberg *solver = new g2o::OptimizationAlgorithmLevenberg(solver_ptr);
     g2o::SparseOptimizer optimizer;
     optimizer.setAlgorithm(solver);
@@ -207,8 +469,8 @@ void bundleAdjustment(
     {
         g2o::VertexSE3Expmap *pose = new g2o::VertexSE3Expmap(); // camera pose
         pose->setId(vertex_id++);
-        // if (num_frames > 1 && ith_frame == num_frames - 1)
-        // pose->setFixed(true); // Fix the last one -- which is the earliest frame
+        if (options.is_fix_first_pose && ith_frame == 0)
+            pose->setFixed(true);
         pose->setEstimate(g2o::SE3Quat(
             v_T_cam_to_world[ith_frame].rotation_matrix(),
             v_T_cam_to_world[ith_frame].translation()));
@@ -247,6 +509,7 @@ void bundleAdjustment(
     // Set information matrix
     int edge_id = 0;
     Eigen::Matrix2d information_matrix_eigen = mat2eigen(information_matrix);
+    vector<vector<g2o::EdgeProjectXYZ2UV *>> g2o_edges(num_frames);
     for (int ith_frame = 0; ith_frame < num_frames; ith_frame++)
     {
         int num_pts_2d = v_pts_2d[ith_frame].size();
@@ -267,32 +530,31 @@ void bundleAdjustment(
             edge->setInformation(information_matrix_eigen);
             edge->setRobustKernel(new g2o::RobustKernelHuber());
             optimizer.addEdge(edge);
+            g2o_edges[ith_frame].push_back(edge);
         }
     }
 
     // -- Optimize
-    constexpr bool is_print_time_and_res = false;
-    int optimize_iters = 50;
-    if (is_print_time_and_res)
+    constexpr bool is_print_res = false;
+    optimizer.setVerbose(is_print_res);
+    optimizer.initializeOptimization();
+    const BASummary summary = options.is_remove_outliers
+                                  ? optimizeAndRejectOutliers(optimizer, options.termination, options.outlier_chi2_threshold)
+                                  : optimizeUntilTermination(optimizer, options.termination);
+    if (options.is_remove_outliers && v_is_outlier != nullptr)
     {
-        std::chrono::steady_clock::time_point t1 = std::chrono::steady_clock::now();
-        optimizer.setVerbose(true);
-        optimizer.initializeOptimization();
-        optimizer.optimize(optimize_iters);
-        std::chrono::steady_clock::time_point t2 = std::chrono::steady_clock::now();
-        std::chrono::duration<double> time_used = std::chrono::duration_cast<std::chrono::duration<double>>(t2 - t1);
-        cout << "optimization costs time: " << time_used.count() << " seconds." << endl;
-    }
-    else
-    {
-        optimizer.initializeOptimization();
-        optimizer.optimize(optimize_iters);
+        v_is_outlier->assign(num_frames, vector<bool>());
+        for (int ith_frame = 0; ith_frame < num_frames; ith_frame++)
+            for (const g2o::EdgeProjectXYZ2UV *edge : g2o_edges[ith_frame])
+                (*v_is_outlier)[ith_frame].push_back(edge->level() != 0);
     }
 
     // --------------------------------------------------
     // -- Final: get the result from solver
 
-    printf("BA: Number of frames = %d, 3d points = %d\n", num_frames, vertex_id - num_frames);
+    printf("BA: Number of frames = %d, 3d points = %d, linear solver = %s, %s\n",
+           num_frames, vertex_id - num_frames, linearSolverType2str(solver_type).c_str(),
+           summary.toString().c_str());
 
     // 1. Camera pose
     for (int i = 0; i < num_frames; i++)
@@ -314,7 +576,278 @@ void bundleAdjustment(
         p->y = p_res(1, 0);
         p->z = p_res(2, 0);
     }
+    return summary;
+}
+
+//------------------------------------------------------------------------------------------
+//------------------------------------------------------------------------------------------
+//------------------------------------------------------------------------------------------
+
+struct SlidingWindowBA::Impl
+{
+    g2o::SparseOptimizer optimizer;
+    Eigen::Matrix2d information_matrix;
+    bool is_fix_map_pts;
+    bool is_remove_outliers;
+    double outlier_chi2_threshold;
+    bool is_graph_changed = true; // If true, call `initializeOptimization` before optimizing.
+    int edge_id = 0;
+
+    std::map<int, g2o::VertexSE3Expmap *> poses; // frame id -> vertex. The first one is the oldest.
+    std::unordered_map<int, g2o::VertexSBAPointXYZ *> points;
+    std::unordered_map<int, int> num_obs_of_points;
+
+    // Vertex ids of poses and points are interleaved, so they never conflict.
+    static int poseVertexId(int frame_id) { return frame_id * 2; }
+    static int pointVertexId(int pt_id) { return pt_id * 2 + 1; }
+    static int frameIdOfVertex(int vertex_id) { return vertex_id / 2; }
+    static int ptIdOfVertex(int vertex_id) { return (vertex_id - 1) / 2; }
+
+    void removePointVertex(int pt_id)
+    {
+        auto it = points.find(pt_id);
+        if (it == points.end())
+            return;
+        optimizer.removeVertex(it->second); // Its edges are removed, too.
+        points.erase(it);
+        num_obs_of_points.erase(pt_id);
+        is_graph_changed = true;
+    }
+};
+
+SlidingWindowBA::SlidingWindowBA(const cv::Mat &K, const cv::Mat &information_matrix,
+                                 bool is_fix_map_pts, int max_num_keyframes,
+                                 const BAOptions &options) : impl_(new Impl)
+{
+    LinearSolverType solver_type = options.linear_solver;
+    if (solver_type == LinearSolverType::AUTO)
+        solver_type = chooseLinearSolver(max_num_keyframes);
+    Block::LinearSolverType *linearSolver = createLinearSolver(solver_type);
+    Block *solver_ptr = new Block(linearSolver);
+    g2o::OptimizationAlgorithmLevenberg *solver = new g2o::OptimizationAlgorithmLevenberg(solver_ptr);
+    impl_->optimizer.setAlgorithm(solver);
+
+    // Parameter: camera intrinsics
+    g2o::CameraParameters *camera = new g2o::CameraParameters(
+        K.at<double>(0, 0), Eigen::Vector2d(K.at<double>(0, 2), K.at<double>(1, 2)), 0);
+    camera->setId(0);
+    impl_->optimizer.addParameter(camera);
+
+    impl_->information_matrix = mat2eigen(information_matrix);
+    impl_->is_fix_map_pts = is_fix_map_pts;
+    impl_->is_remove_outliers = options.is_remove_outliers;
+    impl_->outlier_chi2_threshold = options.outlier_chi2_threshold;
+}
+
+SlidingWindowBA::~SlidingWindowBA() {} // Vertices, edges, and solver are deleted by the optimizer.
+
+bool SlidingWindowBA::hasKeyFrame(int frame_id) const
+{
+    return impl_->poses.find(frame_id) != impl_->poses.end();
+}
+
+vector<int> SlidingWindowBA::getKeyFrameIds() const
+{
+    vector<int> ids;
+    for (const auto &it : impl_->poses)
+        ids.push_back(it.first);
+    return ids;
+}
+
+vector<int> SlidingWindowBA::getPointIds() const
+{
+    vector<int> ids;
+    for (const auto &it : impl_->points)
+        ids.push_back(it.first);
+    return ids;
+}
+
+void SlidingWindowBA::addKeyFrame(int frame_id, const cv::Mat &T_w_c,
+                                  const vector<cv::Point2f> &pts_2d,
+                                  const vector<int> &pts_2d_to_3d_idx,
+                                  const std::unordered_map<int, cv::Point3f> &pts_3d)
+{
+    if (hasKeyFrame(frame_id))
+        removeKeyFrame(frame_id);
+    g2o::SparseOptimizer &optimizer = impl_->optimizer;
+
+    // Camera pose
+    Sophus::SE3 T_cam_to_world = basics::transT_cv2sophus(T_w_c.inv());
+    g2o::VertexSE3Expmap *pose = new g2o::VertexSE3Expmap();
+    pose->setId(Impl::poseVertexId(frame_id));
+    pose->setEstimate(g2o::SE3Quat(
+        T_cam_to_world.rotation_matrix(),
+        T_cam_to_world.translation()));
+    optimizer.addVertex(pose);
+    impl_->poses[frame_id] = pose;
+
+    // Points and edges
+    const int num_pts_2d = pts_2d.size();
+    for (int j = 0; j < num_pts_2d; j++)
+    {
+        const int pt3d_id = pts_2d_to_3d_idx[j];
+        g2o::VertexSBAPointXYZ *point;
+        auto it = impl_->points.find(pt3d_id);
+        if (it != impl_->points.end())
+        {
+            point = it->second; // warm start from the previous solution
+            auto it_pos = pts_3d.find(pt3d_id);
+            if (impl_->is_fix_map_pts && it_pos != pts_3d.end()) // A fixed point follows the map.
+                point->setEstimate(Eigen::Vector3d(it_pos->second.x, it_pos->second.y, it_pos->second.z));
+        }
+        else
+        {
+            auto it_pos = pts_3d.find(pt3d_id);
+            if (it_pos == pts_3d.end())
+                continue;
+            const cv::Point3f &p = it_pos->second;
+            point = new g2o::VertexSBAPointXYZ();
+            point->setId(Impl::pointVertexId(pt3d_id));
+            point->setFixed(impl_->is_fix_map_pts);
+            point->setEstimate(Eigen::Vector3d(p.x, p.y, p.z));
+            point->setMarginalized(true);
+            optimizer.addVertex(point);
+            impl_->points[pt3d_id] = point;
+            impl_->num_obs_of_points[pt3d_id] = 0;
+        }
+
+        g2o::EdgeProjectXYZ2UV *edge = new g2o::EdgeProjectXYZ2UV();
+        edge->setId(impl_->edge_id++);
+        edge->setVertex(0, point);
+        edge->setVertex(1, pose);
+        edge->setMeasurement(Eigen::Vector2d(pts_2d[j].x, pts_2d[j].y));
+        edge->setParameterId(0, 0);
+        edge->setInformation(impl_->information_matrix);
+        edge->setRobustKernel(new g2o::RobustKernelHuber());
+        optimizer.addEdge(edge);
+        impl_->num_obs_of_points[pt3d_id]++;
+    }
+    impl_->is_graph_changed = true;
+}
+
+void SlidingWindowBA::removeKeyFrame(int frame_id)
+{
+    auto it = impl_->poses.find(frame_id);
+    if (it == impl_->poses.end())
+        return;
+    g2o::VertexSE3Expmap *pose = it->second;
+
+    // Points observed by this keyframe
+    vector<int> pt_ids;
+    for (g2o::HyperGraph::Edge *e : pose->edges())
+        pt_ids.push_back(Impl::ptIdOfVertex(e->vertex(0)->id()));
+
+    impl_->optimizer.removeVertex(pose); // Its edges are removed, too.
+    impl_->poses.erase(it);
+
+    // Remove the points that are no longer observed
+    for (int pt_id : pt_ids)
+    {
+        auto it_cnt = impl_->num_obs_of_points.find(pt_id);
+        if (it_cnt != impl_->num_obs_of_points.end() && --(it_cnt->second) <= 0)
+            impl_->removePointVertex(pt_id);
+    }
+    impl_->is_graph_changed = true;
+}
+
+void SlidingWindowBA::removePoint(int pt_id)
+{
+    impl_->removePointVertex(pt_id);
+}
+
+void SlidingWindowBA::setPose(int frame_id, const cv::Mat &T_w_c)
+{
+    auto it = impl_->poses.find(frame_id);
+    if (it == impl_->poses.end())
+        return;
+    Sophus::SE3 T_cam_to_world = basics::transT_cv2sophus(T_w_c.inv());
+    it->second->setEstimate(g2o::SE3Quat(
+        T_cam_to_world.rotation_matrix(),
+        T_cam_to_world.translation()));
+}
+
+void SlidingWindowBA::setPoint(int pt_id, const cv::Point3f &pos)
+{
+    auto it = impl_->points.find(pt_id);
+    if (it == impl_->points.end())
+        return;
+    it->second->setEstimate(Eigen::Vector3d(pos.x, pos.y, pos.z));
+}
+
+BASummary SlidingWindowBA::optimize(const BATermination &termination,
+                                    vector<std::pair<int, int>> *outliers)
+{
+    if (impl_->poses.empty())
+        return BASummary();
+
+    // Fix the oldest keyframe to remove the gauge freedom. It's unnecessary if points are fixed.
+    for (auto &it : impl_->poses)
+        it.second->setFixed(false);
+    if (!impl_->is_fix_map_pts && impl_->poses.size() > 1)
+        impl_->poses.begin()->second->setFixed(true);
+
+    if (impl_->is_graph_changed)
+    {
+        impl_->optimizer.initializeOptimization();
+        impl_->is_graph_changed = false;
+    }
+    if (!impl_->is_remove_outliers)
+    {
+        const BASummary summary = optimizeUntilTermination(impl_->optimizer, termination);
+        printf("Sliding window BA: Number of frames = %d, 3d points = %d, %s\n",
+               (int)impl_->poses.size(), (int)impl_->points.size(), summary.toString().c_str());
+        return summary;
+    }
+
+    // Two-stage BA. Then remove the outliers from the window,
+    // and restore the kernel of the inliers for the next optimization, where new keyframes may bring new outliers.
+    const BASummary summary = optimizeAndRejectOutliers(impl_->optimizer, termination, impl_->outlier_chi2_threshold);
+    vector<g2o::OptimizableGraph::Edge *> outlier_edges;
+    for (g2o::HyperGraph::Edge *e : impl_->optimizer.edges())
+    {
+        g2o::OptimizableGraph::Edge *edge = static_cast<g2o::OptimizableGraph::Edge *>(e);
+        if (edge->level() != 0)
+            outlier_edges.push_back(edge);
+        else
+            edge->setRobustKernel(new g2o::RobustKernelHuber());
+    }
+    for (g2o::OptimizableGraph::Edge *edge : outlier_edges)
+    {
+        const int frame_id = Impl::frameIdOfVertex(edge->vertex(1)->id());
+        const int pt_id = Impl::ptIdOfVertex(edge->vertex(0)->id());
+        if (outliers != nullptr)
+            outliers->push_back(std::make_pair(frame_id, pt_id));
+        impl_->optimizer.removeEdge(edge);
+        if (--impl_->num_obs_of_points[pt_id] == 0)
+            impl_->removePointVertex(pt_id);
+    }
+    impl_->is_graph_changed = true;
+    printf("Sliding window BA: Number of frames = %d, 3d points = %d, %s\n",
+           (int)impl_->poses.size(), (int)impl_->points.size(), summary.toString().c_str());
+    return summary;
+}
+
+bool SlidingWindowBA::getPose(int frame_id, cv::Mat &T_w_c) const
+{
+    auto it = impl_->poses.find(frame_id);
+    if (it == impl_->poses.end())
+        return false;
+    Sophus::SE3 T_cam_to_world = Sophus::SE3(
+        it->second->estimate().rotation(),
+        it->second->estimate().translation());
+    T_w_c = basics::transT_sophus2cv(T_cam_to_world).inv();
+    return true;
+}
+
+void SlidingWindowBA::getPoints(std::unordered_map<int, cv::Point3f> &pts_3d) const
+{
+    pts_3d.clear();
+    for (const auto &it : impl_->points)
+    {
+        Eigen::Vector3d p = it.second->estimate();
+        pts_3d[it.first] = cv::Point3f(p(0), p(1), p(2));
+    }
 }
 
 } // namespace optimization
-} // namespace my_slam
\ No newline at end of file
+} // namespace my_slam
@@ -0,0 +1,134 @@
+
+#include "my_slam/optimization/motion_only_ba.h"
+
+#include "my_slam/basics/eigen_funcs.h"
+
+namespace my_slam
+{
+namespace optimization
+{
+
+int optimizePoseOnly(
+    const vector<Eigen::Vector2d> &pts_2d,
+    const vector<Eigen::Vector3d> &pts_3d,
+    double fx, double fy, double cx, double cy,
+    Sophus::SE3 &T_c_w,
+    vector<bool> &is_inlier,
+    int max_iters,
+    double chi2_threshold)
+{
+    const int N = pts_2d.size();
+    assert(N == pts_3d.size());
+    const double huber_delta = sqrt(chi2_threshold);
+    is_inlier.assign(N, false);
+
+    // Robust cost of all points under the pose T
+    auto computeCost = [&](const Sophus::SE3 &T) {
+        double cost = 0;
+        for (int i = 0; i < N; i++)
+        {
+            const Eigen::Vector3d pc = T * pts_3d[i];
+            if (pc(2) < 1e-6)
+                continue;
+            const Eigen::Vector2d e(fx * pc(0) / pc(2) + cx - pts_2d[i](0),
+                                    fy * pc(1) / pc(2) + cy - pts_2d[i](1));
+            const double chi2 = e.squaredNorm();
+            cost += chi2 <= chi2_threshold ? chi2 : 2 * huber_delta * sqrt(chi2) - chi2_threshold;
+        }
+        return cost;
+    };
+
+    double last_cost = computeCost(T_c_w);
+    for (int iter = 0; iter < max_iters; iter++)
+    {
+        // -- Build the 6x6 normal equation: H * dx = b
+        Matrix6d H = Matrix6d::Zero();
+        Vector6d b = Vector6d::Zero();
+        for (int i = 0; i < N; i++)
+        {
+            const Eigen::Vector3d pc = T_c_w * pts_3d[i];
+            const double x = pc(0), y = pc(1), z = pc(2);
+            if (z < 1e-6)
+                continue; // point is behind the camera
+            const double inv_z = 1.0 / z, inv_z2 = inv_z * inv_z;
+            const Eigen::Vector2d e(fx * x * inv_z + cx - pts_2d[i](0),
+                                    fy * y * inv_z + cy - pts_2d[i](1));
+
+            // Jacobian of the projection wrt the left perturbation on se3 = [rho, phi]
+            Eigen::Matrix<double, 2, 6> J;
+            J << fx * inv_z, 0, -fx * x * inv_z2, -fx * x * y * inv_z2, fx + fx * x * x * inv_z2, -fx * y * inv_z,
+                0, fy * inv_z, -fy * y * inv_z2, -fy - fy * y * y * inv_z2, fy * x * y * inv_z2, fy * x * inv_z;
+
+            // Huber weight
+            const double err = e.norm();
+            const double w = err <= huber_delta ? 1.0 : huber_delta / err;
+
+            H.noalias() += w * J.transpose() * J;
+            b.noalias() -= w * J.transpose() * e;
+        }
+
+        // -- Solve and update
+        const Vector6d dx = H.ldlt().solve(b);
+        if (!dx.allFinite())
+            break;
+        const Sophus::SE3 T_new = Sophus::SE3::exp(dx) * T_c_w;
+        const double cost = computeCost(T_new);
+        if (cost > last_cost)
+            break; // The cost increases. Keep the previous estimation.
+        T_c_w = T_new;
+        last_cost = cost;
+        if (dx.norm() < 1e-6)
+            break; // converged
+    }
+
+    // -- Classify inliers by their final chi2 error
+    int num_inliers = 0;
+    for (int i = 0; i < N; i++)
+    {
+        const Eigen::Vector3d pc = T_c_w * pts_3d[i];
+        if (pc(2) < 1e-6)
+            continue;
+        const Eigen::Vector2d e(fx * pc(0) / pc(2) + cx - pts_2d[i](0),
+                                fy * pc(1) / pc(2) + cy - pts_2d[i](1));
+        if (e.squaredNorm() <= chi2_threshold)
+        {
+            is_inlier[i] = true;
+            num_inliers++;
+        }
+    }
+    return num_inliers;
+}
+
+int optimizePoseOnly(
+    const vector<cv::Point2f> &pts_2d,
+    const vector<cv::Point3f> &pts_3d,
+    const cv::Mat &K,
+    cv::Mat &T_w_c,
+    vector<bool> &is_inlier,
+    int max_iters,
+    double chi2_threshold)
+{
+    // Change data format from OpenCV to Eigen
+    const int N = pts_2d.size();
+    vector<Eigen::Vector2d> eig_pts_2d(N);
+    vector<Eigen::Vector3d> eig_pts_3d(N);
+    for (int i = 0; i < N; i++)
+    {
+        eig_pts_2d[i] << pts_2d[i].x, pts_2d[i].y;
+        eig_pts_3d[i] << pts_3d[i].x, pts_3d[i].y, pts_3d[i].z;
+    }
+    Sophus::SE3 T_c_w = basics::transT_cv2sophus(T_w_c.inv());
+
+    // Optimize
+    int num_inliers = optimizePoseOnly(
+        eig_pts_2d, eig_pts_3d,
+        K.at<double>(0, 0), K.at<double>(1, 1), K.at<double>(0, 2), K.at<double>(1, 2),
+        T_c_w, is_inlier, max_iters, chi2_threshold);
+
+    // Change data format back to OpenCV
+    T_w_c = basics::transT_sophus2cv(T_c_w).inv();
+    return num_inliers;
+}
+
+} // namespace optimization
+} // namespace my_slam
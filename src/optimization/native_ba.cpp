@@ -0,0 +1,580 @@
+
+#include "my_slam/optimization/native_ba.h"
+
+#include "my_slam/basics/eigen_funcs.h"
+
+#include <Eigen/Dense>
+#include <Eigen/Sparse>
+#include <Eigen/IterativeLinearSolvers>
+
+#include <limits>
+#include <thread>
+
+namespace my_slam
+{
+namespace optimization
+{
+
+template <int kPoseDim, int kPointDim, int kResDim>
+NativeBundleAdjuster<kPoseDim, kPointDim, kResDim>::NativeBundleAdjuster(
+    double fx, double fy, double cx, double cy,
+    const InfoMatrix &information, double huber_delta)
+    : fx_(fx), fy_(fy), cx_(cx), cy_(cy), information_(information), huber_delta_(huber_delta)
+{
+    static_assert(kPoseDim == 6 && kPointDim == 3 && kResDim == 2,
+                  "NativeBundleAdjuster: only SE3 pose, 3d point and pixel error are implemented.");
+}
+
+template <int kPoseDim, int kPointDim, int kResDim>
+int NativeBundleAdjuster<kPoseDim, kPointDim, kResDim>::addPose(const Sophus::SE3 &T_c_w, bool is_fixed)
+{
+    poses_.push_back(T_c_w);
+    is_pose_fixed_.push_back(is_fixed);
+    return poses_.size() - 1;
+}
+
+template <int kPoseDim, int kPointDim, int kResDim>
+int NativeBundleAdjuster<kPoseDim, kPointDim, kResDim>::addPoint(const PointVec &pos, bool is_fixed)
+{
+    points_.push_back(pos);
+    is_point_fixed_.push_back(is_fixed);
+    return points_.size() - 1;
+}
+
+template <int kPoseDim, int kPointDim, int kResDim>
+void NativeBundleAdjuster<kPoseDim, kPointDim, kResDim>::addObservation(int pose_idx, int point_idx, const ResVec &uv)
+{
+    Observation obs;
+    obs.pose_idx = pose_idx;
+    obs.point_idx = point_idx;
+    obs.uv = uv;
+    observations_.push_back(obs);
+    is_obs_active_.push_back(true);
+}
+
+template <int kPoseDim, int kPointDim, int kResDim>
+double NativeBundleAdjuster<kPoseDim, kPointDim, kResDim>::computeChi2(int obs_idx) const
+{
+    const Observation &obs = observations_[obs_idx];
+    ResVec err;
+    if (!linearizeOne_(poses_[obs.pose_idx], points_[obs.point_idx], obs.uv, err, nullptr, nullptr))
+        return std::numeric_limits<double>::infinity();
+    return err.dot(information_ * err);
+}
+
+template <int kPoseDim, int kPointDim, int kResDim>
+template <typename Func>
+void NativeBundleAdjuster<kPoseDim, kPointDim, kResDim>::parallelFor_(int n, const Func &func) const
+{
+    constexpr int kMinItemsPerThread = 256; // Below this, the cost of starting a thread dominates.
+    const int num_threads = std::max(1, std::min(num_threads_, n / kMinItemsPerThread));
+    if (num_threads == 1)
+    {
+        func(0, n);
+        return;
+    }
+    vector<std::thread> threads;
+    const int chunk = (n + num_threads - 1) / num_threads;
+    for (int t = 1; t < num_threads; t++)
+        threads.emplace_back(func, std::min(n, t * chunk), std::min(n, (t + 1) * chunk));
+    func(0, std::min(n, chunk));
+    for (std::thread &thread : threads)
+        thread.join();
+}
+
+template <int kPoseDim, int kPointDim, int kResDim>
+bool NativeBundleAdjuster<kPoseDim, kPointDim, kResDim>::linearizeOne_(
+    const Sophus::SE3 &T_c_w, const PointVec &p_w, const ResVec &uv,
+    ResVec &err, PoseJacobian *J_pose, PointJacobian *J_point) const
+{
+    const Eigen::Vector3d pc = T_c_w * p_w;
+    const double x = pc(0), y = pc(1), z = pc(2);
+    if (z < 1e-6)
+        return false; // point is behind the camera
+    const double inv_z = 1.0 / z, inv_z2 = inv_z * inv_z;
+    err << fx_ * x * inv_z + cx_ - uv(0),
+        fy_ * y * inv_z + cy_ - uv(1);
+    if (J_pose == nullptr)
+        return true;
+
+    // Jacobian of the projection wrt the point in camera frame
+    Eigen::Matrix<double, 2, 3> J_proj;
+    J_proj << fx_ * inv_z, 0, -fx_ * x * inv_z2,
+        0, fy_ * inv_z, -fy_ * y * inv_z2;
+
+    // Wrt the left perturbation on se3 = [rho, phi]: d(pc)/d(xi) = [I, -pc^]
+    (*J_pose) << J_proj, J_proj * Sophus::SO3::hat(-pc);
+
+    // Wrt the point in world frame: d(pc)/d(p_w) = R_c_w
+    (*J_point) = J_proj * T_c_w.rotation_matrix();
+    return true;
+}
+
+template <int kPoseDim, int kPointDim, int kResDim>
+void NativeBundleAdjuster<kPoseDim, kPointDim, kResDim>::robustify_(double chi2, double &weight, double &cost) const
+{
+    const double delta2 = huber_delta_ * huber_delta_;
+    if (huber_delta_ <= 0 || chi2 <= delta2)
+    {
+        weight = 1.0;
+        cost = chi2;
+    }
+    else
+    {
+        const double e = sqrt(chi2);
+        weight = huber_delta_ / e;
+        cost = 2 * huber_delta_ * e - delta2;
+    }
+}
+
+template <int kPoseDim, int kPointDim, int kResDim>
+double NativeBundleAdjuster<kPoseDim, kPointDim, kResDim>::computeCost_(
+    const AlignedVector<Sophus::SE3> &poses, const AlignedVector<PointVec> &points) const
+{
+    const int num_obs = observations_.size();
+    vector<double> costs(num_obs, 0.0);
+    parallelFor_(num_obs, [&](int begin, int end) {
+        ResVec err;
+        double weight;
+        for (int k = begin; k < end; k++)
+        {
+            const Observation &obs = observations_[k];
+            if (is_obs_active_[k] &&
+                linearizeOne_(poses[obs.pose_idx], points[obs.point_idx], obs.uv, err, nullptr, nullptr))
+                robustify_(err.dot(information_ * err), weight, costs[k]);
+        }
+    });
+    double cost = 0;
+    for (double c : costs)
+        cost += c;
+    return cost;
+}
+
+template <int kPoseDim, int kPointDim, int kResDim>
+void NativeBundleAdjuster<kPoseDim, kPointDim, kResDim>::buildNormalEquation_()
+{
+    const int num_obs = observations_.size();
+
+    // -- Residuals, weights and Jacobians. Each observation is independent.
+    parallelFor_(num_obs, [&](int begin, int end) {
+        double cost;
+        for (int k = begin; k < end; k++)
+        {
+            const Observation &obs = observations_[k];
+            if (is_obs_active_[k] &&
+                linearizeOne_(poses_[obs.pose_idx], points_[obs.point_idx], obs.uv,
+                              errs_[k], &J_poses_[k], &J_points_[k]))
+            {
+                robustify_(errs_[k].dot(information_ * errs_[k]), weights_[k], cost);
+            }
+            else
+            {
+                weights_[k] = 0;
+                errs_[k].setZero();
+                J_poses_[k].setZero();
+                J_points_[k].setZero();
+            }
+        }
+    });
+
+    // -- Point blocks. Each point owns its own range of observations, so they're also evaluated in parallel.
+    const int num_points = points_.size();
+    parallelFor_(num_points, [&](int begin, int end) {
+        for (int l = begin; l < end; l++)
+        {
+            H_ll_[l].setZero();
+            b_l_[l].setZero();
+            for (int i = point_begin_[l]; i < point_begin_[l + 1]; i++)
+            {
+                const int k = obs_by_point_[i];
+                const Eigen::Matrix<double, kPointDim, kResDim> JtW = weights_[k] * J_points_[k].transpose() * information_;
+                if (!is_point_fixed_[l])
+                {
+                    H_ll_[l].noalias() += JtW * J_points_[k];
+                    b_l_[l].noalias() -= JtW * errs_[k];
+                }
+                if (!is_point_fixed_[l] && pose_col_[observations_[k].pose_idx] >= 0)
+                    H_pl_[k].noalias() = (weights_[k] * J_poses_[k].transpose() * information_) * J_points_[k];
+                else
+                    H_pl_[k].setZero();
+            }
+        }
+    });
+
+    // -- Pose blocks. Observations of a pose are scattered, so accumulate them sequentially.
+    for (PoseBlock &H : H_pp_)
+        H.setZero();
+    for (PoseVec &b : b_p_)
+        b.setZero();
+    for (int k = 0; k < num_obs; k++)
+    {
+        const int pose_idx = observations_[k].pose_idx;
+        if (pose_col_[pose_idx] < 0 || weights_[k] == 0)
+            continue;
+        const Eigen::Matrix<double, kPoseDim, kResDim> JtW = weights_[k] * J_poses_[k].transpose() * information_;
+        H_pp_[pose_idx].noalias() += JtW * J_poses_[k];
+        b_p_[pose_idx].noalias() -= JtW * errs_[k];
+    }
+}
+
+template <int kPoseDim, int kPointDim, int kResDim>
+bool NativeBundleAdjuster<kPoseDim, kPointDim, kResDim>::solveDamped_(
+    double lambda, LinearSolverType solver_type,
+    AlignedVector<PoseVec> &dx_poses, AlignedVector<PointVec> &dx_points) const
+{
+    const int num_points = points_.size();
+    const int num_poses = poses_.size();
+    const int dim = kPoseDim * num_free_poses_;
+
+    // -- Schur complement: S = Hpp - Hpl * Hll^-1 * Hpl^T, r = bp - Hpl * Hll^-1 * bl
+    AlignedVector<PointBlock> H_ll_inv(num_points);
+    AlignedVector<PosePointBlock> Y(observations_.size()); // Hpl * Hll^-1 of each observation
+    for (int l = 0; l < num_points; l++)
+    {
+        if (is_point_fixed_[l])
+            continue;
+        const PointBlock H = H_ll_[l] + lambda * PointBlock::Identity();
+        bool is_invertible;
+        double det;
+        H.computeInverseAndDetWithCheck(H_ll_inv[l], det, is_invertible);
+        if (!is_invertible)
+            return false;
+        for (int i = point_begin_[l]; i < point_begin_[l + 1]; i++)
+        {
+            const int k = obs_by_point_[i];
+            Y[k].noalias() = H_pl_[k] * H_ll_inv[l];
+        }
+    }
+
+    Eigen::VectorXd r(dim);
+    for (int i = 0; i < num_poses; i++)
+        if (pose_col_[i] >= 0)
+            r.segment<kPoseDim>(kPoseDim * pose_col_[i]) = b_p_[i];
+
+    // Blocks of S are indexed by (row, col) of poses. Only covisible poses have a non-zero block.
+    const bool is_dense = solver_type == LinearSolverType::DENSE;
+    Eigen::MatrixXd S_dense;
+    AlignedVector<PoseBlock> S_blocks;
+    std::unordered_map<long long, int> S_block_idx;
+    auto blockOfS = [&](int row, int col) -> Eigen::Ref<PoseBlock> {
+        if (is_dense)
+            return S_dense.block<kPoseDim, kPoseDim>(kPoseDim * row, kPoseDim * col);
+        const long long key = (long long)row * num_free_poses_ + col;
+        auto it = S_block_idx.find(key);
+        if (it == S_block_idx.end())
+        {
+            it = S_block_idx.insert({key, (int)S_blocks.size()}).first;
+            S_blocks.push_back(PoseBlock::Zero());
+        }
+        return S_blocks[it->second];
+    };
+    if (is_dense)
+        S_dense.setZero(dim, dim);
+
+    for (int i = 0; i < num_poses; i++)
+        if (pose_col_[i] >= 0)
+            blockOfS(pose_col_[i], pose_col_[i]) += H_pp_[i] + lambda * PoseBlock::Identity();
+
+    for (int l = 0; l < num_points; l++)
+    {
+        if (is_point_fixed_[l])
+            continue;
+        for (int i = point_begin_[l]; i < point_begin_[l + 1]; i++)
+        {
+            const int k1 = obs_by_point_[i];
+            const int col1 = pose_col_[observations_[k1].pose_idx];
+            if (col1 < 0)
+                continue;
+            r.segment<kPoseDim>(kPoseDim * col1).noalias() -= Y[k1] * b_l_[l];
+            for (int j = point_begin_[l]; j < point_begin_[l + 1]; j++)
+            {
+                const int k2 = obs_by_point_[j];
+                const int col2 = pose_col_[observations_[k2].pose_idx];
+                if (col2 >= 0)
+                    blockOfS(col1, col2).noalias() -= Y[k1] * H_pl_[k2].transpose();
+            }
+        }
+    }
+
+    // -- Solve the reduced camera system
+    Eigen::VectorXd dx;
+    if (dim == 0)
+    {
+        dx.resize(0);
+    }
+    else if (is_dense)
+    {
+        Eigen::LDLT<Eigen::MatrixXd> ldlt(S_dense);
+        if (ldlt.info() != Eigen::Success)
+            return false;
+        dx = ldlt.solve(r);
+    }
+    else
+    {
+        vector<Eigen::Triplet<double>> triplets;
+        triplets.reserve(S_blocks.size() * kPoseDim * kPoseDim);
+        for (const auto &key_idx : S_block_idx)
+        {
+            const int row = key_idx.first / num_free_poses_, col = key_idx.first % num_free_poses_;
+            const PoseBlock &block = S_blocks[key_idx.second];
+            for (int c = 0; c < kPoseDim; c++)
+                for (int rr = 0; rr < kPoseDim; rr++)
+                    triplets.emplace_back(kPoseDim * row + rr, kPoseDim * col + c, block(rr, c));
+        }
+        Eigen::SparseMatrix<double> S(dim, dim);
+        S.setFromTriplets(triplets.begin(), triplets.end());
+
+        if (solver_type == LinearSolverType::PCG)
+        {
+            // With both triangles and row-major storage, Eigen parallelizes CG by OpenMP if it's enabled.
+            typedef Eigen::SparseMatrix<double, Eigen::RowMajor> RowMajorMatrix;
+            const RowMajorMatrix S_row_major(S);
+            Eigen::ConjugateGradient<RowMajorMatrix, Eigen::Lower | Eigen::Upper> cg(S_row_major);
+            dx = cg.solve(r);
+            if (cg.info() != Eigen::Success && cg.info() != Eigen::NoConvergence)
+                return false;
+        }
+        else // sparse Cholesky
+        {
+            Eigen::SimplicialLDLT<Eigen::SparseMatrix<double>> ldlt(S);
+            if (ldlt.info() != Eigen::Success)
+                return false;
+            dx = ldlt.solve(r);
+        }
+    }
+    if (!dx.allFinite())
+        return false;
+
+    // -- Back substitution: dx_l = Hll^-1 * (bl - Hpl^T * dx_p)
+    dx_poses.assign(num_poses, PoseVec::Zero());
+    for (int i = 0; i < num_poses; i++)
+        if (pose_col_[i] >= 0)
+            dx_poses[i] = dx.segment<kPoseDim>(kPoseDim * pose_col_[i]);
+
+    dx_points.assign(num_points, PointVec::Zero());
+    for (int l = 0; l < num_points; l++)
+    {
+        if (is_point_fixed_[l])
+            continue;
+        PointVec rhs = b_l_[l];
+        for (int i = point_begin_[l]; i < point_begin_[l + 1]; i++)
+        {
+            const int k = obs_by_point_[i];
+            if (pose_col_[observations_[k].pose_idx] >= 0)
+                rhs.noalias() -= H_pl_[k].transpose() * dx_poses[observations_[k].pose_idx];
+        }
+        dx_points[l].noalias() = H_ll_inv[l] * rhs;
+    }
+    return true;
+}
+
+template <int kPoseDim, int kPointDim, int kResDim>
+BASummary NativeBundleAdjuster<kPoseDim, kPointDim, kResDim>::optimize(
+    const BATermination &termination, LinearSolverType linear_solver, int num_threads)
+{
+    const int num_poses = poses_.size(), num_points = points_.size(), num_obs = observations_.size();
+    num_threads_ = num_threads > 0 ? num_threads : std::max(1u, std::thread::hardware_concurrency());
+
+    // -- Structure of the problem, which is fixed during optimization
+    pose_col_.assign(num_poses, -1);
+    num_free_poses_ = 0;
+    for (int i = 0; i < num_poses; i++)
+        if (!is_pose_fixed_[i])
+            pose_col_[i] = num_free_poses_++;
+
+    point_begin_.assign(num_points + 1, 0); // counting sort of observations by point
+    for (const Observation &obs : observations_)
+        point_begin_[obs.point_idx + 1]++;
+    for (int l = 0; l < num_points; l++)
+        point_begin_[l + 1] += point_begin_[l];
+    obs_by_point_.resize(num_obs);
+    vector<int> fill_pos(point_begin_.begin(), point_begin_.end() - 1);
+    for (int k = 0; k < num_obs; k++)
+        obs_by_point_[fill_pos[observations_[k].point_idx]++] = k;
+
+    J_poses_.resize(num_obs);
+    J_points_.resize(num_obs);
+    errs_.resize(num_obs);
+    weights_.resize(num_obs);
+    H_pl_.resize(num_obs);
+    H_pp_.resize(num_poses);
+    b_p_.resize(num_poses);
+    H_ll_.resize(num_points);
+    b_l_.resize(num_points);
+
+    if (linear_solver == LinearSolverType::AUTO)
+        linear_solver = chooseLinearSolver(num_free_poses_);
+
+    // -- Levenberg-Marquardt
+    double cost = computeCost_(poses_, points_);
+    BATerminationChecker checker(termination, cost);
+    double lambda = -1, nu = 2;
+    constexpr int kMaxTrialsPerIter = 10;
+    AlignedVector<PoseVec> dx_poses;
+    AlignedVector<PointVec> dx_points;
+    AlignedVector<Sophus::SE3> new_poses(num_poses);
+    AlignedVector<PointVec> new_points(num_points);
+    for (int iter = 0; iter < termination.max_iters; iter++)
+    {
+        buildNormalEquation_();
+        if (lambda < 0) // Initial damping is relative to the scale of the Hessian.
+        {
+            double max_diag = 0;
+            for (const PoseBlock &H : H_pp_)
+                max_diag = std::max(max_diag, H.diagonal().maxCoeff());
+            for (const PointBlock &H : H_ll_)
+                max_diag = std::max(max_diag, H.diagonal().maxCoeff());
+            lambda = 1e-5 * std::max(max_diag, 1.0);
+        }
+
+        bool is_accepted = false;
+        double new_cost = cost, step_norm2 = 0;
+        for (int trial = 0; trial < kMaxTrialsPerIter && !is_accepted; trial++)
+        {
+            if (solveDamped_(lambda, linear_solver, dx_poses, dx_points))
+            {
+                double predicted_decrease = 0;
+                step_norm2 = 0;
+                for (int i = 0; i < num_poses; i++)
+                {
+                    new_poses[i] = Sophus::SE3::exp(dx_poses[i]) * poses_[i];
+                    predicted_decrease += dx_poses[i].dot(lambda * dx_poses[i] + b_p_[i]);
+                    step_norm2 += dx_poses[i].squaredNorm();
+                }
+                for (int l = 0; l < num_points; l++)
+                {
+                    new_points[l] = points_[l] + dx_points[l];
+                    predicted_decrease += dx_points[l].dot(lambda * dx_points[l] + b_l_[l]);
+                    step_norm2 += dx_points[l].squaredNorm();
+                }
+                new_cost = computeCost_(new_poses, new_points);
+                const double rho = (cost - new_cost) / std::max(predicted_decrease, 1e-12);
+                if (new_cost < cost && rho > 0)
+                {
+                    is_accepted = true;
+                    lambda *= std::max(1.0 / 3.0, 1.0 - std::pow(2 * rho - 1, 3));
+                    nu = 2;
+                    break;
+                }
+            }
+            lambda *= nu;
+            nu *= 2;
+        }
+        if (is_accepted)
+        {
+            poses_.swap(new_poses);
+            points_.swap(new_points);
+            cost = new_cost;
+        }
+        if (checker.update(cost, is_accepted ? sqrt(step_norm2) : 0))
+            break;
+    }
+    return checker.getSummary();
+}
+
+template class NativeBundleAdjuster<6, 3, 2>;
+
+BASummary bundleAdjustmentNative(
+    const vector<vector<cv::Point2f *>> &v_pts_2d,
+    const vector<vector<int>> &v_pts_2d_to_3d_idx,
+    const cv::Mat &K,
+    std::unordered_map<int, cv::Point3f *> &pts_3d,
+    vector<cv::Mat *> &v_camera_g2o_poses,
+    const cv::Mat &information_matrix,
+    bool is_fix_map_pts, bool is_update_map_pts,
+    const BAOptions &options,
+    vector<vector<bool>> *v_is_outlier)
+{
+    typedef NativeBundleAdjuster<6, 3, 2> Adjuster;
+    Adjuster::InfoMatrix information;
+    information << information_matrix.at<double>(0, 0), information_matrix.at<double>(0, 1),
+        information_matrix.at<double>(1, 0), information_matrix.at<double>(1, 1);
+    Adjuster adjuster(K.at<double>(0, 0), K.at<double>(1, 1), K.at<double>(0, 2), K.at<double>(1, 2), information);
+
+    // -- Add variables
+    const int num_frames = v_camera_g2o_poses.size();
+    for (int i = 0; i < num_frames; i++)
+        adjuster.addPose(basics::transT_cv2sophus((*v_camera_g2o_poses[i]).inv()),
+                         options.is_fix_first_pose && i == 0);
+
+    std::unordered_map<int, int> pts3dID_to_idx;
+    for (auto it = pts_3d.begin(); it != pts_3d.end(); it++)
+    {
+        const cv::Point3f *p = it->second;
+        pts3dID_to_idx[it->first] = adjuster.addPoint(Eigen::Vector3d(p->x, p->y, p->z), is_fix_map_pts);
+    }
+
+    // -- Add observations
+    for (int ith_frame = 0; ith_frame < num_frames; ith_frame++)
+    {
+        const int num_pts_2d = v_pts_2d[ith_frame].size();
+        for (int j = 0; j < num_pts_2d; j++)
+        {
+            const cv::Point2f *p = v_pts_2d[ith_frame][j];
+            auto it_idx = pts3dID_to_idx.find(v_pts_2d_to_3d_idx[ith_frame][j]);
+            if (it_idx == pts3dID_to_idx.end())
+                throw std::runtime_error("native_ba.cpp::bundleAdjustmentNative: observed point " +
+                                         std::to_string(v_pts_2d_to_3d_idx[ith_frame][j]) + " is not in pts_3d.");
+            adjuster.addObservation(ith_frame, it_idx->second, Eigen::Vector2d(p->x, p->y));
+        }
+    }
+
+    // -- Optimize
+    BASummary summary = adjuster.optimize(options.termination, options.linear_solver, options.num_threads);
+    if (options.is_remove_outliers)
+    {
+        // Two-stage BA: deactivate outliers, and then optimize inliers without the kernel
+        auto rejectOutliers = [&adjuster, &options]() {
+            int num_outliers = 0;
+            for (int k = 0; k < adjuster.numObservations(); k++)
+                if (adjuster.isObservationActive(k) && adjuster.computeChi2(k) > options.outlier_chi2_threshold)
+                {
+                    adjuster.setObservationActive(k, false);
+                    num_outliers++;
+                }
+            return num_outliers;
+        };
+        summary.num_outliers = rejectOutliers();
+        BATermination termination2 = options.termination;
+        if (termination2.max_time_ms > 0)
+            termination2.max_time_ms -= summary.time_ms;
+        if (options.termination.max_time_ms <= 0 || termination2.max_time_ms > 0)
+        {
+            adjuster.setHuberDelta(0);
+            const BASummary summary2 = adjuster.optimize(termination2, options.linear_solver, options.num_threads);
+            summary.iterations += summary2.iterations;
+            summary.time_ms += summary2.time_ms;
+            summary.final_cost = summary2.final_cost;
+            summary.stop_reason = summary2.stop_reason;
+            summary.num_outliers += rejectOutliers();
+        }
+        if (v_is_outlier != nullptr)
+        {
+            v_is_outlier->assign(num_frames, vector<bool>());
+            int k = 0; // Observations were added in the order of frames
+            for (int ith_frame = 0; ith_frame < num_frames; ith_frame++)
+                for (int j = 0; j < (int)v_pts_2d[ith_frame].size(); j++)
+                    (*v_is_outlier)[ith_frame].push_back(!adjuster.isObservationActive(k++));
+        }
+    }
+    printf("BA (native): Number of frames = %d, 3d points = %d, %s\n",
+           num_frames, adjuster.numPoints(), summary.toString().c_str());
+
+    // -- Get the results
+    for (int i = 0; i < num_frames; i++)
+    {
+        cv::Mat pose_src = basics::transT_sophus2cv(adjuster.getPose(i)).inv();
+        pose_src.copyTo(*v_camera_g2o_poses[i]);
+    }
+    for (auto it = pts_3d.begin(); is_update_map_pts && it != pts_3d.end(); it++)
+    {
+        const Eigen::Vector3d &p = adjuster.getPoint(pts3dID_to_idx.at(it->first));
+        it->second->x = p(0);
+        it->second->y = p(1);
+        it->second->z = p(2);
+    }
+    return summary;
+}
+
+} // namespace optimization
+} // namespace my_slam
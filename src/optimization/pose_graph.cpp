@@ -0,0 +1,96 @@
+#include "my_slam/optimization/pose_graph.h"
+
+#include <g2o/core/block_solver.h>
+#include <g2o/core/optimization_algorithm_levenberg.h>
+#include <g2o/solvers/eigen/linear_solver_eigen.h>
+#include <g2o/types/sim3/types_seven_dof_expmap.h>
+
+namespace my_slam
+{
+namespace optimization
+{
+
+Sim3 Sim3::fromCamPose(const cv::Mat &T_w_c)
+{
+    const cv::Mat T_c_w = T_w_c.inv();
+    Eigen::Matrix3d R;
+    Eigen::Vector3d t;
+    for (int i = 0; i < 3; i++)
+    {
+        for (int j = 0; j < 3; j++)
+            R(i, j) = T_c_w.at<double>(i, j);
+        t(i) = T_c_w.at<double>(i, 3);
+    }
+    return Sim3(R, t, 1.0);
+}
+
+cv::Mat Sim3::toCamPose() const
+{
+    // S_c_w = [s*R, t] is the same camera as T_c_w = [R, t/s] in a world scaled by s.
+    const Eigen::Matrix3d R_w_c = R.transpose();
+    const Eigen::Vector3d t_w_c = -R_w_c * t / s;
+    cv::Mat T_w_c = cv::Mat::eye(4, 4, CV_64F);
+    for (int i = 0; i < 3; i++)
+    {
+        for (int j = 0; j < 3; j++)
+            T_w_c.at<double>(i, j) = R_w_c(i, j);
+        T_w_c.at<double>(i, 3) = t_w_c(i);
+    }
+    return T_w_c;
+}
+
+void optimizeSim3PoseGraph(std::map<int, Sim3> &S_c_w,
+                           const vector<Sim3Edge> &edges,
+                           int fixed_id,
+                           int max_iters)
+{
+    // Solver. The graph only has poses, and is very sparse.
+    typedef g2o::BlockSolver_7_3 Block;
+    Block::LinearSolverType *linear_solver = new g2o::LinearSolverEigen<Block::PoseMatrixType>();
+    Block *solver_ptr = new Block(linear_solver);
+    g2o::OptimizationAlgorithmLevenberg *solver = new g2o::OptimizationAlgorithmLevenberg(solver_ptr);
+    g2o::SparseOptimizer optimizer;
+    optimizer.setAlgorithm(solver);
+
+    // Vertices. The scale is free, since it drifts in monocular VO.
+    std::map<int, g2o::VertexSim3Expmap *> vertices;
+    for (const auto &it : S_c_w)
+    {
+        g2o::VertexSim3Expmap *v = new g2o::VertexSim3Expmap();
+        v->setEstimate(g2o::Sim3(it.second.R, it.second.t, it.second.s));
+        v->setId(vertices.size());
+        v->setFixed(it.first == fixed_id);
+        v->_fix_scale = false;
+        optimizer.addVertex(v);
+        vertices[it.first] = v;
+    }
+
+    // Edges. g2o's EdgeSim3 measures S_1_0 = S_1_w * S_0_w^-1, where 0 and 1 are the indices of its vertices.
+    int edge_id = 0;
+    for (const Sim3Edge &e : edges)
+    {
+        auto it_from = vertices.find(e.id_from), it_to = vertices.find(e.id_to);
+        if (it_from == vertices.end() || it_to == vertices.end())
+            throw std::runtime_error("pose_graph.cpp::optimizeSim3PoseGraph: edge connects a keyframe not in the graph.");
+        g2o::EdgeSim3 *edge = new g2o::EdgeSim3();
+        edge->setId(edge_id++);
+        edge->setVertex(0, it_from->second);
+        edge->setVertex(1, it_to->second);
+        edge->setMeasurement(g2o::Sim3(e.S_to_from.R, e.S_to_from.t, e.S_to_from.s));
+        edge->setInformation(Eigen::Matrix<double, 7, 7>::Identity());
+        optimizer.addEdge(edge);
+    }
+
+    optimizer.initializeOptimization();
+    optimizer.optimize(max_iters);
+
+    // Output
+    for (auto &it : S_c_w)
+    {
+        const g2o::Sim3 S = vertices[it.first]->estimate();
+        it.second = Sim3(S.rotation().toRotationMatrix(), S.translation(), S.scale());
+    }
+}
+
+} // namespace optimization
+} // namespace my_slam
@@ -1,5 +1,9 @@
 
 #include "my_slam/vo/frame.h"
+#include "my_slam/basics/config.h"
+#include <fstream>
+#include <opencv2/imgproc/imgproc.hpp>
+#include <opencv2/video/tracking.hpp>
 
 namespace my_slam
 {
@@ -8,16 +12,88 @@ namespace vo
 
 int Frame::factory_id_ = 0;
 
+basics::ObjectPool<Frame> &Frame::pool()
+{
+    // Never destroyed, so it outlives every Frame::Ptr.
+    static basics::ObjectPool<Frame> *pool = new basics::ObjectPool<Frame>(256);
+    return *pool;
+}
+
+Frame::Ptr Frame::create()
+{
+    return pool().share(pool().create());
+}
+
 Frame::Ptr Frame::createFrame(cv::Mat rgb_img, geometry::Camera::Ptr camera, double time_stamp)
 {
-    Frame::Ptr frame(new Frame());
+    Frame::Ptr frame = create();
     frame->rgb_img_ = rgb_img;
+    frame->image_size_ = rgb_img.size();
     frame->id_ = factory_id_++;
     frame->time_stamp_ = time_stamp;
     frame->camera_ = camera;
     return frame;
 }
 
+void Frame::computeBoW(const geometry::Vocabulary &vocabulary)
+{
+    static const int bow_node_levels_up = basics::Config::get<int>("bow_node_levels_up");
+    if (bow_vec_.empty())
+        vocabulary.transform(descriptors_, bow_vec_, feat_vec_, bow_node_levels_up);
+}
+
+void Frame::buildOpticalFlowPyramid(const cv::Size &win_size, int max_level)
+{
+    if (!optical_flow_pyramid_.empty() || rgb_img_.empty())
+        return;
+    cv::Mat gray = rgb_img_;
+    if (rgb_img_.channels() == 3)
+        cv::cvtColor(rgb_img_, gray, cv::COLOR_BGR2GRAY);
+    cv::buildOpticalFlowPyramid(gray, optical_flow_pyramid_, win_size, max_level, false); // Levels are images only.
+}
+
+void Frame::refineKeyPointsAtFullResolution()
+{
+    if (full_res_img_.empty())
+        return;
+    if (!keypoints_.empty())
+    {
+        cv::Mat gray = full_res_img_;
+        if (full_res_img_.channels() == 3)
+            cv::cvtColor(full_res_img_, gray, cv::COLOR_BGR2GRAY);
+
+        // Pixel centers are kept by cv::resize: u_full = (u + 0.5) / scale - 0.5
+        const double scale = (double)image_size_.width / full_res_img_.cols;
+        vector<cv::Point2f> pts;
+        for (const cv::KeyPoint &kpt : keypoints_)
+            pts.push_back(cv::Point2f((kpt.pt.x + 0.5) / scale - 0.5, (kpt.pt.y + 0.5) / scale - 0.5));
+        cv::cornerSubPix(gray, pts, cv::Size(5, 5), cv::Size(-1, -1),
+                         cv::TermCriteria(cv::TermCriteria::COUNT + cv::TermCriteria::EPS, 20, 0.01));
+        vector<cv::KeyPoint> refined = keypoints_;
+        for (int i = 0; i < refined.size(); i++)
+        {
+            const cv::Point2f pt((pts[i].x + 0.5) * scale - 0.5, (pts[i].y + 0.5) * scale - 0.5);
+            if (cv::norm(pt - refined[i].pt) <= 1.0)
+                refined[i].pt = pt;
+        }
+
+        // Descriptors computed before, e.g. for PnP of a frame which then becomes a keyframe, are recomputed.
+        if (descriptors_.empty())
+            keypoints_ = refined;
+        else
+        {
+            cv::Mat descriptors;
+            geometry::calcDescriptors(rgb_img_, refined, descriptors);
+            if (refined.size() == keypoints_.size())
+            {
+                keypoints_ = refined;
+                descriptors_ = descriptors;
+            }
+        }
+    }
+    full_res_img_.release();
+}
+
 cv::Point2f Frame::projectWorldPointToImage(const cv::Point3f &p_world)
 {
     cv::Point3f p_cam = basics::preTranslatePoint3f(p_world, T_w_c_.inv()); // T_c_w * p_w = p_c
@@ -32,7 +108,7 @@ bool Frame::isInFrame(const cv::Point3f &p_world)
     if (p_cam.z < 0)
         return false;
     cv::Point2f pixel = geometry::cam2pixel(p_cam, camera_->K_);
-    return pixel.x > 0 && pixel.y > 0 && pixel.x < rgb_img_.cols && pixel.y < rgb_img_.rows;
+    return pixel.x > 0 && pixel.y > 0 && pixel.x < image_size_.width && pixel.y < image_size_.height;
 }
 
 bool Frame::isInFrame(const cv::Mat &p_world)
@@ -45,5 +121,98 @@ cv::Mat Frame::getCamCenter()
     return basics::getPosFromT(T_w_c_);
 }
 
+// ------------------- Memory -------------------
+
+namespace
+{
+// Clear a vector and free its memory, which `clear` keeps.
+template <typename T>
+void freeVector(vector<T> &v) { vector<T>().swap(v); }
+} // namespace
+
+void Frame::releaseScratch()
+{
+    freeVector(kpts_colors_);
+    freeVector(matches_with_ref_);
+    freeVector(inliers_matches_with_ref_);
+    freeVector(triangulation_angles_of_inliers_);
+    freeVector(inliers_matches_for_3d_);
+    freeVector(inliers_pts3d_);
+    freeVector(matches_with_map_);
+}
+
+void Frame::spillDescriptors(const string &filename)
+{
+    if (isDescriptorsSpilled() || descriptors_.empty())
+        return;
+    std::ofstream fout(filename, std::ios::binary);
+    if (!fout.is_open())
+        throw std::runtime_error("frame.cpp::spillDescriptors: cannot open " + filename);
+    const int32_t header[3] = {descriptors_.rows, descriptors_.cols, descriptors_.type()};
+    fout.write(reinterpret_cast<const char *>(header), sizeof(header));
+    for (int i = 0; i < descriptors_.rows; i++)
+        fout.write(reinterpret_cast<const char *>(descriptors_.ptr(i)), descriptors_.cols * descriptors_.elemSize());
+    if (!fout)
+        throw std::runtime_error("frame.cpp::spillDescriptors: failed to write " + filename);
+    descriptors_.release();
+    spilled_descriptors_file_ = filename;
+}
+
+cv::Mat Frame::readSpilledDescriptors() const
+{
+    std::ifstream fin(spilled_descriptors_file_, std::ios::binary | std::ios::ate);
+    const std::streamoff file_bytes = fin.tellg();
+    fin.seekg(0);
+    int32_t header[3];
+    if (!fin.read(reinterpret_cast<char *>(header), sizeof(header)))
+        throw std::runtime_error("frame.cpp::readSpilledDescriptors: cannot read " + spilled_descriptors_file_);
+
+    // Check the header before allocating by it, and the payload after reading it.
+    if (header[0] < 0 || header[1] < 0 || header[2] != CV_MAT_TYPE(header[2]))
+        throw std::runtime_error("frame.cpp::readSpilledDescriptors: bad header in " + spilled_descriptors_file_);
+    const std::streamoff payload_bytes = (std::streamoff)header[0] * header[1] * CV_ELEM_SIZE(header[2]);
+    if (payload_bytes != file_bytes - (std::streamoff)sizeof(header))
+        throw std::runtime_error("frame.cpp::readSpilledDescriptors: size of " + spilled_descriptors_file_ +
+                                 " doesn't match its header");
+    cv::Mat descriptors(header[0], header[1], header[2]);
+    if (payload_bytes > 0 &&
+        (!fin.read(reinterpret_cast<char *>(descriptors.data), payload_bytes) || fin.gcount() != payload_bytes))
+        throw std::runtime_error("frame.cpp::readSpilledDescriptors: failed to read " + spilled_descriptors_file_);
+    return descriptors;
+}
+
+void Frame::restoreDescriptors()
+{
+    if (!isDescriptorsSpilled())
+        return;
+    descriptors_ = readSpilledDescriptors();
+    spilled_descriptors_file_.clear();
+}
+
+size_t Frame::memoryBytes() const
+{
+    size_t bytes = sizeof(Frame);
+    bytes += rgb_img_.total() * rgb_img_.elemSize();
+    bytes += full_res_img_.total() * full_res_img_.elemSize();
+    for (const cv::Mat &level : optical_flow_pyramid_)
+        bytes += level.total() * level.elemSize();
+    bytes += descriptors_.total() * descriptors_.elemSize();
+    bytes += keypoints_.capacity() * sizeof(cv::KeyPoint);
+    bytes += kpts_colors_.capacity() * (sizeof(vector<unsigned char>) + 3);
+    bytes += (matches_with_ref_.capacity() + inliers_matches_with_ref_.capacity() +
+              inliers_matches_for_3d_.capacity() + matches_with_map_.capacity()) *
+             sizeof(cv::DMatch);
+    bytes += triangulation_angles_of_inliers_.capacity() * sizeof(double);
+    bytes += inliers_pts3d_.capacity() * sizeof(cv::Point3f);
+
+    constexpr size_t kHashNodeOverhead = 2 * sizeof(void *); // next pointer, and a bucket
+    bytes += inliers_to_mappt_connections_.size() * (sizeof(std::pair<int, PtConn>) + kHashNodeOverhead);
+    constexpr size_t kTreeNodeOverhead = 4 * sizeof(void *);
+    bytes += bow_vec_.size() * (sizeof(std::pair<int, double>) + kTreeNodeOverhead);
+    for (const auto &it : feat_vec_)
+        bytes += sizeof(std::pair<int, vector<int>>) + kTreeNodeOverhead + it.second.capacity() * sizeof(int);
+    return bytes;
+}
+
 } // namespace vo
 } // namespace my_slam
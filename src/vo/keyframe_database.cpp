@@ -0,0 +1,68 @@
+#include "my_slam/vo/keyframe_database.h"
+
+namespace my_slam
+{
+namespace vo
+{
+
+void KeyFrameDatabase::add(int keyframe_id, const geometry::BowVector &bow_vec)
+{
+    if (bow_vecs_.count(keyframe_id))
+        erase(keyframe_id);
+    bow_vecs_[keyframe_id] = bow_vec;
+    for (const auto &it : bow_vec)
+        inverted_file_[it.first].push_back(keyframe_id);
+}
+
+void KeyFrameDatabase::erase(int keyframe_id)
+{
+    auto it_kf = bow_vecs_.find(keyframe_id);
+    if (it_kf == bow_vecs_.end())
+        return;
+    for (const auto &it : it_kf->second)
+    {
+        std::list<int> &keyframe_ids = inverted_file_[it.first];
+        keyframe_ids.remove(keyframe_id);
+        if (keyframe_ids.empty())
+            inverted_file_.erase(it.first);
+    }
+    bow_vecs_.erase(it_kf);
+}
+
+vector<std::pair<int, double>> KeyFrameDatabase::query(const geometry::BowVector &bow_vec, int max_results,
+                                                       const std::function<bool(int)> &is_candidate,
+                                                       double min_common_words_ratio) const
+{
+    // Count the shared words of each keyframe
+    std::unordered_map<int, int> num_common_words;
+    int max_common_words = 0;
+    for (const auto &it : bow_vec)
+    {
+        auto it_word = inverted_file_.find(it.first);
+        if (it_word == inverted_file_.end())
+            continue;
+        for (int keyframe_id : it_word->second)
+        {
+            if (is_candidate && !is_candidate(keyframe_id))
+                continue;
+            max_common_words = std::max(max_common_words, ++num_common_words[keyframe_id]);
+        }
+    }
+
+    // Score the keyframes sharing enough words
+    vector<std::pair<int, double>> results;
+    const int min_common_words = min_common_words_ratio * max_common_words;
+    for (const auto &it : num_common_words)
+        if (it.second >= min_common_words)
+            results.push_back(std::make_pair(
+                it.first, geometry::Vocabulary::score(bow_vec, bow_vecs_.at(it.first))));
+
+    std::sort(results.begin(), results.end(),
+              [](const std::pair<int, double> &r1, const std::pair<int, double> &r2) { return r1.second > r2.second; });
+    if (results.size() > max_results)
+        results.resize(max_results);
+    return results;
+}
+
+} // namespace vo
+} // namespace my_slam
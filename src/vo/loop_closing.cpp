@@ -0,0 +1,307 @@
+#include "my_slam/vo/loop_closing.h"
+#include "my_slam/basics/config.h"
+#include "my_slam/basics/opencv_funcs.h"
+#include "my_slam/geometry/feature_match.h"
+
+#include <random>
+#include <Eigen/Geometry> // umeyama
+
+namespace my_slam
+{
+namespace vo
+{
+
+LoopClosing::LoopClosing(geometry::Vocabulary::Ptr vocabulary) : vocabulary_(vocabulary)
+{
+    min_keyframes_gap_ = basics::Config::get<int>("loop_min_keyframes_gap");
+    num_candidates_ = basics::Config::get<int>("loop_num_candidates");
+    min_matches_ = basics::Config::get<int>("loop_min_matches");
+    min_inliers_ = basics::Config::get<int>("loop_min_inliers");
+    max_reproj_err_ = basics::Config::get<double>("loop_max_reproj_err");
+    num_ransac_iters_ = 200;
+    num_keyframes_since_loop_ = min_keyframes_gap_;
+    thread_ = std::thread(&LoopClosing::run_, this);
+}
+
+LoopClosing::~LoopClosing()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        is_stop_ = true;
+    }
+    cond_.notify_one();
+    thread_.join();
+}
+
+void LoopClosing::addKeyFrame(const Frame::Ptr &keyframe, const Map::Ptr &map)
+{
+    KeyFrameSnapshot kf;
+    kf.id = keyframe->id_;
+    kf.T_c_w = keyframe->T_w_c_.inv();
+    kf.K = keyframe->camera_->K_.clone();
+    std::unordered_map<int, int> kpt_to_row;
+    for (const auto &it : keyframe->inliers_to_mappt_connections_)
+    {
+        auto it_pt = map->map_points_.find(it.second.pt_map_idx);
+        if (it_pt == map->map_points_.end())
+            continue; // point has been deleted
+        kpt_to_row[it.first] = kf.pts_2d.size();
+        kf.pts_2d.push_back(keyframe->keypoints_[it.first].pt);
+        kf.pts_3d.push_back(it_pt->second->pos_);
+        kf.descriptors.push_back(keyframe->descriptors_.row(it.first));
+    }
+
+    // BoW vector of the whole image, and feature vector of only the map points.
+    kf.bow_vec = keyframe->bow_vec_;
+    for (const auto &it : keyframe->feat_vec_)
+        for (int kpt_idx : it.second)
+        {
+            auto it_row = kpt_to_row.find(kpt_idx);
+            if (it_row != kpt_to_row.end())
+                kf.feat_vec[it.first].push_back(it_row->second);
+        }
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        queue_.push_back(kf);
+    }
+    cond_.notify_one();
+}
+
+bool LoopClosing::getLoop(Loop &loop)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (loops_.empty())
+        return false;
+    loop = loops_.front();
+    loops_.pop_front();
+    return true;
+}
+
+void LoopClosing::eraseKeyFrame(int keyframe_id)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = std::find_if(queue_.begin(), queue_.end(),
+                           [keyframe_id](const KeyFrameSnapshot &kf) { return kf.id == keyframe_id; });
+    if (it != queue_.end())
+        queue_.erase(it);
+    else
+        keyframes_to_erase_.push_back(keyframe_id);
+}
+
+void LoopClosing::eraseFromDatabase_(int keyframe_id)
+{
+    auto it_idx = database_index_.find(keyframe_id);
+    if (it_idx == database_index_.end())
+        return;
+    const int idx = it_idx->second;
+    database_index_.erase(it_idx);
+    if (vocabulary_ != nullptr)
+        keyframe_database_.erase(keyframe_id);
+    database_.erase(database_.begin() + idx);
+    for (int i = idx; i < database_.size(); i++)
+        database_index_[database_[i].id] = i;
+}
+
+void LoopClosing::run_()
+{
+    while (true)
+    {
+        KeyFrameSnapshot kf;
+        vector<int> keyframes_to_erase;
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            cond_.wait(lock, [this] { return is_stop_ || !queue_.empty(); });
+            if (is_stop_)
+                return;
+            kf = queue_.front();
+            queue_.pop_front();
+            keyframes_to_erase.swap(keyframes_to_erase_);
+        }
+        for (int keyframe_id : keyframes_to_erase)
+            eraseFromDatabase_(keyframe_id);
+
+        Loop loop;
+        num_keyframes_since_loop_++;
+        if (num_keyframes_since_loop_ >= min_keyframes_gap_ && detectLoop_(kf, loop))
+        {
+            printf("Loop closing: keyframe %d -> keyframe %d, %d inliers.\n",
+                   loop.curr_id, loop.loop_id, loop.num_inliers);
+            num_keyframes_since_loop_ = 0;
+            std::lock_guard<std::mutex> lock(mutex_);
+            loops_.push_back(loop);
+        }
+        database_index_[kf.id] = database_.size();
+        if (vocabulary_ != nullptr)
+            keyframe_database_.add(kf.id, kf.bow_vec);
+        database_.push_back(kf);
+    }
+}
+
+bool LoopClosing::detectLoop_(const KeyFrameSnapshot &curr, Loop &loop)
+{
+    if (curr.descriptors.rows < min_matches_)
+        return false;
+
+    const int num_old_keyframes = static_cast<int>(database_.size()) - min_keyframes_gap_;
+    if (num_old_keyframes <= 0)
+        return false;
+
+    // Candidates: old keyframes with the highest BoW scores, or else with the most descriptor matches.
+    vector<int> candidates; // indices in database_, the most similar first
+    if (vocabulary_ != nullptr)
+    {
+        const int max_old_id = database_[num_old_keyframes - 1].id;
+        for (const std::pair<int, double> &result : keyframe_database_.query(
+                 curr.bow_vec, num_candidates_, [max_old_id](int id) { return id <= max_old_id; }))
+            candidates.push_back(database_index_[result.first]);
+    }
+    else
+    {
+        vector<std::pair<int, int>> num_matches; // (num matches, index in database_)
+        for (int i = 0; i < num_old_keyframes; i++)
+        {
+            vector<cv::DMatch> matches;
+            matchDescriptors_(curr, database_[i], matches);
+            if (matches.size() >= min_matches_)
+                num_matches.push_back(std::make_pair(matches.size(), i));
+        }
+        std::sort(num_matches.rbegin(), num_matches.rend());
+        for (int i = 0; i < num_matches.size() && i < num_candidates_; i++)
+            candidates.push_back(num_matches[i].second);
+    }
+
+    // Verify each candidate by Sim3
+    for (int candidate : candidates)
+    {
+        const KeyFrameSnapshot &old = database_[candidate];
+        vector<cv::DMatch> matches;
+        matchDescriptors_(curr, old, matches);
+        if (matches.size() < min_matches_)
+            continue;
+        optimization::Sim3 S_wold_wcurr;
+        const int num_inliers = computeSim3_(curr, old, matches, S_wold_wcurr);
+        if (num_inliers < min_inliers_)
+            continue;
+
+        // Relative to the cameras, so the constraint doesn't depend on the world frames at the time of the snapshots.
+        const optimization::Sim3 S_curr_w = optimization::Sim3::fromCamPose(curr.T_c_w.inv());
+        const optimization::Sim3 S_old_w = optimization::Sim3::fromCamPose(old.T_c_w.inv());
+        loop.curr_id = curr.id;
+        loop.loop_id = old.id;
+        loop.num_inliers = num_inliers;
+        loop.S_loop_curr = S_old_w * S_wold_wcurr * S_curr_w.inverse();
+        return true;
+    }
+    return false;
+}
+
+void LoopClosing::matchDescriptors_(const KeyFrameSnapshot &kf1, const KeyFrameSnapshot &kf2,
+                                    vector<cv::DMatch> &matches)
+{
+    // Ratio test, and each point of kf2 is matched at most once.
+    constexpr float kRatio = 0.7;
+    if (vocabulary_ != nullptr)
+    {
+        geometry::matchFeaturesByBoW(kf1.descriptors, kf1.feat_vec, kf2.descriptors, kf2.feat_vec, matches, kRatio);
+        return;
+    }
+    matches.clear();
+    if (kf1.descriptors.empty() || kf2.descriptors.rows < 2)
+        return;
+    static cv::BFMatcher matcher(cv::NORM_HAMMING);
+    vector<vector<cv::DMatch>> knn_matches;
+    matcher.knnMatch(kf1.descriptors, kf2.descriptors, knn_matches, 2);
+    std::unordered_set<int> matched;
+    for (const vector<cv::DMatch> &knn : knn_matches)
+        if (knn.size() == 2 && knn[0].distance < kRatio * knn[1].distance && matched.insert(knn[0].trainIdx).second)
+            matches.push_back(knn[0]);
+}
+
+int LoopClosing::computeSim3_(const KeyFrameSnapshot &kf1, const KeyFrameSnapshot &kf2,
+                              const vector<cv::DMatch> &matches, optimization::Sim3 &S_w2_w1)
+{
+    const int N = matches.size();
+    if (N < 3)
+        return 0;
+    auto umeyama = [&](const vector<int> &indices) {
+        Eigen::Matrix3Xd src(3, indices.size()), dst(3, indices.size());
+        for (int k = 0; k < indices.size(); k++)
+        {
+            const cv::Point3f &p1 = kf1.pts_3d[matches[indices[k]].queryIdx];
+            const cv::Point3f &p2 = kf2.pts_3d[matches[indices[k]].trainIdx];
+            src.col(k) << p1.x, p1.y, p1.z;
+            dst.col(k) << p2.x, p2.y, p2.z;
+        }
+        const Eigen::Matrix4d T = Eigen::umeyama(src, dst, true);
+        const double s = T.block<3, 1>(0, 0).norm();
+        return optimization::Sim3(T.block<3, 3>(0, 0) / s, T.block<3, 1>(0, 3), s);
+    };
+
+    // RANSAC on minimal sets of 3 matches
+    std::mt19937 rng(0); // deterministic
+    std::uniform_int_distribution<int> uniform(0, N - 1);
+    vector<bool> is_inlier;
+    int best_num_inliers = 0;
+    for (int iter = 0; iter < num_ransac_iters_; iter++)
+    {
+        vector<int> indices{uniform(rng), uniform(rng), uniform(rng)};
+        if (indices[0] == indices[1] || indices[1] == indices[2] || indices[0] == indices[2])
+            continue;
+        const optimization::Sim3 S = umeyama(indices);
+        const int num_inliers = countSim3Inliers_(kf1, kf2, matches, S, is_inlier);
+        if (num_inliers > best_num_inliers)
+        {
+            best_num_inliers = num_inliers;
+            S_w2_w1 = S;
+        }
+    }
+    if (best_num_inliers < 3)
+        return 0;
+
+    // Refine by all inliers
+    countSim3Inliers_(kf1, kf2, matches, S_w2_w1, is_inlier);
+    vector<int> inliers;
+    for (int i = 0; i < N; i++)
+        if (is_inlier[i])
+            inliers.push_back(i);
+    const optimization::Sim3 S_refined = umeyama(inliers);
+    const int num_inliers = countSim3Inliers_(kf1, kf2, matches, S_refined, is_inlier);
+    if (num_inliers >= best_num_inliers)
+    {
+        S_w2_w1 = S_refined;
+        best_num_inliers = num_inliers;
+    }
+    return best_num_inliers;
+}
+
+int LoopClosing::countSim3Inliers_(const KeyFrameSnapshot &kf1, const KeyFrameSnapshot &kf2,
+                                   const vector<cv::DMatch> &matches, const optimization::Sim3 &S_w2_w1,
+                                   vector<bool> &is_inlier)
+{
+    // A match is an inlier if it reprojects well in both directions.
+    const optimization::Sim3 S_w1_w2 = S_w2_w1.inverse();
+    const double max_err2 = max_reproj_err_ * max_reproj_err_;
+    auto isReprojected = [max_err2](const cv::Point3f &p_w, const cv::Mat &T_c_w, const cv::Mat &K,
+                                    const cv::Point2f &pt) {
+        const cv::Point3f p_c = basics::preTranslatePoint3f(p_w, T_c_w);
+        if (p_c.z <= 0)
+            return false;
+        const double u = K.at<double>(0, 0) * p_c.x / p_c.z + K.at<double>(0, 2);
+        const double v = K.at<double>(1, 1) * p_c.y / p_c.z + K.at<double>(1, 2);
+        return (u - pt.x) * (u - pt.x) + (v - pt.y) * (v - pt.y) < max_err2;
+    };
+
+    int num_inliers = 0;
+    is_inlier.assign(matches.size(), false);
+    for (int i = 0; i < matches.size(); i++)
+    {
+        const int i1 = matches[i].queryIdx, i2 = matches[i].trainIdx;
+        is_inlier[i] = isReprojected(S_w2_w1 * kf1.pts_3d[i1], kf2.T_c_w, kf2.K, kf2.pts_2d[i2]) &&
+                       isReprojected(S_w1_w2 * kf2.pts_3d[i2], kf1.T_c_w, kf1.K, kf1.pts_2d[i1]);
+        num_inliers += is_inlier[i];
+    }
+    return num_inliers;
+}
+
+} // namespace vo
+} // namespace my_slam
@@ -19,6 +19,12 @@ void Map::insertKeyFrame(Frame::Ptr frame)
     printf("Insert keyframe!!! frame_id = %d, total keyframes = %d\n", frame->id_, (int)keyframes_.size());
 }
 
+void Map::eraseKeyFrame(int frame_id)
+{
+    keyframes_.erase(frame_id);
+    printf("Erase keyframe!!! frame_id = %d, total keyframes = %d\n", frame_id, (int)keyframes_.size());
+}
+
 void Map::insertMapPoint(MapPoint::Ptr map_point)
 {
     if (map_points_.find(map_point->id_) == map_points_.end())
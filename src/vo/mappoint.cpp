@@ -2,6 +2,8 @@
 
 #include "my_slam/common_include.h"
 #include "my_slam/vo/mappoint.h"
+#include "my_slam/basics/opencv_funcs.h"
+#include <climits>
 
 namespace my_slam
 {
@@ -18,10 +20,71 @@ MapPoint::MapPoint(
     id_ = factory_id_++;
 }
 
+MapPoint::Ptr MapPoint::create(
+    const cv::Point3f &pos, const cv::Mat &descriptor, const cv::Mat &norm,
+    unsigned char r, unsigned char g, unsigned char b)
+{
+    const Handle handle = pool().create(pos, descriptor, norm, r, g, b);
+    MapPoint::Ptr pt = pool().share(handle);
+    pt->handle_ = handle;
+    return pt;
+}
+
+basics::ObjectPool<MapPoint> &MapPoint::pool()
+{
+    // Never destroyed, so it outlives every MapPoint::Ptr.
+    static basics::ObjectPool<MapPoint> *pool = new basics::ObjectPool<MapPoint>(4096);
+    return *pool;
+}
+
 void MapPoint::setPos(const cv::Point3f &pos)
 {
     pos_ = pos;
 }
 
+void MapPoint::computeFromObservations(
+    const cv::Point3f &pos, const vector<cv::Mat> &descriptors, const vector<cv::Point3f> &cam_centers,
+    const cv::Point3f &ref_cam_center, int ref_octave, double scale_factor, int num_levels,
+    cv::Mat &descriptor, cv::Mat &norm, float &min_distance, float &max_distance)
+{
+    // -- Descriptor
+    const int n = descriptors.size();
+    if (n > 0)
+    {
+        vector<vector<int>> dists(n, vector<int>(n, 0));
+        for (int i = 0; i < n; i++)
+            for (int j = i + 1; j < n; j++)
+                dists[i][j] = dists[j][i] = cv::norm(descriptors[i], descriptors[j], cv::NORM_HAMMING);
+        int best_idx = 0, best_median = INT_MAX;
+        for (int i = 0; i < n; i++)
+        {
+            vector<int> &d = dists[i];
+            std::nth_element(d.begin(), d.begin() + (n - 1) / 2, d.end());
+            if (d[(n - 1) / 2] < best_median)
+                best_idx = i, best_median = d[(n - 1) / 2];
+        }
+        descriptor = descriptors[best_idx].clone();
+    }
+
+    // -- Norm
+    cv::Point3f sum(0, 0, 0);
+    for (const cv::Point3f &center : cam_centers)
+    {
+        const cv::Point3f v = pos - center;
+        const double len = cv::norm(v);
+        if (len > 0)
+            sum += v * (1.0 / len);
+    }
+    if (cv::norm(sum) > 0)
+        norm = basics::getNormalizedMat(basics::point3f_to_mat3x1(sum));
+
+    // -- Scale invariance range.
+    //      At octave k, the point is seen at scale_factor^k of the distance of the finest level.
+    //      So it can be matched from the distance of the finest level to that of the coarsest level.
+    const double dist = cv::norm(pos - ref_cam_center);
+    max_distance = dist * pow(scale_factor, ref_octave);
+    min_distance = max_distance / pow(scale_factor, num_levels - 1);
+}
+
 } // namespace vo
 } // namespace my_slam
@@ -1,7 +1,10 @@
 
 #include "my_slam/vo/vo.h"
 #include "my_slam/optimization/g2o_ba.h"
+#include "my_slam/optimization/motion_only_ba.h"
+#include "my_slam/optimization/direct_alignment.h"
 #include <numeric>
+#include <opencv2/video/tracking.hpp>
 
 namespace my_slam
 {
@@ -11,10 +14,72 @@ namespace vo
 VisualOdometry::VisualOdometry() : map_(new (Map))
 {
     vo_state_ = BLANK;
+    keypoint_budget_ = basics::Config::get<int>("max_number_of_keypoints");
+    frame_deadline_ms_ = basics::Config::get<double>("frame_deadline_ms");
+    const string vocabulary_file = basics::Config::get<string>("vocabulary_file");
+    if (!vocabulary_file.empty())
+    {
+        vocabulary_.reset(new geometry::Vocabulary);
+        vocabulary_->load(vocabulary_file);
+        printf("Loaded vocabulary of %d words from %s\n", vocabulary_->numWords(), vocabulary_file.c_str());
+    }
+    if (basics::Config::getBool("is_enable_loop_closing"))
+        loop_closing_.reset(new LoopClosing(vocabulary_));
+    const string localization_map_file = basics::Config::get<string>("localization_map_file");
+    if (!localization_map_file.empty())
+        setLocalizationMap(loadMap(localization_map_file));
+    if (basics::Config::getBool("is_spill_keyframes_to_disk"))
+        basics::makedirs(basics::Config::get<string>("keyframe_spill_folder") + "/");
+}
+
+void VisualOdometry::setLocalizationMap(Map::Ptr map)
+{
+    map_ = map;
+    is_localization_only_ = true;
+    loop_closing_ = nullptr;
+
+    // Keyframes for relocalization
+    vector<Frame::Ptr> keyframes;
+    for (const auto &it : map_->keyframes_)
+        keyframes.push_back(it.second);
+    std::sort(keyframes.begin(), keyframes.end(),
+              [](const Frame::Ptr &f1, const Frame::Ptr &f2) { return f1->id_ < f2->id_; });
+    keyframes_buff_.clear();
+    keyframe_database_ = KeyFrameDatabase();
+    // BoW vectors loaded with the map are reused if they are from the same vocabulary.
+    const bool is_bow_loaded = vocabulary_ != nullptr && map_->bow_key_ == getBoWKey();
+    for (Frame::Ptr keyframe : keyframes)
+    {
+        pushKeyFrameToBuff_(keyframe);
+        if (vocabulary_ != nullptr)
+        {
+            if (!is_bow_loaded)
+            {
+                keyframe->bow_vec_.clear();
+                keyframe->feat_vec_.clear();
+            }
+            keyframe->computeBoW(*vocabulary_);
+            keyframe_database_.add(keyframe->id_, keyframe->bow_vec_);
+        }
+    }
+
+    // The first frame will be relocalized in the map.
+    vo_state_ = LOST;
+    printf("Localization-only mode: %d keyframes and %d map points.%s\n",
+           (int)map_->keyframes_.size(), (int)map_->map_points_.size(), is_bow_loaded ? " BoW is loaded." : "");
+}
+
+uint64_t VisualOdometry::getBoWKey() const
+{
+    static const int bow_node_levels_up = basics::Config::get<int>("bow_node_levels_up");
+    if (vocabulary_ == nullptr)
+        return 0;
+    const uint64_t key = vocabulary_->signature() * 31 + bow_node_levels_up;
+    return key != 0 ? key : 1;
 }
 
 void VisualOdometry::getMappointsInCurrentView_(
-    vector<MapPoint::Ptr> &candidate_mappoints_in_map,
+    vector<MapPoint *> &candidate_mappoints_in_map,
     vector<cv::Point2f> &candidate_2d_pts_in_image,
     cv::Mat &corresponding_mappoints_descriptors)
 {
@@ -22,17 +87,24 @@ void VisualOdometry::getMappointsInCurrentView_(
     // cv::Mat corresponding_mappoints_descriptors;
     candidate_mappoints_in_map.clear();
     corresponding_mappoints_descriptors.release();
+    const cv::Mat T_c_w = curr_->T_w_c_.inv();
+    const cv::Point3f cam_center = basics::Mat3x1_to_Point3f(curr_->getCamCenter());
     for (auto &iter_map_point : map_->map_points_)
     {
-        MapPoint::Ptr &p_world = iter_map_point.second;
+        MapPoint *p_world = iter_map_point.second.get();
+
+        // -- Skip if it can't be detected at this distance by any pyramid level
+        if (!p_world->isInScaleRange(cv::norm(p_world->pos_ - cam_center)))
+            continue;
 
         // -- Check if p in curr frame image
         bool is_p_in_curr_frame = true;
-        cv::Point3f p_cam = basics::preTranslatePoint3f(p_world->pos_, curr_->T_w_c_.inv()); // T_c_w * p_w = p_c
+        cv::Point3f p_cam = basics::preTranslatePoint3f(p_world->pos_, T_c_w); // T_c_w * p_w = p_c
         if (p_cam.z < 0)
             is_p_in_curr_frame = false;
         cv::Point2f pixel = geometry::cam2pixel(p_cam, curr_->camera_->K_);
-        const bool is_inside_image = pixel.x > 0 && pixel.y > 0 && pixel.x < curr_->rgb_img_.cols && pixel.y < curr_->rgb_img_.rows;
+        const bool is_inside_image = pixel.x > 0 && pixel.y > 0 &&
+                                     pixel.x < curr_->image_size_.width && pixel.y < curr_->image_size_.height;
         if (!is_inside_image)
             is_p_in_curr_frame = false;
 
@@ -44,6 +116,7 @@ void VisualOdometry::getMappointsInCurrentView_(
             candidate_2d_pts_in_image.push_back(pixel);
             corresponding_mappoints_descriptors.push_back(p_world->descriptor_);
             p_world->visible_times_++;
+            queueMapPointCheck_(p_world);
         }
     }
 }
@@ -171,7 +244,7 @@ bool VisualOdometry::isVoGoodToInit_()
 
 bool VisualOdometry::isInitialized()
 {
-    return vo_state_ == DOING_TRACKING;
+    return vo_state_ == DOING_TRACKING || vo_state_ == LOST;
 }
 
 // ------------------------------- Triangulation -------------------------------
@@ -252,7 +325,7 @@ bool VisualOdometry::checkLargeMoveForAddKeyFrame_(Frame::Ptr curr, Frame::Ptr r
     cv::Rodrigues(R, R_vec);
 
     static const double min_dist_between_two_keyframes = basics::Config::get<double>("min_dist_between_two_keyframes");
-    // static const double min_rotation_angle_betwen_two_keyframes = basics::Config::get<double>("min_rotation_angle_betwen_two_keyframes");
+    static const double min_rotation_angle_between_two_keyframes = basics::Config::get<double>("min_rotation_angle_between_two_keyframes");
 
     double moved_dist = basics::calcMatNorm(t);
     double rotated_angle = basics::calcMatNorm(R_vec);
@@ -260,14 +333,14 @@ bool VisualOdometry::checkLargeMoveForAddKeyFrame_(Frame::Ptr curr, Frame::Ptr r
     printf("Wrt prev keyframe, relative dist = %.5f, angle = %.5f\n", moved_dist, rotated_angle);
 
     // Satisfy each one will be a good keyframe
-    bool res = moved_dist > min_dist_between_two_keyframes;
+    bool res = moved_dist > min_dist_between_two_keyframes || rotated_angle > min_rotation_angle_between_two_keyframes;
     return res;
 }
 
 bool VisualOdometry::poseEstimationPnP_()
 {
     // -- From the local map, find the keypoints that fall into the current view
-    vector<MapPoint::Ptr> candidate_mappoints_in_map;
+    vector<MapPoint *> candidate_mappoints_in_map;
     vector<cv::Point2f> candidate_2d_pts_in_image;
     cv::Mat corresponding_mappoints_descriptors;
     getMappointsInCurrentView_(
@@ -287,7 +360,192 @@ bool VisualOdometry::poseEstimationPnP_()
         false,
         candidate_2d_kpts_in_image, curr_->keypoints_,
         max_matching_pixel_dist_in_pnp);
+    return solvePnPFromMatches_(candidate_mappoints_in_map);
+}
 
+bool VisualOdometry::trackByOpticalFlow_(bool is_pose_predicted)
+{
+    static const int klt_min_tracked_points = basics::Config::get<int>("klt_min_tracked_points");
+    static const int klt_window_size = basics::Config::get<int>("klt_window_size");
+    static const int klt_max_level = basics::Config::get<int>("klt_max_level");
+    if (prev_ == nullptr || prev_->inliers_to_mappt_connections_.size() < klt_min_tracked_points)
+        return false;
+    const cv::Size win_size(klt_window_size, klt_window_size);
+    prev_->buildOpticalFlowPyramid(win_size, klt_max_level);
+    curr_->buildOpticalFlowPyramid(win_size, klt_max_level);
+    if (prev_->optical_flow_pyramid_.empty() || curr_->optical_flow_pyramid_.empty())
+        return false; // The image has been released.
+
+    // -- Track the previous frame's observations of the map points which still exist
+    vector<MapPoint *> pts;
+    vector<cv::Point2f> pts_prev, pts_curr;
+    for (const auto &it : prev_->inliers_to_mappt_connections_)
+    {
+        auto it_pt = map_->map_points_.find(it.second.pt_map_idx);
+        if (it_pt == map_->map_points_.end())
+            continue;
+        pts.push_back(it_pt->second.get());
+        pts_prev.push_back(prev_->keypoints_[it.first].pt);
+    }
+    if (pts.size() < klt_min_tracked_points)
+        return false;
+    int flags = 0;
+    if (is_pose_predicted)
+    {
+        const cv::Mat T_c_w = curr_->T_w_c_.inv();
+        for (const MapPoint *pt : pts)
+            pts_curr.push_back(geometry::cam2pixel(basics::preTranslatePoint3f(pt->pos_, T_c_w), curr_->camera_->K_));
+        flags = cv::OPTFLOW_USE_INITIAL_FLOW;
+    }
+    vector<unsigned char> status;
+    vector<float> err;
+    cv::calcOpticalFlowPyrLK(prev_->optical_flow_pyramid_, curr_->optical_flow_pyramid_,
+                             pts_prev, pts_curr, status, err, win_size, klt_max_level,
+                             cv::TermCriteria(cv::TermCriteria::COUNT | cv::TermCriteria::EPS, 30, 0.01), flags);
+
+    // -- The tracked points become the keypoints of curr_, each matched to its map point.
+    vector<MapPoint *> tracked_pts;
+    curr_->keypoints_.clear();
+    curr_->matches_with_map_.clear();
+    for (int i = 0; i < pts.size(); i++)
+    {
+        const cv::Point2f &pt = pts_curr[i];
+        if (!status[i] || pt.x < 0 || pt.y < 0 || pt.x >= curr_->image_size_.width || pt.y >= curr_->image_size_.height)
+            continue;
+        if (!curr_->mask_.empty() && !curr_->mask_.at<uchar>(int(pt.y), int(pt.x))) // e.g. on the car's hood
+            continue;
+        curr_->matches_with_map_.push_back(cv::DMatch(tracked_pts.size(), curr_->keypoints_.size(), err[i]));
+        curr_->keypoints_.push_back(cv::KeyPoint(pt, klt_window_size));
+        tracked_pts.push_back(pts[i]);
+        pts[i]->visible_times_++;
+        queueMapPointCheck_(pts[i]);
+    }
+    printf("KLT: tracked %d of %d map points.\n", (int)tracked_pts.size(), (int)pts.size());
+
+    // -- Solve the pose. Fall back to ORB features, if too few points are left, or a keyframe is needed.
+    bool is_good = tracked_pts.size() >= klt_min_tracked_points && solvePnPFromMatches_(tracked_pts) &&
+                   curr_->matches_with_map_.size() >= klt_min_tracked_points;
+    if (is_good && !is_localization_only_ && checkLargeMoveForAddKeyFrame_(curr_, ref_))
+    {
+        printf("KLT: a keyframe is needed.\n");
+        is_good = false;
+    }
+    if (!is_good)
+    {
+        // Undo the statistics, since the frame will be matched to the map again.
+        for (MapPoint *pt : tracked_pts)
+            pt->visible_times_--;
+        for (const auto &it : curr_->inliers_to_mappt_connections_) // keypoint idx == idx in tracked_pts
+            tracked_pts[it.first]->matched_times_--;
+        curr_->keypoints_.clear();
+        curr_->matches_with_map_.clear();
+        curr_->inliers_to_mappt_connections_.clear();
+        printf("KLT: fall back to ORB features.\n");
+    }
+    return is_good;
+}
+
+bool VisualOdometry::alignToPrevFrameDirectly_()
+{
+    static const int direct_alignment_min_points = basics::Config::get<int>("direct_alignment_min_points");
+    static const double direct_alignment_max_rms_error = basics::Config::get<double>("direct_alignment_max_rms_error");
+    static const int direct_alignment_max_iters = basics::Config::get<int>("direct_alignment_max_iters");
+    static const int klt_window_size = basics::Config::get<int>("klt_window_size");
+    static const int klt_max_level = basics::Config::get<int>("klt_max_level");
+    direct_alignment_point_errors_.clear();
+    if (prev_ == nullptr || prev_->inliers_to_mappt_connections_.size() < direct_alignment_min_points)
+        return false;
+    const cv::Size win_size(klt_window_size, klt_window_size);
+    prev_->buildOpticalFlowPyramid(win_size, klt_max_level);
+    curr_->buildOpticalFlowPyramid(win_size, klt_max_level);
+    if (prev_->optical_flow_pyramid_.empty() || curr_->optical_flow_pyramid_.empty())
+        return false; // The image has been released.
+
+    // -- prev_'s observations of the map points which still exist
+    vector<cv::Point3f> pts_world;
+    vector<int> pt_ids;
+    for (const auto &it : prev_->inliers_to_mappt_connections_)
+    {
+        auto it_pt = map_->map_points_.find(it.second.pt_map_idx);
+        if (it_pt == map_->map_points_.end())
+            continue;
+        pts_world.push_back(it_pt->second->pos_);
+        pt_ids.push_back(it_pt->first);
+    }
+
+    // -- Align, starting from the previous pose
+    cv::Mat T_w_c = prev_->T_w_c_.clone();
+    const optimization::DirectAlignmentSummary summary = optimization::alignSparseDirect(
+        prev_->optical_flow_pyramid_, curr_->optical_flow_pyramid_, pts_world,
+        curr_->camera_->K_, prev_->T_w_c_, T_w_c, direct_alignment_max_iters);
+    const bool is_converged = summary.num_points >= direct_alignment_min_points &&
+                              summary.rms_error <= direct_alignment_max_rms_error;
+    printf("Direct alignment: %d of %d points, %d iterations, rms error %.2f. %s\n",
+           summary.num_points, (int)pts_world.size(), summary.num_iterations, summary.rms_error,
+           is_converged ? "Converged." : "Not converged.");
+    if (is_converged)
+    {
+        curr_->T_w_c_ = T_w_c;
+        for (int i = 0; i < pt_ids.size(); i++)
+            direct_alignment_point_errors_.push_back(std::make_pair(pt_ids[i], summary.point_rms_errors[i]));
+    }
+    return is_converged;
+}
+
+bool VisualOdometry::observeMapPointsByProjection_()
+{
+    static const int klt_window_size = basics::Config::get<int>("klt_window_size");
+    static const int direct_alignment_min_points = basics::Config::get<int>("direct_alignment_min_points");
+    static const double direct_alignment_max_point_error = basics::Config::get<double>("direct_alignment_max_point_error");
+    const cv::Mat T_c_w = curr_->T_w_c_.inv();
+
+    // -- Points whose patches still match at the aligned pose, and their projections
+    vector<MapPoint *> observed_pts;
+    vector<cv::Point2f> pixels;
+    vector<double> errors;
+    for (const std::pair<int, double> &it : direct_alignment_point_errors_)
+    {
+        if (it.second < 0 || it.second > direct_alignment_max_point_error)
+            continue; // out of the images, or occluded, or on a moving object
+        auto it_pt = map_->map_points_.find(it.first);
+        if (it_pt == map_->map_points_.end())
+            continue;
+        const cv::Point3f p_cam = basics::preTranslatePoint3f(it_pt->second->pos_, T_c_w);
+        if (p_cam.z <= 0)
+            continue;
+        const cv::Point2f pixel = geometry::cam2pixel(p_cam, curr_->camera_->K_);
+        if (pixel.x < 0 || pixel.y < 0 || pixel.x >= curr_->image_size_.width || pixel.y >= curr_->image_size_.height)
+            continue;
+        if (!curr_->mask_.empty() && !curr_->mask_.at<uchar>(int(pixel.y), int(pixel.x)))
+            continue;
+        observed_pts.push_back(it_pt->second.get());
+        pixels.push_back(pixel);
+        errors.push_back(it.second);
+    }
+    printf("Direct alignment: observed %d of %d map points by projection.\n",
+           (int)observed_pts.size(), (int)direct_alignment_point_errors_.size());
+    if (observed_pts.size() < direct_alignment_min_points)
+        return false;
+
+    // -- They become the keypoints of curr_. Keypoint i observes observed_pts[i], like in KLT tracking.
+    curr_->keypoints_.clear();
+    curr_->matches_with_map_.clear();
+    curr_->inliers_to_mappt_connections_.clear();
+    for (int i = 0; i < observed_pts.size(); i++)
+    {
+        MapPoint *pt = observed_pts[i];
+        curr_->keypoints_.push_back(cv::KeyPoint(pixels[i], klt_window_size));
+        curr_->matches_with_map_.push_back(cv::DMatch(i, i, errors[i]));
+        curr_->inliers_to_mappt_connections_[i] = PtConn{-1, pt->id_};
+        pt->visible_times_++;
+        pt->matched_times_++;
+        queueMapPointCheck_(pt);
+    }
+    return true;
+}
+
+bool VisualOdometry::solvePnPFromMatches_(const vector<MapPoint *> &candidate_mappoints_in_map)
+{
     const int num_matches = curr_->matches_with_map_.size();
     cout << "Number of 3d-2d pairs: " << num_matches << endl;
     vector<cv::Point3f> pts_3d;
@@ -295,7 +553,7 @@ bool VisualOdometry::poseEstimationPnP_()
     for (int i = 0; i < num_matches; i++)
     {
         cv::DMatch &match = curr_->matches_with_map_[i];
-        MapPoint::Ptr mappoint = candidate_mappoints_in_map[match.queryIdx];
+        const MapPoint *mappoint = candidate_mappoints_in_map[match.queryIdx];
         pts_3d.push_back(mappoint->pos_);
         pts_2d.push_back(curr_->keypoints_[match.trainIdx].pt);
     }
@@ -325,16 +583,44 @@ bool VisualOdometry::poseEstimationPnP_()
         cv::Mat R;
         cv::Rodrigues(R_vec, R); // angle-axis rotation to 3x3 rotation matrix
 
+        // -- Update current camera pos
+        curr_->T_w_c_ = basics::convertRt2T(R, t).inv();
+
         // -- Get inlier matches used in PnP
+        vector<int> inliers_idx;
+        for (int i = 0; i < pnp_inliers_mask.rows; i++)
+            inliers_idx.push_back(pnp_inliers_mask.at<int>(i, 0));
+
+        // -- Refine current camera pose by motion-only BA, and remove the outliers
+        static const bool is_enable_motion_only_ba = basics::Config::getBool("is_enable_motion_only_ba");
+        static const int motion_only_ba_iters = basics::Config::get<int>("motion_only_ba_iters");
+        if (is_enable_motion_only_ba && inliers_idx.size() >= kMinPtsForPnP)
+        {
+            vector<cv::Point2f> inlier_pts_2d;
+            vector<cv::Point3f> inlier_pts_3d;
+            for (int idx : inliers_idx)
+            {
+                inlier_pts_2d.push_back(pts_2d[idx]);
+                inlier_pts_3d.push_back(pts_3d[idx]);
+            }
+            vector<bool> is_inlier;
+            optimization::optimizePoseOnly(
+                inlier_pts_2d, inlier_pts_3d, curr_->camera_->K_,
+                curr_->T_w_c_, is_inlier, motion_only_ba_iters);
+            vector<int> tmp_inliers_idx;
+            for (int i = 0; i < inliers_idx.size(); i++)
+                if (is_inlier[i])
+                    tmp_inliers_idx.push_back(inliers_idx[i]);
+            printf("Motion-only BA: %d of %d PnP inliers are kept.\n",
+                   (int)tmp_inliers_idx.size(), (int)inliers_idx.size());
+            inliers_idx.swap(tmp_inliers_idx);
+        }
+
+        // -- Output the inlier matches, and update graph info
         vector<cv::Point2f> tmp_pts_2d;
-        vector<cv::Point3f *> inlier_candidates_pos;
-        vector<MapPoint::Ptr> inlier_candidates;
         vector<cv::DMatch> tmp_matches_with_map_;
-        int num_inliers = pnp_inliers_mask.rows;
-        for (int i = 0; i < num_inliers; i++)
+        for (int good_idx : inliers_idx)
         {
-            int good_idx = pnp_inliers_mask.at<int>(i, 0);
-
             // good match
             cv::DMatch &match = curr_->matches_with_map_[good_idx];
             tmp_matches_with_map_.push_back(match);
@@ -343,8 +629,7 @@ bool VisualOdometry::poseEstimationPnP_()
             tmp_pts_2d.push_back(pts_2d[good_idx]);
 
             // good pts 3d
-            MapPoint::Ptr inlier_mappoint = candidate_mappoints_in_map[match.queryIdx];
-            inlier_candidates_pos.push_back(&(inlier_mappoint->pos_));
+            MapPoint *inlier_mappoint = candidate_mappoints_in_map[match.queryIdx];
             inlier_mappoint->matched_times_++;
 
             // Update graph info
@@ -353,9 +638,6 @@ bool VisualOdometry::poseEstimationPnP_()
         pts_2d.swap(tmp_pts_2d);
         curr_->matches_with_map_.swap(tmp_matches_with_map_);
 
-        // -- Update current camera pos
-        curr_->T_w_c_ = basics::convertRt2T(R, t).inv();
-
         // -- Check relative motion with previous frame
         cv::Mat R_prev, t_prev, R_curr, t_curr;
         basics::getRtFromT(curr_->T_w_c_, R_prev, t_prev);
@@ -380,149 +662,657 @@ bool VisualOdometry::poseEstimationPnP_()
     return is_pnp_good;
 }
 
+optimization::BAOptions VisualOdometry::getBAOptionsFromConfig_()
+{
+    static const string ba_linear_solver = basics::Config::get<string>("ba_linear_solver");
+    static const string ba_backend = basics::Config::get<string>("ba_backend");
+    static const int ba_num_threads = basics::Config::get<int>("ba_num_threads");
+    static const int ba_max_iters = basics::Config::get<int>("ba_max_iters");
+    static const double ba_min_relative_decrease = basics::Config::get<double>("ba_min_relative_decrease");
+    static const double ba_min_step_norm = basics::Config::get<double>("ba_min_step_norm");
+    static const double ba_max_time_ms = basics::Config::get<double>("ba_max_time_ms");
+    static const bool is_ba_remove_outliers = basics::Config::getBool("is_ba_remove_outliers");
+    static const double ba_outlier_chi2_threshold = basics::Config::get<double>("ba_outlier_chi2_threshold");
+
+    optimization::BAOptions ba_options;
+    ba_options.linear_solver = optimization::str2LinearSolverType(ba_linear_solver);
+    ba_options.backend = optimization::str2BABackend(ba_backend);
+    ba_options.num_threads = ba_num_threads;
+    ba_options.termination.max_iters = ba_max_iters;
+    ba_options.termination.min_relative_decrease = ba_min_relative_decrease;
+    ba_options.termination.min_step_norm = ba_min_step_norm;
+    ba_options.termination.max_time_ms = ba_max_time_ms;
+    ba_options.is_remove_outliers = is_ba_remove_outliers;
+    ba_options.outlier_chi2_threshold = ba_outlier_chi2_threshold;
+    return ba_options;
+}
+
+cv::Mat VisualOdometry::getBAInformationMatrixFromConfig_()
+{
+    static const vector<double> im = basics::str2vecdouble(
+        basics::Config::get<string>("information_matrix"));
+    const static cv::Mat information_matrix = (cv::Mat_<double>(2, 2) << im[0], im[1], im[2], im[3]);
+    return information_matrix;
+}
+
+void VisualOdometry::addFrameToBundleAdjustmentJob_(BundleAdjustmentJob &job, Frame::Ptr frame,
+                                                    bool is_copy_observations)
+{
+    job.frames.push_back(frame);
+    job.poses.push_back(frame->T_w_c_.clone());
+    job.pts_2d.push_back(vector<cv::Point2f>());
+    job.pts_2d_to_3d_idx.push_back(vector<int>());
+    if (!is_copy_observations)
+        return;
+
+    // Iterate through this camera's mappoints
+    for (std::unordered_map<int, PtConn>::iterator ite = frame->inliers_to_mappt_connections_.begin();
+         ite != frame->inliers_to_mappt_connections_.end(); ite++)
+    {
+        int kpt_idx = ite->first;
+        int mappt_idx = ite->second.pt_map_idx;
+        auto it_pt = map_->map_points_.find(mappt_idx);
+        if (it_pt == map_->map_points_.end())
+            continue; // point has been deleted
+
+        job.pts_2d.back().push_back(frame->keypoints_[kpt_idx].pt);
+        job.pts_2d_to_3d_idx.back().push_back(mappt_idx);
+        job.pts_3d[mappt_idx] = it_pt->second->pos_;
+    }
+}
+
+void VisualOdometry::solveBundleAdjustmentJob_(BundleAdjustmentJob &job, const cv::Mat &information_matrix,
+                                               const optimization::BAOptions &options)
+{
+    vector<vector<cv::Point2f *>> v_pts_2d;
+    for (vector<cv::Point2f> &pts_2d : job.pts_2d)
+    {
+        v_pts_2d.push_back(vector<cv::Point2f *>());
+        for (cv::Point2f &p : pts_2d)
+            v_pts_2d.back().push_back(&p);
+    }
+    std::unordered_map<int, cv::Point3f *> um_pts_3d;
+    for (auto &it : job.pts_3d)
+        um_pts_3d[it.first] = &it.second;
+    vector<cv::Mat *> v_camera_poses;
+    for (cv::Mat &pose : job.poses)
+        v_camera_poses.push_back(&pose);
+
+    vector<vector<bool>> v_is_outlier;
+    job.summary = optimization::bundleAdjustment(
+        v_pts_2d, job.pts_2d_to_3d_idx, job.frames[0]->camera_->K_,
+        um_pts_3d, v_camera_poses,
+        information_matrix,
+        !job.is_update_map_pts, job.is_update_map_pts,
+        options, &v_is_outlier);
+    for (int i = 0; i < v_is_outlier.size(); i++)
+        for (int j = 0; j < v_is_outlier[i].size(); j++)
+            if (v_is_outlier[i][j])
+                job.outliers.push_back(std::make_pair(job.frames[i]->id_, job.pts_2d_to_3d_idx[i][j]));
+}
+
 // bundle adjustment
 void VisualOdometry::callBundleAdjustment_()
 {
     // Read settings from config.yaml
     static const bool is_enable_ba = basics::Config::getBool("is_enable_ba");
+    static const bool is_ba_in_background = basics::Config::getBool("is_ba_in_background");
     static const int num_prev_frames_to_opti_by_ba = basics::Config::get<int>("num_prev_frames_to_opti_by_ba");
-    static const vector<double> im = basics::str2vecdouble(
-        basics::Config::get<string>("information_matrix"));
     static const bool is_ba_fix_map_points = basics::Config::getBool("is_ba_fix_map_points");
-    static const bool is_ba_update_map_points = !is_ba_fix_map_points;
+    static const optimization::BAOptions ba_options = getBAOptionsFromConfig_();
+    static const bool is_ba_sliding_window = basics::Config::getBool("is_ba_sliding_window") &&
+                                             ba_options.backend == optimization::BABackend::G2O;
 
     // Set params
-    const int kTotalFrames = frames_buff_.size();
-    const int kNumFramesForBA = std::min(num_prev_frames_to_opti_by_ba, kTotalFrames - 1);
-    const static cv::Mat information_matrix = (cv::Mat_<double>(2, 2) << im[0], im[1], im[2], im[3]);
+    const int kTotalFrames = keyframes_buff_.size();
+    const int kNumFramesForBA = std::min(num_prev_frames_to_opti_by_ba, kTotalFrames);
+    const cv::Mat information_matrix = getBAInformationMatrixFromConfig_();
 
     if (is_enable_ba != true)
     {
         printf("\nNot using bundle adjustment ... \n");
         return;
     }
-    printf("\nCalling bundle adjustment on %d frames ... \n", kNumFramesForBA);
 
-    // Measurement (which is fixed; truth)
-    vector<vector<cv::Point2f *>> v_pts_2d;
-    vector<vector<int>> v_pts_2d_to_3d_idx;
-
-    // Things to to optimize
-    std::unordered_map<int, cv::Point3f *> um_pts_3d_in_prev_frames;
-    vector<cv::Point3f *> v_pts_3d_only_in_curr;
-    vector<cv::Mat *> v_camera_poses;
-
-    // Set up input vars
-    int ith_frame = 0;
+    // Only one BA job at a time. If the previous one is still running, skip this one.
+    applyBundleAdjustmentResult_();
+    if (ba_job_ != nullptr)
+    {
+        printf("\nPrevious bundle adjustment is still running. Skip this one ... \n");
+        return;
+    }
+    printf("\nCalling bundle adjustment on %d keyframes ... \n", kNumFramesForBA);
+
+    // Persistent graph of the sliding window
+    if (is_ba_sliding_window && sliding_window_ba_ == nullptr)
+        sliding_window_ba_.reset(new optimization::SlidingWindowBA(
+            curr_->camera_->K_, information_matrix, is_ba_fix_map_points,
+            num_prev_frames_to_opti_by_ba, ba_options));
+
+    // Copy the measurements and the things to optimize into a job
+    std::shared_ptr<BundleAdjustmentJob> job(new BundleAdjustmentJob);
+    job->is_update_map_pts = !is_ba_fix_map_points;
+    std::unordered_set<int> frame_ids_in_job;
     for (int ith_frame_in_buff = kTotalFrames - 1;
          ith_frame_in_buff >= kTotalFrames - kNumFramesForBA;
-         ith_frame_in_buff--, ith_frame++)
+         ith_frame_in_buff--)
     {
-        Frame::Ptr frame = frames_buff_[ith_frame_in_buff];
+        Frame::Ptr frame = keyframes_buff_[ith_frame_in_buff];
         int num_mappt_in_frame = frame->inliers_to_mappt_connections_.size();
         if (num_mappt_in_frame < 3)
         {
             continue; // Too few mappoints. Not optimizing this frame
         }
         printf("Frame id: %d, num map points = %d\n", frame->id_, num_mappt_in_frame);
-        v_pts_2d.push_back(vector<cv::Point2f *>());
-        v_pts_2d_to_3d_idx.push_back(vector<int>());
+        frame_ids_in_job.insert(frame->id_);
 
-        // Get camera poses
-        v_camera_poses.push_back(&frame->T_w_c_);
+        // If the frame is already in the sliding window, its observations are there, too.
+        const bool is_new_in_window = !is_ba_sliding_window || !sliding_window_ba_->hasKeyFrame(frame->id_);
+        job->is_new_in_window.push_back(is_new_in_window);
+        addFrameToBundleAdjustmentJob_(*job, frame, is_new_in_window);
+    }
+    if (job->frames.empty())
+        return;
 
-        // Iterate through this camera's mappoints
-        for (std::unordered_map<int, PtConn>::iterator ite = frame->inliers_to_mappt_connections_.begin();
-             ite != frame->inliers_to_mappt_connections_.end(); ite++)
+    // Old keyframes and deleted points are removed from the sliding window
+    if (is_ba_sliding_window)
+    {
+        for (int frame_id : sliding_window_ba_->getKeyFrameIds())
+            if (frame_ids_in_job.find(frame_id) == frame_ids_in_job.end())
+                job->frame_ids_to_remove.push_back(frame_id);
+        for (int pt_id : sliding_window_ba_->getPointIds())
         {
-            int kpt_idx = ite->first;
-            int mappt_idx = ite->second.pt_map_idx;
-            if (map_->map_points_.find(mappt_idx) == map_->map_points_.end())
-                continue; // point has been deleted
-
-            // Get 2d pos
-            v_pts_2d.back().push_back(&(frame->keypoints_[kpt_idx].pt));
-            v_pts_2d_to_3d_idx.back().push_back(mappt_idx);
-
-            // Get 3d pos
-            cv::Point3f *p = &(map_->map_points_[mappt_idx]->pos_);
-            um_pts_3d_in_prev_frames[mappt_idx] = p;
-            if (ith_frame == 0)
-                v_pts_3d_only_in_curr.push_back(p);
+            auto it_pt = map_->map_points_.find(pt_id);
+            if (it_pt == map_->map_points_.end())
+                job->pt_ids_to_remove.push_back(pt_id);
+            else if (is_ba_fix_map_points) // The map may have moved it, e.g. by fusion or loop correction.
+                job->fixed_pts_to_reset[pt_id] = it_pt->second->pos_;
         }
     }
+
     // Bundle Adjustment
-    cv::Mat pose_src = basics::getPosFromT(curr_->T_w_c_);
-    if (1)
+    ba_job_ = job;
+    optimization::SlidingWindowBA::Ptr sliding_window_ba = sliding_window_ba_;
+    auto runJob = [job, information_matrix, sliding_window_ba]() {
+        if (sliding_window_ba == nullptr)
+        {
+            solveBundleAdjustmentJob_(*job, information_matrix, ba_options);
+            return;
+        }
+
+        // Update the window, and warm-start from its previous solution
+        for (int frame_id : job->frame_ids_to_remove)
+            sliding_window_ba->removeKeyFrame(frame_id);
+        for (int pt_id : job->pt_ids_to_remove)
+            sliding_window_ba->removePoint(pt_id);
+        for (const auto &it : job->fixed_pts_to_reset)
+            sliding_window_ba->setPoint(it.first, it.second);
+        for (int i = 0; i < job->frames.size(); i++)
+            if (job->is_new_in_window[i])
+                sliding_window_ba->addKeyFrame(
+                    job->frames[i]->id_, job->poses[i],
+                    job->pts_2d[i], job->pts_2d_to_3d_idx[i], job->pts_3d);
+        job->summary = sliding_window_ba->optimize(ba_options.termination, &job->outliers);
+
+        // Output
+        for (int i = 0; i < job->frames.size(); i++)
+            sliding_window_ba->getPose(job->frames[i]->id_, job->poses[i]);
+        sliding_window_ba->getPoints(job->pts_3d);
+    };
+    if (is_ba_in_background)
+        ba_future_ = std::async(std::launch::async, runJob);
+    else
     {
-        optimization::bundleAdjustment(
-            v_pts_2d, v_pts_2d_to_3d_idx, curr_->camera_->K_,
-            um_pts_3d_in_prev_frames, v_camera_poses,
-            information_matrix,
-            is_ba_fix_map_points, is_ba_update_map_points);
+        runJob();
+        applyBundleAdjustmentResult_();
     }
-    else // This is a deprecated function. I will remove it later.
+}
+
+void VisualOdometry::globalBundleAdjustment()
+{
+    static const string global_ba_backend = basics::Config::get<string>("global_ba_backend");
+    static const string global_ba_linear_solver = basics::Config::get<string>("global_ba_linear_solver");
+    static const int global_ba_max_iters = basics::Config::get<int>("global_ba_max_iters");
+    static const double global_ba_max_time_ms = basics::Config::get<double>("global_ba_max_time_ms");
+
+    // Finish the loop correction and the windowed BA first. The BA graph becomes stale after this, so drop it.
+    applyLoopCorrection_(true);
+    applyBundleAdjustmentResult_(true);
+    sliding_window_ba_ = nullptr;
+
+    // Settings. The first keyframe is fixed to remove the gauge freedom of poses and points.
+    optimization::BAOptions ba_options = getBAOptionsFromConfig_();
+    ba_options.backend = optimization::str2BABackend(global_ba_backend);
+    ba_options.linear_solver = optimization::str2LinearSolverType(global_ba_linear_solver);
+    ba_options.termination.max_iters = global_ba_max_iters;
+    ba_options.termination.max_time_ms = global_ba_max_time_ms;
+    ba_options.is_fix_first_pose = true;
+
+    // All keyframes in the order of id, and all map points they observe
+    vector<Frame::Ptr> keyframes;
+    for (const auto &it : map_->keyframes_)
+        if (it.second->inliers_to_mappt_connections_.size() >= 3)
+            keyframes.push_back(it.second);
+    if (keyframes.size() < 2)
+        return;
+    std::sort(keyframes.begin(), keyframes.end(),
+              [](const Frame::Ptr &f1, const Frame::Ptr &f2) { return f1->id_ < f2->id_; });
+
+    std::shared_ptr<BundleAdjustmentJob> job(new BundleAdjustmentJob);
+    job->is_update_map_pts = true;
+    for (Frame::Ptr keyframe : keyframes)
+        addFrameToBundleAdjustmentJob_(*job, keyframe, true);
+    printf("\nGlobal bundle adjustment on %d keyframes and %d map points ... \n",
+           (int)job->frames.size(), (int)job->pts_3d.size());
+
+    solveBundleAdjustmentJob_(*job, getBAInformationMatrixFromConfig_(), ba_options);
+    ba_job_ = job;
+    applyBundleAdjustmentResult_(true);
+}
+
+void VisualOdometry::applyBundleAdjustmentResult_(bool is_wait)
+{
+    if (ba_job_ == nullptr)
+        return;
+    if (ba_future_.valid())
+    {
+        if (!is_wait && ba_future_.wait_for(std::chrono::seconds(0)) != std::future_status::ready)
+            return; // still running
+        ba_future_.get();
+    }
+
+    // 1. Camera poses
+    const int num_frames = ba_job_->frames.size();
+    for (int i = 0; i < num_frames; i++)
+    {
+        Frame::Ptr frame = ba_job_->frames[i];
+        cv::Mat pose_src = basics::getPosFromT(frame->T_w_c_);
+        ba_job_->poses[i].copyTo(frame->T_w_c_);
+        if (num_frames > kBuffSize_)
+            continue; // Don't print for the global BA.
+        cv::Mat pose_new = basics::getPosFromT(frame->T_w_c_);
+        printf("BA: frame %d, cam pos: Before:{%.5f,%.5f,%.5f}, After:{%.5f,%.5f,%.5f}\n", frame->id_,
+               pose_src.at<double>(0, 0), pose_src.at<double>(1, 0), pose_src.at<double>(2, 0),
+               pose_new.at<double>(0, 0), pose_new.at<double>(1, 0), pose_new.at<double>(2, 0));
+    }
+
+    // 2. Map points. Skip those which have been deleted during the optimization.
+    for (auto it = ba_job_->pts_3d.begin(); ba_job_->is_update_map_pts && it != ba_job_->pts_3d.end(); it++)
     {
-        optimization::optimizeSingleFrame(
-            v_pts_2d[0], curr_->camera_->K_,
-            v_pts_3d_only_in_curr, curr_->T_w_c_,
-            is_ba_fix_map_points, is_ba_update_map_points); // Update pts_3d and curr_->T_w_c_
+        auto it_map = map_->map_points_.find(it->first);
+        if (it_map != map_->map_points_.end())
+            it_map->second->setPos(it->second);
     }
 
-    // Print result
-    cv::Mat pose_new = basics::getPosFromT(curr_->T_w_c_);
-    printf("Cam pos: Before:{%.5f,%.5f,%.5f}, After:{%.5f,%.5f,%.5f}\n",
-           pose_src.at<double>(0, 0), pose_src.at<double>(1, 0), pose_src.at<double>(2, 0),
-           pose_new.at<double>(0, 0), pose_new.at<double>(1, 0), pose_new.at<double>(2, 0));
+    // 3. Outliers. Remove their 2d-3d associations, so they won't be added to later BA problems.
+    std::unordered_map<int, std::unordered_set<int>> outlier_pts_of_frames;
+    for (const std::pair<int, int> &outlier : ba_job_->outliers)
+        outlier_pts_of_frames[outlier.first].insert(outlier.second);
+    int num_removed = 0;
+    for (Frame::Ptr frame : ba_job_->frames)
+    {
+        auto it_outliers = outlier_pts_of_frames.find(frame->id_);
+        if (it_outliers == outlier_pts_of_frames.end())
+            continue;
+        std::unordered_map<int, PtConn> &connections = frame->inliers_to_mappt_connections_;
+        for (auto it = connections.begin(); it != connections.end();)
+        {
+            if (it_outliers->second.count(it->second.pt_map_idx))
+            {
+                auto it_pt = map_->map_points_.find(it->second.pt_map_idx);
+                if (it_pt != map_->map_points_.end())
+                    eraseObservation_(it_pt->second.get(), frame->id_);
+                it = connections.erase(it);
+                num_removed++;
+            }
+            else
+                it++;
+        }
+    }
+    if (num_removed > 0)
+        printf("BA: removed %d outlier observations\n", num_removed);
+    ba_job_ = nullptr;
     printf("Bundle adjustment finishes... \n\n");
 }
 
+// ------------------- Loop closing -------------------
+
+void VisualOdometry::callLoopCorrection_()
+{
+    static const int loop_pgo_max_iters = basics::Config::get<int>("loop_pgo_max_iters");
+    constexpr int kNumNeighbors = 3; // Each keyframe is constrained by this many previous keyframes.
+
+    LoopClosing::Loop loop;
+    if (loop_closing_ == nullptr || loop_job_ != nullptr || !loop_closing_->getLoop(loop))
+        return;
+    if (!map_->hasKeyFrame(loop.curr_id) || !map_->hasKeyFrame(loop.loop_id))
+        return;
+    loop_edges_.push_back(optimization::Sim3Edge{loop.curr_id, loop.loop_id, loop.S_loop_curr});
+
+    // Poses of all keyframes. Consecutive keyframes are constrained by their current relative poses.
+    std::shared_ptr<LoopCorrectionJob> job(new LoopCorrectionJob);
+    for (const auto &it : map_->keyframes_)
+        job->S_c_w_before[it.first] = optimization::Sim3::fromCamPose(it.second->T_w_c_);
+    job->S_c_w = job->S_c_w_before;
+    job->fixed_id = job->S_c_w.begin()->first; // The first keyframe defines the world frame.
+    for (auto it = job->S_c_w.begin(); it != job->S_c_w.end(); it++)
+    {
+        auto it_prev = it;
+        for (int i = 0; i < kNumNeighbors && it_prev != job->S_c_w.begin(); i++)
+        {
+            it_prev--;
+            job->edges.push_back(optimization::Sim3Edge{
+                it_prev->first, it->first, it->second * it_prev->second.inverse()});
+        }
+    }
+    for (const optimization::Sim3Edge &edge : loop_edges_)
+        if (job->S_c_w.count(edge.id_from) && job->S_c_w.count(edge.id_to))
+            job->edges.push_back(edge);
+    printf("\nLoop closing: pose graph optimization of %d keyframes and %d edges ... \n",
+           (int)job->S_c_w.size(), (int)job->edges.size());
+
+    loop_job_ = job;
+    loop_future_ = std::async(std::launch::async, [job]() {
+        optimization::optimizeSim3PoseGraph(job->S_c_w, job->edges, job->fixed_id, loop_pgo_max_iters);
+    });
+}
+
+void VisualOdometry::applyLoopCorrection_(bool is_wait)
+{
+    if (loop_job_ == nullptr)
+        return;
+    if (!is_wait && loop_future_.wait_for(std::chrono::seconds(0)) != std::future_status::ready)
+        return; // still running
+    applyBundleAdjustmentResult_(is_wait);
+    if (ba_job_ != nullptr)
+        return; // Wait for the BA, and correct its result together.
+    loop_future_.get();
+
+    // The correction of each keyframe in the world frame, i.e., p_w_new = W * p_w_old.
+    //      Poses may have been changed by BA after the job was created, so they are corrected by W,
+    //      instead of being overwritten by the optimized poses.
+    std::map<int, optimization::Sim3> corrections;
+    for (const auto &it : loop_job_->S_c_w)
+        corrections[it.first] = it.second.inverse() * loop_job_->S_c_w_before[it.first];
+    const optimization::Sim3 &W_newest = corrections.rbegin()->second; // For things newer than the job.
+    auto correctPose = [](cv::Mat &T_w_c, const optimization::Sim3 &W) {
+        T_w_c = (optimization::Sim3::fromCamPose(T_w_c) * W.inverse()).toCamPose();
+    };
+
+    // 1. Keyframes
+    for (auto &it : map_->keyframes_)
+    {
+        auto it_correction = corrections.find(it.first);
+        correctPose(it.second->T_w_c_, it_correction != corrections.end() ? it_correction->second : W_newest);
+    }
+
+    // 2. The previous frame, which may be used as the initial pose of tracking.
+    if (prev_ != nullptr && !map_->hasKeyFrame(prev_->id_))
+        correctPose(prev_->T_w_c_, W_newest);
+
+    // 3. Map points, by the oldest keyframe which observes them.
+    std::unordered_set<int> corrected_pts;
+    for (const auto &it : corrections)
+    {
+        Frame::Ptr keyframe = map_->findKeyFrame(it.first);
+        if (keyframe == nullptr)
+            continue;
+        for (const auto &it_conn : keyframe->inliers_to_mappt_connections_)
+        {
+            auto it_pt = map_->map_points_.find(it_conn.second.pt_map_idx);
+            if (it_pt != map_->map_points_.end() && corrected_pts.insert(it_pt->first).second)
+                it_pt->second->setPos(it.second * it_pt->second->pos_);
+        }
+    }
+    for (auto &it : map_->map_points_)
+        if (!corrected_pts.count(it.first))
+            it.second->setPos(W_newest * it.second->pos_);
+
+    // Distances and viewing directions have changed with the points.
+    for (const auto &it : map_->map_points_)
+        if (!it.second->observations_.empty())
+            map_points_to_update_[it.first] = it.second->handle_;
+
+    // The sliding window BA holds the poses before correction.
+    sliding_window_ba_ = nullptr;
+    loop_job_ = nullptr;
+    printf("Loop closing: corrected %d keyframes and %d map points.\n\n",
+           (int)map_->keyframes_.size(), (int)map_->map_points_.size());
+}
+
 // ------------------- Mapping -------------------
 
 void VisualOdometry::addKeyFrame_(Frame::Ptr frame)
 {
     map_->insertKeyFrame(frame);
+    pushKeyFrameToBuff_(frame);
     ref_ = frame;
+    for (const auto &it : frame->inliers_to_mappt_connections_)
+    {
+        auto it_pt = map_->map_points_.find(it.second.pt_map_idx);
+        if (it_pt != map_->map_points_.end())
+            addObservation_(it_pt->second.get(), frame->id_, it.first);
+    }
+    if (vocabulary_ != nullptr)
+    {
+        frame->computeBoW(*vocabulary_);
+        keyframe_database_.add(frame->id_, frame->bow_vec_);
+    }
+    if (loop_closing_ != nullptr)
+        loop_closing_->addKeyFrame(frame, map_);
+    manageKeyFrameMemory_(frame);
 }
 
-void VisualOdometry::optimizeMap_()
+void VisualOdometry::cullRedundantKeyFrames_()
 {
-    static const double default_erase = 0.1;
-    static double map_point_erase_ratio = default_erase;
+    static const bool is_enable_keyframe_culling = basics::Config::getBool("is_enable_keyframe_culling");
+    static const int keyframe_culling_min_observers = basics::Config::get<int>("keyframe_culling_min_observers");
+    static const double keyframe_culling_redundant_ratio = basics::Config::get<double>("keyframe_culling_redundant_ratio");
+    constexpr int kNumNewestKept = 2; // The newest keyframes are still being refined by BA and used for triangulation.
+    if (!is_enable_keyframe_culling || keyframes_buff_.size() <= kNumNewestKept)
+        return;
 
-    // remove the hardly seen and no visible points
-    for (auto iter = map_->map_points_.begin(); iter != map_->map_points_.end();)
+    // -- Number of keyframes in the window observing each map point
+    std::unordered_map<int, int> num_observers;
+    for (const Frame::Ptr &keyframe : keyframes_buff_)
+        for (const auto &it : keyframe->inliers_to_mappt_connections_)
+            num_observers[it.second.pt_map_idx]++;
+
+    // -- Keyframes which can't be removed
+    int first_id = ref_->id_;
+    for (const auto &it : map_->keyframes_)
+        first_id = std::min(first_id, it.first);
+    std::unordered_set<int> kept_ids{ref_->id_, first_id};
+    for (const optimization::Sim3Edge &edge : loop_edges_)
+        kept_ids.insert(edge.id_from), kept_ids.insert(edge.id_to);
+
+    // -- Check the keyframes in the window, except the newest ones
+    vector<Frame::Ptr> redundant_keyframes;
+    for (int i = 0; i < (int)keyframes_buff_.size() - kNumNewestKept; i++)
     {
-        if (!curr_->isInFrame(iter->second->pos_))
-        {
-            iter = map_->map_points_.erase(iter);
+        const Frame::Ptr &keyframe = keyframes_buff_[i];
+        if (kept_ids.count(keyframe->id_))
             continue;
+        int num_pts = 0, num_redundant_pts = 0;
+        for (const auto &it : keyframe->inliers_to_mappt_connections_)
+        {
+            if (map_->map_points_.find(it.second.pt_map_idx) == map_->map_points_.end())
+                continue;
+            num_pts++;
+            num_redundant_pts += num_observers[it.second.pt_map_idx] - 1 >= keyframe_culling_min_observers;
         }
+        if (num_pts > 0 && num_redundant_pts >= keyframe_culling_redundant_ratio * num_pts)
+        {
+            redundant_keyframes.push_back(keyframe);
 
-        float match_ratio = float(iter->second->matched_times_) / iter->second->visible_times_;
-        if (match_ratio < map_point_erase_ratio)
+            // Its observations no longer count for the next keyframes.
+            for (const auto &it : keyframe->inliers_to_mappt_connections_)
+                num_observers[it.second.pt_map_idx]--;
+        }
+    }
+
+    // -- Remove them
+    auto eraseFrom = [](std::deque<Frame::Ptr> &frames, const Frame::Ptr &frame) {
+        frames.erase(std::remove(frames.begin(), frames.end(), frame), frames.end());
+    };
+    for (const Frame::Ptr &keyframe : redundant_keyframes)
+    {
+        for (const auto &it : keyframe->inliers_to_mappt_connections_)
         {
-            iter = map_->map_points_.erase(iter);
-            continue;
+            auto it_pt = map_->map_points_.find(it.second.pt_map_idx);
+            if (it_pt != map_->map_points_.end())
+                eraseObservation_(it_pt->second.get(), keyframe->id_);
         }
+        map_->eraseKeyFrame(keyframe->id_);
+        keyframe_database_.erase(keyframe->id_);
+        if (loop_closing_ != nullptr)
+            loop_closing_->eraseKeyFrame(keyframe->id_);
+        eraseFrom(keyframes_buff_, keyframe);
+        eraseFrom(keyframes_with_image_, keyframe);
+        eraseFrom(keyframes_with_descriptors_, keyframe);
+    }
+    if (!redundant_keyframes.empty())
+        printf("Keyframe culling: removed %d redundant keyframes.\n", (int)redundant_keyframes.size());
+}
+
+void VisualOdometry::manageKeyFrameMemory_(Frame::Ptr keyframe)
+{
+    // At least 2, since the previous reference keyframe's image is drawn by run_vo.cpp.
+    static const int num_keyframes_with_image = std::max(2, basics::Config::get<int>("num_keyframes_with_image"));
+    static const double keyframe_memory_budget_mb = basics::Config::get<double>("keyframe_memory_budget_mb");
+    static const bool is_spill_keyframes_to_disk = basics::Config::getBool("is_spill_keyframes_to_disk");
+    static const string keyframe_spill_folder = basics::Config::get<string>("keyframe_spill_folder");
+    const size_t budget_bytes = keyframe_memory_budget_mb * 1024 * 1024;
+
+    // -- Older keyframes drop their images, and what was only needed for mapping them.
+    keyframes_with_image_.push_back(keyframe);
+    while (keyframes_with_image_.size() > num_keyframes_with_image)
+    {
+        Frame::Ptr old_keyframe = keyframes_with_image_.front();
+        keyframes_with_image_.pop_front();
+        old_keyframe->releaseImage();
+        old_keyframe->releaseScratch();
+        keyframes_with_descriptors_.push_back(old_keyframe);
+    }
 
-        double angle = getViewAngle_(curr_, iter->second);
-        if (angle > M_PI / 4.)
+    // -- Spill the descriptors of the oldest keyframes, until the memory is within the budget.
+    size_t bytes = 0;
+    for (const auto &it : map_->keyframes_)
+        bytes += it.second->memoryBytes();
+    if (budget_bytes > 0 && is_spill_keyframes_to_disk)
+    {
+        while (bytes > budget_bytes && !keyframes_with_descriptors_.empty())
         {
-            iter = map_->map_points_.erase(iter);
-            continue;
+            Frame::Ptr old_keyframe = keyframes_with_descriptors_.front();
+            keyframes_with_descriptors_.pop_front();
+            if (!map_->hasKeyFrame(old_keyframe->id_) || old_keyframe->isDescriptorsSpilled())
+                continue;
+            const size_t bytes_before = old_keyframe->memoryBytes();
+            old_keyframe->spillDescriptors(
+                keyframe_spill_folder + "/keyframe_" + std::to_string(old_keyframe->id_) + ".bin");
+            bytes -= bytes_before - old_keyframe->memoryBytes();
         }
-        iter++;
     }
 
-    if (map_->map_points_.size() > 1000)
+    // -- Report
+    int num_spilled = 0;
+    for (const auto &it : map_->keyframes_)
+        num_spilled += it.second->isDescriptorsSpilled();
+    printf("Keyframe memory: %d keyframes, %.1f MB (budget %.0f MB), %d with images, %d spilled to disk.\n",
+           (int)map_->keyframes_.size(), bytes / 1024.0 / 1024.0, keyframe_memory_budget_mb,
+           (int)keyframes_with_image_.size(), num_spilled);
+    if (budget_bytes > 0 && bytes > budget_bytes)
+        printf("Warning: keyframe memory is over the budget.%s\n",
+               is_spill_keyframes_to_disk ? "" : " Set is_spill_keyframes_to_disk to spill old keyframes.");
+}
+
+void VisualOdometry::maintainMapPoints_()
+{
+    static const double map_point_min_match_ratio = basics::Config::get<double>("map_point_min_match_ratio");
+    static const int map_point_min_visible_times = basics::Config::get<int>("map_point_min_visible_times");
+    static const int map_maintenance_max_points = basics::Config::get<int>("map_maintenance_max_points");
+    static const double map_maintenance_max_time_ms = basics::Config::get<double>("map_maintenance_max_time_ms");
+    constexpr int kNumPointsPerTimeCheck = 32;
+
+    const auto t_start = std::chrono::steady_clock::now();
+    int num_checked = 0, num_erased = 0;
+    while (!map_points_to_check_.empty() && num_checked < map_maintenance_max_points)
     {
-        // TODO map is too large, remove some one
-        map_point_erase_ratio += 0.05;
+        if (num_checked % kNumPointsPerTimeCheck == 0 &&
+            std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t_start).count() >
+                map_maintenance_max_time_ms)
+            break;
+        const int pt_id = map_points_to_check_.front().first;
+        const MapPoint *pt = MapPoint::pool().get(map_points_to_check_.front().second);
+        map_points_to_check_.pop_front();
+        map_points_in_queue_.erase(pt_id);
+        num_checked++;
+
+        if (pt == nullptr) // Destroyed, e.g. fused into another point.
+            continue;
+        if (pt->visible_times_ >= map_point_min_visible_times &&
+            pt->matched_times_ < map_point_min_match_ratio * pt->visible_times_)
+            num_erased += map_->map_points_.erase(pt_id); // It may be alive, but out of the map.
     }
-    else
-        map_point_erase_ratio = default_erase;
-    cout << "map points: " << map_->map_points_.size() << endl;
+    printf("Map maintenance: checked %d points, erased %d. %d points in queue, %d in map.\n",
+           num_checked, num_erased, (int)map_points_to_check_.size(), (int)map_->map_points_.size());
+}
+
+void VisualOdometry::runDeferredMapping_()
+{
+    constexpr int kMaxDeferredKeyFrames = 3; // Beyond this, fuse anyway, so mapping is not starved.
+    int num_fused = 0;
+    while (!keyframes_to_fuse_.empty() &&
+           (!isOverFrameDeadline_() || keyframes_to_fuse_.size() > kMaxDeferredKeyFrames))
+    {
+        const Frame::Ptr keyframe = keyframes_to_fuse_.front();
+        keyframes_to_fuse_.pop_front();
+        if (!map_->hasKeyFrame(keyframe->id_))
+            continue; // culled
+        fuseMapPoints_(keyframe);
+        num_fused++;
+    }
+    if (is_keyframe_culling_pending_ && keyframes_to_fuse_.empty() && !isOverFrameDeadline_())
+    {
+        cullRedundantKeyFrames_();
+        is_keyframe_culling_pending_ = false;
+    }
+    if (num_fused > 0)
+        callMapPointUpdate_();
+    if (num_fused > 0 || !keyframes_to_fuse_.empty())
+        printf("Deferred mapping: fused %d keyframes, %d are still waiting.\n", num_fused, (int)keyframes_to_fuse_.size());
+}
+
+void VisualOdometry::adaptKeypointBudget_(double frame_time_ms)
+{
+    static const bool is_adaptive_keypoint_budget = basics::Config::getBool("is_adaptive_keypoint_budget");
+    static const int keypoint_budget_min = basics::Config::get<int>("keypoint_budget_min");
+    static const int keypoint_budget_max = basics::Config::get<int>("keypoint_budget_max");
+    static const int keypoint_budget_min_inliers = basics::Config::get<int>("keypoint_budget_min_inliers");
+    static const int keypoint_budget_healthy_inliers = basics::Config::get<int>("keypoint_budget_healthy_inliers");
+    constexpr double kTimeSmoothing = 0.3; // Weight of the latest frame in the average frame time.
+    constexpr double kDecrease = 0.8, kIncrease = 1.25, kRelax = 0.95;
+
+    frame_time_ms_ = frame_time_ms_ <= 0 ? frame_time_ms
+                                         : kTimeSmoothing * frame_time_ms + (1 - kTimeSmoothing) * frame_time_ms_;
+    if (!is_adaptive_keypoint_budget)
+        return;
+
+    const int num_inliers = curr_->inliers_to_mappt_connections_.size();
+    double budget = keypoint_budget_;
+    if (vo_state_ == LOST)
+        budget = keypoint_budget_max; // Relocalization needs as many features as possible.
+    else if (vo_state_ != DOING_TRACKING)
+        return;
+    else if (frame_deadline_ms_ > 0 && frame_time_ms_ > frame_deadline_ms_)
+        budget *= kDecrease; // Real time comes first.
+    else if (num_inliers < keypoint_budget_min_inliers)
+        budget *= kIncrease;
+    else if (num_inliers > keypoint_budget_healthy_inliers)
+        budget *= kRelax;
+    keypoint_budget_ = std::min(keypoint_budget_max, std::max(keypoint_budget_min, (int)budget));
+    printf("Keypoint budget: %d. Average frame time: %.1f ms, PnP inliers: %d.\n",
+           keypoint_budget_, frame_time_ms_, num_inliers);
 }
 
 void VisualOdometry::pushCurrPointsToMap_()
@@ -557,13 +1347,14 @@ void VisualOdometry::pushCurrPointsToMap_()
             cv::Point3f world_pos = basics::preTranslatePoint3f(inliers_pts3d_in_curr[i], T_w_curr);
 
             // Create map point
-            MapPoint::Ptr map_point(new MapPoint( // createMapPoint
+            MapPoint::Ptr map_point = MapPoint::create(
                 world_pos,
                 descriptors.row(pt_idx).clone(),                                                        // descriptor
                 basics::getNormalizedMat(basics::point3f_to_mat3x1(world_pos) - curr_->getCamCenter()), // view direction of the point
                 kpts_colors[pt_idx][0], kpts_colors[pt_idx][1], kpts_colors[pt_idx][2]                  // rgb color
-                ));
+                );
             map_point_id = map_point->id_;
+            queueMapPointCheck_(map_point.get());
             // cout<<map_point->id_ <<", "<< map_point->factory_id_<<endl;
 
             // Push to map
@@ -575,7 +1366,225 @@ void VisualOdometry::pushCurrPointsToMap_()
     return;
 }
 
-double VisualOdometry::getViewAngle_(Frame::Ptr frame, MapPoint::Ptr point)
+void VisualOdometry::fuseMapPoints_(Frame::Ptr keyframe)
+{
+    static const bool is_enable_map_point_fusion = basics::Config::getBool("is_enable_map_point_fusion");
+    static const double fusion_search_radius = basics::Config::get<double>("fusion_search_radius");
+    static const int fusion_max_descriptor_distance = basics::Config::get<int>("fusion_max_descriptor_distance");
+    if (!is_enable_map_point_fusion)
+        return;
+    if (keyframe->isDescriptorsSpilled()) // A deferred keyframe may be spilled by `manageKeyFrameMemory_` while waiting.
+    {
+        keyframe->restoreDescriptors();
+        keyframes_with_descriptors_.push_back(keyframe); // so it can be spilled again
+    }
+    const cv::Mat T_c_w = keyframe->T_w_c_.inv();
+    const cv::Point3f cam_center = basics::Mat3x1_to_Point3f(keyframe->getCamCenter());
+    const cv::Mat &K = keyframe->camera_->K_;
+    std::unordered_map<int, PtConn> &connections = keyframe->inliers_to_mappt_connections_;
+
+    // -- Keypoints in a grid of cells of the search radius, and the map points already observed
+    const int cell_size = std::max(1, (int)ceil(fusion_search_radius));
+    std::unordered_map<int, vector<int>> grid; // cell x * kMaxCells + cell y -> keypoints
+    constexpr int kMaxCells = 100000;
+    for (int i = 0; i < keyframe->keypoints_.size(); i++)
+    {
+        const cv::Point2f &pt = keyframe->keypoints_[i].pt;
+        grid[(int)(pt.x / cell_size) * kMaxCells + (int)(pt.y / cell_size)].push_back(i);
+    }
+    std::unordered_set<int> visited_pt_ids;
+    for (const auto &it : connections)
+        visited_pt_ids.insert(it.second.pt_map_idx);
+
+    // -- Project the nearby map points: the ones observed by the local keyframes, but not by this one
+    vector<int> pt_ids;
+    for (const Frame::Ptr &kf : keyframes_buff_)
+        for (const auto &it : kf->inliers_to_mappt_connections_)
+            if (visited_pt_ids.insert(it.second.pt_map_idx).second)
+                pt_ids.push_back(it.second.pt_map_idx);
+    int num_added = 0, num_fused = 0;
+    const double r2 = fusion_search_radius * fusion_search_radius;
+    for (int pt_id : pt_ids)
+    {
+        auto it_pt = map_->map_points_.find(pt_id);
+        if (it_pt == map_->map_points_.end())
+            continue; // fused into another one
+        MapPoint *pt = it_pt->second.get();
+        if (!pt->isInScaleRange(cv::norm(pt->pos_ - cam_center)))
+            continue;
+        const cv::Point3f p_cam = basics::preTranslatePoint3f(pt->pos_, T_c_w);
+        if (p_cam.z <= 0)
+            continue;
+        const cv::Point2f pixel = geometry::cam2pixel(p_cam, K);
+        if (pixel.x < 0 || pixel.y < 0 || pixel.x >= keyframe->image_size_.width || pixel.y >= keyframe->image_size_.height)
+            continue;
+
+        // The keypoint nearby with the most similar descriptor
+        int best_kpt = -1, best_dist = fusion_max_descriptor_distance + 1;
+        const int cx = pixel.x / cell_size, cy = pixel.y / cell_size;
+        for (int x = cx - 1; x <= cx + 1; x++)
+            for (int y = cy - 1; y <= cy + 1; y++)
+            {
+                auto it_cell = grid.find(x * kMaxCells + y);
+                if (it_cell == grid.end())
+                    continue;
+                for (int kpt_idx : it_cell->second)
+                {
+                    const cv::Point2f &kpt = keyframe->keypoints_[kpt_idx].pt;
+                    if ((kpt.x - pixel.x) * (kpt.x - pixel.x) + (kpt.y - pixel.y) * (kpt.y - pixel.y) > r2)
+                        continue;
+                    const int dist = cv::norm(pt->descriptor_, keyframe->descriptors_.row(kpt_idx), cv::NORM_HAMMING);
+                    if (dist < best_dist)
+                        best_kpt = kpt_idx, best_dist = dist;
+                }
+            }
+        if (best_kpt < 0)
+            continue;
+
+        // A new observation
+        auto it_conn = connections.find(best_kpt);
+        if (it_conn == connections.end())
+        {
+            connections[best_kpt] = PtConn{-1, pt_id};
+            addObservation_(pt, keyframe->id_, best_kpt);
+            num_added++;
+            continue;
+        }
+
+        // A duplicate. Keep the one which has been matched more often.
+        auto it_other = map_->map_points_.find(it_conn->second.pt_map_idx);
+        if (it_other == map_->map_points_.end())
+        {
+            it_conn->second.pt_map_idx = pt_id;
+            addObservation_(pt, keyframe->id_, best_kpt);
+            num_added++;
+            continue;
+        }
+        MapPoint *kept = it_other->second.get(), *removed = pt;
+        if (removed->matched_times_ > kept->matched_times_)
+            std::swap(kept, removed);
+        for (const std::pair<const int, int> &obs : removed->observations_) // Move its observations to the kept one.
+        {
+            Frame::Ptr frame = map_->findKeyFrame(obs.first);
+            if (frame == nullptr)
+                continue;
+            std::unordered_map<int, PtConn> &conns = frame->inliers_to_mappt_connections_;
+            auto it_removed = conns.find(obs.second);
+            if (it_removed == conns.end() || it_removed->second.pt_map_idx != removed->id_)
+                continue;
+            if (kept->observations_.count(obs.first)) // One landmark is observed by one keypoint of a frame.
+                conns.erase(it_removed);
+            else
+            {
+                it_removed->second.pt_map_idx = kept->id_;
+                addObservation_(kept, obs.first, obs.second);
+            }
+        }
+        kept->matched_times_ += removed->matched_times_;
+        kept->visible_times_ += removed->visible_times_;
+        queueMapPointCheck_(kept);
+        map_->map_points_.erase(removed->id_); // Last use of `removed`, which may be destroyed here.
+        num_fused++;
+    }
+    printf("Map point fusion: %d new observations, %d duplicated points fused.\n", num_added, num_fused);
+}
+
+void VisualOdometry::addObservation_(MapPoint *pt, int keyframe_id, int kpt_idx)
+{
+    pt->addObservation(keyframe_id, kpt_idx);
+    map_points_to_update_[pt->id_] = pt->handle_;
+}
+
+void VisualOdometry::eraseObservation_(MapPoint *pt, int keyframe_id)
+{
+    pt->eraseObservation(keyframe_id);
+    map_points_to_update_[pt->id_] = pt->handle_;
+}
+
+void VisualOdometry::callMapPointUpdate_()
+{
+    static const bool is_update_map_point_descriptors = basics::Config::getBool("is_update_map_point_descriptors");
+    static const double scale_factor = basics::Config::get<double>("scale_factor");
+    static const int level_pyramid = basics::Config::get<int>("level_pyramid");
+    if (!is_update_map_point_descriptors)
+    {
+        map_points_to_update_.clear();
+        return;
+    }
+    if (map_point_update_job_ != nullptr || map_points_to_update_.empty())
+        return; // The points wait for the running job.
+
+    // -- Copy the observations. Points are found by their handles, so a destroyed one is skipped without a lookup.
+    std::shared_ptr<MapPointUpdateJob> job(new MapPointUpdateJob);
+    for (const auto &it : map_points_to_update_)
+    {
+        const MapPoint *pt = MapPoint::pool().get(it.second);
+        if (pt == nullptr)
+            continue;
+        MapPointUpdateJob::Item item;
+        item.handle = it.second;
+        item.pos = pt->pos_;
+        item.ref_octave = -1;
+        for (const std::pair<const int, int> &obs : pt->observations_) // In the order of keyframe id.
+        {
+            Frame::Ptr keyframe = map_->findKeyFrame(obs.first);
+            if (keyframe == nullptr || obs.second >= keyframe->keypoints_.size())
+                continue;
+            const cv::Point3f center = basics::Mat3x1_to_Point3f(keyframe->getCamCenter());
+            item.cam_centers.push_back(center);
+            if (item.ref_octave < 0)
+            {
+                item.ref_cam_center = center;
+                item.ref_octave = keyframe->keypoints_[obs.second].octave;
+            }
+            if (!keyframe->isDescriptorsSpilled())
+                item.descriptors.push_back(keyframe->descriptors_.row(obs.second).clone());
+        }
+        if (item.ref_octave >= 0)
+            job->items.push_back(item);
+    }
+    map_points_to_update_.clear();
+    if (job->items.empty())
+        return;
+
+    // -- Compute in background
+    map_point_update_job_ = job;
+    map_point_update_future_ = std::async(std::launch::async, [job]() {
+        for (MapPointUpdateJob::Item &item : job->items)
+            MapPoint::computeFromObservations(
+                item.pos, item.descriptors, item.cam_centers, item.ref_cam_center, item.ref_octave,
+                scale_factor, level_pyramid, item.descriptor, item.norm, item.min_distance, item.max_distance);
+    });
+}
+
+void VisualOdometry::applyMapPointUpdate_(bool is_wait)
+{
+    if (map_point_update_job_ == nullptr)
+        return;
+    if (!is_wait && map_point_update_future_.wait_for(std::chrono::seconds(0)) != std::future_status::ready)
+        return; // still running
+    map_point_update_future_.get();
+
+    // Points destroyed meanwhile are skipped. Those changed meanwhile have been queued again.
+    int num_updated = 0;
+    for (const MapPointUpdateJob::Item &item : map_point_update_job_->items)
+    {
+        MapPoint *pt = MapPoint::pool().get(item.handle);
+        if (pt == nullptr)
+            continue;
+        if (!item.descriptor.empty())
+            pt->descriptor_ = item.descriptor;
+        if (!item.norm.empty())
+            pt->norm_ = item.norm;
+        pt->min_distance_ = item.min_distance;
+        pt->max_distance_ = item.max_distance;
+        num_updated++;
+    }
+    printf("Map point update: %d descriptors, norms and scale ranges.\n", num_updated);
+    map_point_update_job_ = nullptr;
+}
+
+double VisualOdometry::getViewAngle_(const Frame::Ptr &frame, const MapPoint *point)
 {
     cv::Mat n = basics::point3f_to_mat3x1(point->pos_) - frame->getCamCenter();
     n = basics::getNormalizedMat(n);
@@ -2,6 +2,8 @@
 
 #include "my_slam/vo/vo.h"
 
+#include <chrono>
+
 namespace my_slam
 {
 namespace vo
@@ -9,8 +11,14 @@ namespace vo
 
 void VisualOdometry::addFrame(Frame::Ptr frame)
 {
+    frame_start_time_ = std::chrono::steady_clock::now();
+
     // Settings
     pushFrameToBuff_(frame);
+    applyBundleAdjustmentResult_(); // If the background BA has finished, update keyframes' poses.
+    applyLoopCorrection_();         // If the pose graph optimization has finished, correct the map.
+    applyMapPointUpdate_();         // If the map points' descriptors have been recomputed, update them.
+    callLoopCorrection_();          // If a loop has been detected, start the pose graph optimization.
 
     // Renamed vars
     curr_ = frame;
@@ -21,9 +29,21 @@ void VisualOdometry::addFrame(Frame::Ptr frame)
     printf("\n\n=============================================\n");
     printf("Start processing the %dth image.\n", img_id);
 
-    curr_->calcKeyPoints();
-    curr_->calcDescriptors();
-    cout << "Number of keypoints: " << curr_->keypoints_.size() << endl;
+    // With KLT tracking or direct alignment, a tracked frame extracts ORB features only if they are not enough.
+    static const bool is_enable_klt_tracking = basics::Config::getBool("is_enable_klt_tracking");
+    static const bool is_enable_direct_alignment = basics::Config::getBool("is_enable_direct_alignment");
+    static const bool is_direct_alignment_replace_tracking = basics::Config::getBool("is_direct_alignment_replace_tracking");
+    const bool is_lazy_features = (is_enable_klt_tracking || is_enable_direct_alignment) && vo_state_ == DOING_TRACKING;
+    // Before tracking, any frame may become a keyframe, so its keypoints are refined at full resolution.
+    auto extractFeatures = [this]() {
+        curr_->calcKeyPoints(keypoint_budget_);
+        if (vo_state_ != DOING_TRACKING)
+            curr_->refineKeyPointsAtFullResolution();
+        curr_->calcDescriptors();
+        cout << "Number of keypoints: " << curr_->keypoints_.size() << endl;
+    };
+    if (!is_lazy_features)
+        extractFeatures();
     prev_ref_ = ref_;
 
     // vo_state_: BLANK -> DOING_INITIALIZATION
@@ -58,6 +78,7 @@ void VisualOdometry::addFrame(Frame::Ptr frame)
             cout << "Large movement detected at frame " << img_id << ". Start initialization" << endl;
             pushCurrPointsToMap_();
             addKeyFrame_(curr_);
+            callMapPointUpdate_();
             vo_state_ = DOING_TRACKING;
             cout << "Inilialiation success !!!" << endl;
             cout << "!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!" << endl;
@@ -71,8 +92,25 @@ void VisualOdometry::addFrame(Frame::Ptr frame)
     else if (vo_state_ == DOING_TRACKING)
     {
         printf("\nDoing tracking\n");
-        curr_->T_w_c_ = ref_->T_w_c_.clone(); // Initial estimation of the current pose
-        bool is_pnp_good = poseEstimationPnP_();
+        // Initial estimation of the current pose.
+        //  In localization-only mode, there is no new keyframe close to the current frame, so the previous frame is used.
+        curr_->T_w_c_ = (is_localization_only_ ? prev_ : ref_)->T_w_c_.clone();
+        // Direct alignment gives a pose without features, which seeds the feature tracking, or replaces it.
+        const bool is_pose_predicted = is_enable_direct_alignment && alignToPrevFrameDirectly_();
+        bool is_pnp_good = false;
+        if (is_pose_predicted && is_direct_alignment_replace_tracking &&
+            (is_localization_only_ || !checkLargeMoveForAddKeyFrame_(curr_, ref_)))
+        {
+            is_pnp_good = observeMapPointsByProjection_();
+        }
+        if (!is_pnp_good && is_enable_klt_tracking)
+            is_pnp_good = trackByOpticalFlow_(is_pose_predicted);
+        if (!is_pnp_good)
+        {
+            if (is_lazy_features)
+                extractFeatures();
+            is_pnp_good = poseEstimationPnP_();
+        }
         if (!is_pnp_good) // pnp failed. Print log.
         {
             int num_matches = curr_->matches_with_map_.size();
@@ -84,23 +122,56 @@ void VisualOdometry::addFrame(Frame::Ptr frame)
                 printf("    Computed world to camera transformation:\n");
                 std::cout << curr_->T_w_c_ << std::endl;
             }
-            printf("PnP result has been reset as R=identity, t=zero.\n");
+            printf("PnP result has been reset as the previous frame's pose.\n");
+
+            // Try to relocalize right away. Otherwise, wait for the next frames.
+            if (relocalize_())
+                printf("Relocalization success.\n");
+            else
+            {
+                vo_state_ = LOST;
+                printf("Tracking is lost !!!\n");
+            }
         }
         else // pnp good
         {
-            callBundleAdjustment_();
+            // The current pose has been refined by motion-only BA inside PnP.
+            // The windowed BA is only called when a keyframe is inserted.
+
             // -- Insert a keyframe is motion is large. Then, triangulate more points
-            if (checkLargeMoveForAddKeyFrame_(curr_, ref_))
+            //  In localization-only mode, the map is fixed.
+            if (!is_localization_only_ && checkLargeMoveForAddKeyFrame_(curr_, ref_))
             {
+                // The keypoints of a keyframe are triangulated, so they are refined at full resolution.
+                //      Their descriptors, computed for PnP, are recomputed at the refined positions.
+                curr_->refineKeyPointsAtFullResolution();
+
                 // Feature matching
                 static const float max_matching_pixel_dist_in_triangulation =
                     basics::Config::get<float>("max_matching_pixel_dist_in_triangulation");
                 static const int method_index = basics::Config::get<float>("feature_match_method_index_pnp");
-                geometry::matchFeatures(
-                    ref_->descriptors_, curr_->descriptors_, curr_->matches_with_ref_, method_index,
-                    false,
-                    ref_->keypoints_, curr_->keypoints_,
-                    max_matching_pixel_dist_in_triangulation);
+                if (vocabulary_ != nullptr && !ref_->feat_vec_.empty())
+                {
+                    // Only descriptors under the same vocabulary node are compared.
+                    curr_->computeBoW(*vocabulary_);
+                    geometry::matchFeaturesByBoW(ref_->descriptors_, ref_->feat_vec_,
+                                                 curr_->descriptors_, curr_->feat_vec_, curr_->matches_with_ref_);
+                    if (max_matching_pixel_dist_in_triangulation > 0)
+                    {
+                        const float max_dist = max_matching_pixel_dist_in_triangulation;
+                        vector<cv::DMatch> &matches = curr_->matches_with_ref_;
+                        matches.erase(std::remove_if(matches.begin(), matches.end(), [&](const cv::DMatch &m) {
+                                          return cv::norm(ref_->keypoints_[m.queryIdx].pt - curr_->keypoints_[m.trainIdx].pt) > max_dist;
+                                      }),
+                                      matches.end());
+                    }
+                }
+                else
+                    geometry::matchFeatures(
+                        ref_->descriptors_, curr_->descriptors_, curr_->matches_with_ref_, method_index,
+                        false,
+                        ref_->keypoints_, curr_->keypoints_,
+                        max_matching_pixel_dist_in_triangulation);
 
                 // Find inliers by epipolar constraint
                 curr_->inliers_matches_with_ref_ = geometry::helperFindInlierMatchesByEpipolarCons(
@@ -118,10 +189,43 @@ void VisualOdometry::addFrame(Frame::Ptr frame)
                 retainGoodTriangulationResult_();
 
                 // -- Update state
+                //      Fusion and culling can wait for a later frame, if this one is over its deadline.
                 pushCurrPointsToMap_();
-                optimizeMap_();
                 addKeyFrame_(curr_);
+                if (isOverFrameDeadline_() || !keyframes_to_fuse_.empty())
+                {
+                    keyframes_to_fuse_.push_back(curr_);
+                    is_keyframe_culling_pending_ = true;
+                    printf("Over the frame deadline. Fusion and culling of keyframe %d are deferred.\n", curr_->id_);
+                }
+                else
+                {
+                    fuseMapPoints_(curr_);
+                    cullRedundantKeyFrames_();
+                }
+                callMapPointUpdate_();
+                callBundleAdjustment_();
             }
+
+            // -- Check a few recently changed map points, and do the deferred mapping, if there is time left.
+            if (!is_localization_only_)
+            {
+                if (!isOverFrameDeadline_())
+                    maintainMapPoints_();
+                runDeferredMapping_();
+            }
+        }
+    }
+
+    else if (vo_state_ == LOST)
+    {
+        printf("\nTracking is lost. Doing relocalization\n");
+        // prev_ is nullptr, if the 1st frame is localized in a prebuilt map.
+        curr_->T_w_c_ = prev_ != nullptr ? prev_->T_w_c_.clone() : cv::Mat::eye(4, 4, CV_64F);
+        if (relocalize_())
+        {
+            vo_state_ = DOING_TRACKING;
+            printf("Relocalization success. Continue tracking.\n");
         }
     }
 
@@ -137,7 +241,19 @@ void VisualOdometry::addFrame(Frame::Ptr frame)
         cout << "R_prev_to_curr: " << R << endl;
         cout << "t_prev_to_curr: " << t.t() << endl;
     }
+    // Only the pose of a previous frame is used, and its image pyramid by KLT tracking of the next frame.
+    if (prev_ != nullptr && !map_->hasKeyFrame(prev_->id_))
+    {
+        prev_->releaseImage();
+        prev_->releaseScratch();
+    }
+    else if (prev_ != nullptr)
+        prev_->releaseOpticalFlowPyramid();
+    curr_->full_res_img_.release(); // Only used by this frame's keyframe insertion.
     prev_ = curr_;
+
+    // The number of keypoints of the next frame
+    adaptKeypointBudget_(getFrameTimeMs_());
     cout << "\nEnd of a frame" << endl;
 }
 
@@ -4,6 +4,14 @@
 #include <iostream>
 #include <boost/format.hpp> // for setting image filename
 #include <fstream>
+#include <cstdint>
+#include <cstring>
+
+// mmap
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 namespace my_slam
 {
@@ -76,6 +84,36 @@ void writePoseToFile(const string filename, vector<cv::Mat> list_T)
     fout.close();
 }
 
+void writePointCloudToFile(const string filename,
+                           const vector<cv::Point3f> &pts,
+                           const vector<vector<unsigned char>> &colors)
+{
+    std::ofstream fout;
+    fout.open(filename);
+    if (!fout.is_open())
+    {
+        cout << "my WARNING: failed to store point cloud to the wrong file name of:" << endl;
+        cout << "    " << filename << endl;
+        return;
+    }
+    const bool has_color = colors.size() == pts.size();
+    fout << "ply\n"
+         << "format ascii 1.0\n"
+         << "element vertex " << pts.size() << "\n"
+         << "property float x\nproperty float y\nproperty float z\n";
+    if (has_color)
+        fout << "property uchar red\nproperty uchar green\nproperty uchar blue\n";
+    fout << "end_header\n";
+    for (int i = 0; i < pts.size(); i++)
+    {
+        fout << pts[i].x << " " << pts[i].y << " " << pts[i].z;
+        if (has_color)
+            fout << " " << (int)colors[i][0] << " " << (int)colors[i][1] << " " << (int)colors[i][2];
+        fout << '\n';
+    }
+    fout.close();
+}
+
 vector<cv::Mat> readPoseFromFile(const string filename)
 {
     // Output
@@ -116,5 +154,538 @@ vector<cv::Mat> readPoseFromFile(const string filename)
     return list_T;
 }
 
+// ------------------- Binary map file -------------------
+
+namespace
+{
+const char kMapMagic[8] = {'M', 'Y', 'S', 'L', 'A', 'M', 'M', 'P'};
+const uint32_t kMapVersion = 3; // 2: scale invariance ranges of points. 3: BoW and feature vectors of keyframes
+
+// Sections of the file, in this order.
+enum MapSection
+{
+    KEYFRAMES,
+    KEYPOINTS,
+    KEYFRAME_DESCRIPTORS,
+    POINT_IDS,
+    POSITIONS,
+    NORMALS,
+    COLORS,
+    POINT_DESCRIPTORS,
+    POINT_COUNTERS,
+    SCALE_RANGES,
+    OBSERVATION_OFFSETS,
+    OBSERVATIONS,
+    BOW_OFFSETS,
+    BOW_WORDS,
+    FEATURE_OFFSETS,
+    FEATURES,
+    NUM_SECTIONS
+};
+
+struct MapFileHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t descriptor_bytes;
+    uint64_t num_keyframes;
+    uint64_t num_keypoints; // of all keyframes
+    uint64_t num_points;
+    uint64_t num_observations;
+    uint64_t bow_key; // `saveMap`'s bow_key if the BoW sections are written, or 0.
+    uint64_t num_bow_words;
+    uint64_t num_features;
+    double K[9];
+    uint64_t offsets[NUM_SECTIONS]; // in bytes from the beginning of the file
+};
+
+struct KeyFrameRecord
+{
+    int32_t id;
+    uint32_t num_keypoints;
+    uint64_t first_keypoint;
+    double T_w_c[16];
+};
+
+struct KeyPointRecord
+{
+    float x, y, size, angle, response;
+    int32_t octave;
+};
+
+struct ObservationRecord
+{
+    int32_t keyframe_index;
+    int32_t keypoint_idx;
+};
+
+struct BowRecord
+{
+    double weight;
+    int32_t word_id;
+    int32_t padding;
+};
+
+// A descriptor under a node of the feature vector
+struct FeatureRecord
+{
+    int32_t node_id;
+    int32_t keypoint_idx;
+};
+
+inline uint64_t alignTo8(uint64_t n) { return (n + 7) & ~uint64_t(7); }
+
+// Keep a memory-mapped file alive until the last descriptor pointing into it is gone.
+struct MappedFile
+{
+    void *data = MAP_FAILED;
+    size_t size = 0;
+    ~MappedFile()
+    {
+        if (data != MAP_FAILED)
+            munmap(data, size);
+    }
+};
+} // namespace
+
+void saveMap(const string filename, const Map::Ptr &map, uint64_t bow_key)
+{
+    // Keyframes and points in the order of id, so the file is deterministic.
+    vector<Frame::Ptr> keyframes;
+    for (const auto &it : map->keyframes_)
+        keyframes.push_back(it.second);
+    std::sort(keyframes.begin(), keyframes.end(),
+              [](const Frame::Ptr &f1, const Frame::Ptr &f2) { return f1->id_ < f2->id_; });
+    vector<MapPoint::Ptr> points;
+    for (const auto &it : map->map_points_)
+        points.push_back(it.second);
+    std::sort(points.begin(), points.end(),
+              [](const MapPoint::Ptr &p1, const MapPoint::Ptr &p2) { return p1->id_ < p2->id_; });
+    std::unordered_map<int, int> point_index;
+    for (int i = 0; i < points.size(); i++)
+        point_index[points[i]->id_] = i;
+
+    // Observations of each point, from the keyframes' 2d-3d associations
+    vector<vector<ObservationRecord>> observations(points.size());
+    uint64_t num_keypoints = 0, num_observations = 0;
+    for (int i = 0; i < keyframes.size(); i++)
+    {
+        num_keypoints += keyframes[i]->keypoints_.size();
+        for (const auto &it : keyframes[i]->inliers_to_mappt_connections_)
+        {
+            auto it_idx = point_index.find(it.second.pt_map_idx);
+            if (it_idx == point_index.end())
+                continue; // point has been deleted
+            observations[it_idx->second].push_back(ObservationRecord{i, it.first});
+            num_observations++;
+        }
+    }
+
+    // BoW and feature vectors are only written if every keyframe has them.
+    uint64_t num_bow_words = 0, num_features = 0;
+    for (const Frame::Ptr &kf : keyframes)
+    {
+        if (kf->bow_vec_.empty())
+            bow_key = 0;
+        num_bow_words += kf->bow_vec_.size();
+        for (const auto &it : kf->feat_vec_)
+            num_features += it.second.size();
+    }
+    if (bow_key == 0)
+        num_bow_words = num_features = 0;
+
+    // Header
+    MapFileHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, kMapMagic, sizeof(kMapMagic));
+    header.version = kMapVersion;
+    header.descriptor_bytes = 32;
+    for (const Frame::Ptr &kf : keyframes)
+        if (!kf->descriptors_.empty())
+            header.descriptor_bytes = kf->descriptors_.cols;
+    header.num_keyframes = keyframes.size();
+    header.num_keypoints = num_keypoints;
+    header.num_points = points.size();
+    header.num_observations = num_observations;
+    header.bow_key = bow_key;
+    header.num_bow_words = num_bow_words;
+    header.num_features = num_features;
+    if (!keyframes.empty())
+        for (int i = 0; i < 9; i++)
+            header.K[i] = keyframes[0]->camera_->K_.at<double>(i / 3, i % 3);
+    const uint64_t section_bytes[NUM_SECTIONS] = {
+        sizeof(KeyFrameRecord) * header.num_keyframes,
+        sizeof(KeyPointRecord) * num_keypoints,
+        header.descriptor_bytes * num_keypoints,
+        sizeof(int32_t) * header.num_points,
+        sizeof(float) * 3 * header.num_points,
+        sizeof(float) * 3 * header.num_points,
+        sizeof(uint8_t) * 4 * header.num_points,
+        header.descriptor_bytes * header.num_points,
+        sizeof(int32_t) * 2 * header.num_points,
+        sizeof(float) * 2 * header.num_points,
+        sizeof(uint64_t) * (header.num_points + 1),
+        sizeof(ObservationRecord) * num_observations,
+        sizeof(uint64_t) * (header.num_keyframes + 1),
+        sizeof(BowRecord) * num_bow_words,
+        sizeof(uint64_t) * (header.num_keyframes + 1),
+        sizeof(FeatureRecord) * num_features};
+    uint64_t offset = alignTo8(sizeof(header));
+    for (int s = 0; s < NUM_SECTIONS; s++)
+    {
+        header.offsets[s] = offset;
+        offset = alignTo8(offset + section_bytes[s]);
+    }
+    const uint64_t file_size = offset;
+
+    // -- The sections must have the sizes above, or every later section would be shifted.
+    //      Spilled descriptors are checked when they are read back below.
+    auto isDescriptorsOfSize = [&header](const cv::Mat &descriptors, int rows) {
+        if (rows == 0)
+            return descriptors.rows == 0;
+        return descriptors.rows == rows && descriptors.cols == (int)header.descriptor_bytes &&
+               descriptors.type() == CV_8U && descriptors.isContinuous();
+    };
+    for (const Frame::Ptr &kf : keyframes)
+        if (!kf->isDescriptorsSpilled() && !isDescriptorsOfSize(kf->descriptors_, kf->keypoints_.size()))
+            throw std::runtime_error("vo_io.cpp::saveMap: descriptors of keyframe " + std::to_string(kf->id_) +
+                                     " don't match its keypoints.");
+    for (const MapPoint::Ptr &pt : points)
+        if (!isDescriptorsOfSize(pt->descriptor_, 1))
+            throw std::runtime_error("vo_io.cpp::saveMap: map point " + std::to_string(pt->id_) +
+                                     " has no descriptor of " + std::to_string(header.descriptor_bytes) + " bytes.");
+
+    // Write. Each section is padded to 8 bytes.
+    std::ofstream fout(filename, std::ios::binary);
+    if (!fout.is_open())
+        throw std::runtime_error("vo_io.cpp::saveMap: cannot open " + filename);
+    auto write = [&fout](const void *data, uint64_t bytes) { fout.write(reinterpret_cast<const char *>(data), bytes); };
+    auto pad = [&fout]() {
+        const char zeros[8] = {0};
+        fout.write(zeros, alignTo8(fout.tellp()) - fout.tellp());
+    };
+    // After padding a section, the stream is where the next section should begin.
+    auto checkOffset = [&fout, &header, file_size, &filename](int next_section) {
+        const uint64_t expected = next_section < NUM_SECTIONS ? header.offsets[next_section] : file_size;
+        if (!fout || static_cast<uint64_t>(fout.tellp()) != expected)
+            throw std::runtime_error("vo_io.cpp::saveMap: section " + std::to_string(next_section - 1) +
+                                     " has a wrong size in " + filename);
+    };
+    write(&header, sizeof(header));
+    pad();
+    checkOffset(KEYFRAMES);
+
+    uint64_t first_keypoint = 0;
+    for (const Frame::Ptr &kf : keyframes)
+    {
+        KeyFrameRecord record;
+        record.id = kf->id_;
+        record.num_keypoints = kf->keypoints_.size();
+        record.first_keypoint = first_keypoint;
+        for (int i = 0; i < 16; i++)
+            record.T_w_c[i] = kf->T_w_c_.at<double>(i / 4, i % 4);
+        write(&record, sizeof(record));
+        first_keypoint += record.num_keypoints;
+    }
+    pad();
+    checkOffset(KEYPOINTS);
+    for (const Frame::Ptr &kf : keyframes)
+        for (const cv::KeyPoint &kpt : kf->keypoints_)
+        {
+            const KeyPointRecord record{kpt.pt.x, kpt.pt.y, kpt.size, kpt.angle, kpt.response, kpt.octave};
+            write(&record, sizeof(record));
+        }
+    pad();
+    checkOffset(KEYFRAME_DESCRIPTORS);
+    for (const Frame::Ptr &kf : keyframes)
+    {
+        const cv::Mat descriptors = kf->isDescriptorsSpilled() ? kf->readSpilledDescriptors() : kf->descriptors_;
+        if (!isDescriptorsOfSize(descriptors, kf->keypoints_.size()))
+            throw std::runtime_error("vo_io.cpp::saveMap: spilled descriptors of keyframe " + std::to_string(kf->id_) +
+                                     " don't match its keypoints.");
+        if (descriptors.rows > 0)
+            write(descriptors.ptr<uchar>(), descriptors.rows * header.descriptor_bytes);
+    }
+    pad();
+    checkOffset(POINT_IDS);
+    for (const MapPoint::Ptr &pt : points)
+    {
+        const int32_t id = pt->id_;
+        write(&id, sizeof(id));
+    }
+    pad();
+    checkOffset(POSITIONS);
+    for (const MapPoint::Ptr &pt : points)
+    {
+        const float pos[3] = {pt->pos_.x, pt->pos_.y, pt->pos_.z};
+        write(pos, sizeof(pos));
+    }
+    pad();
+    checkOffset(NORMALS);
+    for (const MapPoint::Ptr &pt : points)
+    {
+        float norm[3] = {0, 0, 0};
+        for (int i = 0; i < 3 && !pt->norm_.empty(); i++)
+            norm[i] = pt->norm_.at<double>(i, 0);
+        write(norm, sizeof(norm));
+    }
+    pad();
+    checkOffset(COLORS);
+    for (const MapPoint::Ptr &pt : points)
+    {
+        uint8_t color[4] = {0, 0, 0, 0};
+        for (int i = 0; i < 3 && i < pt->color_.size(); i++)
+            color[i] = pt->color_[i];
+        write(color, sizeof(color));
+    }
+    pad();
+    checkOffset(POINT_DESCRIPTORS);
+    for (const MapPoint::Ptr &pt : points)
+        write(pt->descriptor_.ptr<uchar>(), header.descriptor_bytes);
+    pad();
+    checkOffset(POINT_COUNTERS);
+    for (const MapPoint::Ptr &pt : points)
+    {
+        const int32_t counters[2] = {pt->matched_times_, pt->visible_times_};
+        write(counters, sizeof(counters));
+    }
+    pad();
+    checkOffset(SCALE_RANGES);
+    for (const MapPoint::Ptr &pt : points)
+    {
+        const float range[2] = {pt->min_distance_, pt->max_distance_};
+        write(range, sizeof(range));
+    }
+    pad();
+    checkOffset(OBSERVATION_OFFSETS);
+    uint64_t obs_offset = 0;
+    for (const vector<ObservationRecord> &obs : observations)
+    {
+        write(&obs_offset, sizeof(obs_offset));
+        obs_offset += obs.size();
+    }
+    write(&obs_offset, sizeof(obs_offset));
+    pad();
+    checkOffset(OBSERVATIONS);
+    for (const vector<ObservationRecord> &obs : observations)
+        write(obs.data(), sizeof(ObservationRecord) * obs.size());
+    pad();
+    checkOffset(BOW_OFFSETS);
+    // Without BoW, the offsets are all 0 and the BoW sections are empty.
+    const int num_keyframes_with_bow = bow_key != 0 ? keyframes.size() : 0;
+    uint64_t bow_offset = 0;
+    for (int i = 0; i < keyframes.size(); i++)
+    {
+        write(&bow_offset, sizeof(bow_offset));
+        if (i < num_keyframes_with_bow)
+            bow_offset += keyframes[i]->bow_vec_.size();
+    }
+    write(&bow_offset, sizeof(bow_offset));
+    pad();
+    checkOffset(BOW_WORDS);
+    for (int i = 0; i < num_keyframes_with_bow; i++)
+        for (const auto &it : keyframes[i]->bow_vec_)
+        {
+            const BowRecord record{it.second, it.first, 0};
+            write(&record, sizeof(record));
+        }
+    pad();
+    checkOffset(FEATURE_OFFSETS);
+    uint64_t feature_offset = 0;
+    for (int i = 0; i < keyframes.size(); i++)
+    {
+        write(&feature_offset, sizeof(feature_offset));
+        if (i < num_keyframes_with_bow)
+            for (const auto &it : keyframes[i]->feat_vec_)
+                feature_offset += it.second.size();
+    }
+    write(&feature_offset, sizeof(feature_offset));
+    pad();
+    checkOffset(FEATURES);
+    for (int i = 0; i < num_keyframes_with_bow; i++)
+        for (const auto &it : keyframes[i]->feat_vec_)
+            for (int keypoint_idx : it.second)
+            {
+                const FeatureRecord record{it.first, keypoint_idx};
+                write(&record, sizeof(record));
+            }
+    pad();
+    checkOffset(NUM_SECTIONS);
+    if (!fout)
+        throw std::runtime_error("vo_io.cpp::saveMap: failed to write " + filename);
+    printf("Saved map of %d keyframes and %d points%s to %s\n",
+           (int)header.num_keyframes, (int)header.num_points, bow_key != 0 ? " with BoW" : "", filename.c_str());
+}
+
+Map::Ptr loadMap(const string filename)
+{
+    // Map the file. Pages are copy-on-write, so the loaded descriptors can still be modified in memory.
+    //      Everything else is copied into Frames, MapPoints and their observations.
+    std::shared_ptr<MappedFile> file(new MappedFile);
+    const int fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0)
+        throw std::runtime_error("vo_io.cpp::loadMap: cannot open " + filename);
+    struct stat st;
+    if (fstat(fd, &st) != 0)
+    {
+        close(fd);
+        throw std::runtime_error("vo_io.cpp::loadMap: cannot stat " + filename);
+    }
+    file->size = st.st_size;
+    if (file->size < sizeof(MapFileHeader))
+    {
+        close(fd);
+        throw std::runtime_error("vo_io.cpp::loadMap: file is too small for a map: " + filename);
+    }
+    file->data = mmap(nullptr, file->size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (file->data == MAP_FAILED)
+        throw std::runtime_error("vo_io.cpp::loadMap: cannot map " + filename);
+
+    uchar *base = static_cast<uchar *>(file->data);
+    const MapFileHeader &header = *reinterpret_cast<const MapFileHeader *>(base);
+    if (memcmp(header.magic, kMapMagic, sizeof(kMapMagic)) != 0 || header.version != kMapVersion)
+        throw std::runtime_error("vo_io.cpp::loadMap: not a map file of version " +
+                                 std::to_string(kMapVersion) + ": " + filename);
+    auto throwCorrupted = [&filename](const string &what) {
+        throw std::runtime_error("vo_io.cpp::loadMap: " + what + " is out of range. The file is truncated or corrupted: " + filename);
+    };
+
+    // -- Every section is aligned and inside the file. Sizes are checked by division, so a corrupted count can't overflow.
+    const uint64_t file_size = file->size;
+    auto checkSection = [&](MapSection s, uint64_t count, uint64_t element_bytes) {
+        const uint64_t offset = header.offsets[s];
+        if (offset % 8 != 0 || offset > file_size || count > (file_size - offset) / element_bytes)
+            throwCorrupted("section " + std::to_string(s));
+    };
+    if (header.descriptor_bytes == 0)
+        throwCorrupted("descriptor size");
+    checkSection(KEYFRAMES, header.num_keyframes, sizeof(KeyFrameRecord));
+    checkSection(KEYPOINTS, header.num_keypoints, sizeof(KeyPointRecord));
+    checkSection(KEYFRAME_DESCRIPTORS, header.num_keypoints, header.descriptor_bytes);
+    checkSection(POINT_IDS, header.num_points, sizeof(int32_t));
+    checkSection(POSITIONS, header.num_points, 3 * sizeof(float));
+    checkSection(NORMALS, header.num_points, 3 * sizeof(float));
+    checkSection(COLORS, header.num_points, 4 * sizeof(uint8_t));
+    checkSection(POINT_DESCRIPTORS, header.num_points, header.descriptor_bytes);
+    checkSection(POINT_COUNTERS, header.num_points, 2 * sizeof(int32_t));
+    checkSection(SCALE_RANGES, header.num_points, 2 * sizeof(float));
+    checkSection(OBSERVATION_OFFSETS, header.num_points + 1, sizeof(uint64_t));
+    checkSection(OBSERVATIONS, header.num_observations, sizeof(ObservationRecord));
+    checkSection(BOW_OFFSETS, header.num_keyframes + 1, sizeof(uint64_t));
+    checkSection(BOW_WORDS, header.num_bow_words, sizeof(BowRecord));
+    checkSection(FEATURE_OFFSETS, header.num_keyframes + 1, sizeof(uint64_t));
+    checkSection(FEATURES, header.num_features, sizeof(FeatureRecord));
+    auto section = [base, &header](MapSection s) { return base + header.offsets[s]; };
+    const int num_bytes = header.descriptor_bytes;
+
+    Map::Ptr map(new Map);
+    map->storage_ = file;
+    map->bow_key_ = header.bow_key;
+    geometry::Camera::Ptr camera(new geometry::Camera(
+        (cv::Mat_<double>(3, 3) << header.K[0], header.K[1], header.K[2],
+         header.K[3], header.K[4], header.K[5], header.K[6], header.K[7], header.K[8])));
+
+    // Keyframes
+    const KeyFrameRecord *kf_records = reinterpret_cast<const KeyFrameRecord *>(section(KEYFRAMES));
+    const KeyPointRecord *kpt_records = reinterpret_cast<const KeyPointRecord *>(section(KEYPOINTS));
+    uchar *kf_descriptors = section(KEYFRAME_DESCRIPTORS);
+    const uint64_t *bow_offsets = reinterpret_cast<const uint64_t *>(section(BOW_OFFSETS));
+    const BowRecord *bow_words = reinterpret_cast<const BowRecord *>(section(BOW_WORDS));
+    const uint64_t *feature_offsets = reinterpret_cast<const uint64_t *>(section(FEATURE_OFFSETS));
+    const FeatureRecord *features = reinterpret_cast<const FeatureRecord *>(section(FEATURES));
+    vector<Frame::Ptr> keyframes;
+    int max_frame_id = -1;
+    for (uint64_t i = 0; i < header.num_keyframes; i++)
+    {
+        const KeyFrameRecord &record = kf_records[i];
+        if (record.first_keypoint > header.num_keypoints ||
+            record.num_keypoints > header.num_keypoints - record.first_keypoint)
+            throwCorrupted("keypoints of keyframe " + std::to_string(record.id));
+        Frame::Ptr kf = Frame::create();
+        kf->id_ = record.id;
+        kf->time_stamp_ = -1;
+        kf->camera_ = camera;
+        kf->T_w_c_ = cv::Mat(4, 4, CV_64F);
+        for (int j = 0; j < 16; j++)
+            kf->T_w_c_.at<double>(j / 4, j % 4) = record.T_w_c[j];
+        kf->keypoints_.reserve(record.num_keypoints);
+        for (uint64_t j = record.first_keypoint; j < record.first_keypoint + record.num_keypoints; j++)
+        {
+            const KeyPointRecord &k = kpt_records[j];
+            kf->keypoints_.push_back(cv::KeyPoint(k.x, k.y, k.size, k.angle, k.response, k.octave));
+        }
+        if (record.num_keypoints > 0)
+            kf->descriptors_ = cv::Mat(record.num_keypoints, num_bytes, CV_8U,
+                                       kf_descriptors + record.first_keypoint * num_bytes);
+        if (header.bow_key != 0)
+        {
+            if (bow_offsets[i] > bow_offsets[i + 1] || bow_offsets[i + 1] > header.num_bow_words ||
+                feature_offsets[i] > feature_offsets[i + 1] || feature_offsets[i + 1] > header.num_features)
+                throwCorrupted("BoW of keyframe " + std::to_string(record.id));
+            for (uint64_t j = bow_offsets[i]; j < bow_offsets[i + 1]; j++)
+                kf->bow_vec_[bow_words[j].word_id] = bow_words[j].weight;
+            for (uint64_t j = feature_offsets[i]; j < feature_offsets[i + 1]; j++)
+            {
+                if (features[j].keypoint_idx < 0 || features[j].keypoint_idx >= (int64_t)record.num_keypoints)
+                    throwCorrupted("a feature of keyframe " + std::to_string(record.id));
+                kf->feat_vec_[features[j].node_id].push_back(features[j].keypoint_idx);
+            }
+        }
+        keyframes.push_back(kf);
+        map->keyframes_[kf->id_] = kf;
+        max_frame_id = std::max(max_frame_id, kf->id_);
+    }
+
+    // Points, and their observations
+    const int32_t *ids = reinterpret_cast<const int32_t *>(section(POINT_IDS));
+    const float *positions = reinterpret_cast<const float *>(section(POSITIONS));
+    const float *normals = reinterpret_cast<const float *>(section(NORMALS));
+    const uint8_t *colors = section(COLORS);
+    uchar *pt_descriptors = section(POINT_DESCRIPTORS);
+    const int32_t *counters = reinterpret_cast<const int32_t *>(section(POINT_COUNTERS));
+    const float *scale_ranges = reinterpret_cast<const float *>(section(SCALE_RANGES));
+    const uint64_t *obs_offsets = reinterpret_cast<const uint64_t *>(section(OBSERVATION_OFFSETS));
+    const ObservationRecord *observations = reinterpret_cast<const ObservationRecord *>(section(OBSERVATIONS));
+    int max_point_id = -1;
+    for (uint64_t i = 0; i < header.num_points; i++)
+    {
+        const float *p = positions + 3 * i, *n = normals + 3 * i;
+        const uint8_t *c = colors + 4 * i;
+        MapPoint::Ptr pt = MapPoint::create(
+            cv::Point3f(p[0], p[1], p[2]),
+            cv::Mat(1, num_bytes, CV_8U, pt_descriptors + i * num_bytes),
+            (cv::Mat_<double>(3, 1) << n[0], n[1], n[2]),
+            c[0], c[1], c[2]);
+        pt->id_ = ids[i];
+        pt->matched_times_ = counters[2 * i];
+        pt->visible_times_ = counters[2 * i + 1];
+        pt->min_distance_ = scale_ranges[2 * i];
+        pt->max_distance_ = scale_ranges[2 * i + 1];
+        map->map_points_[pt->id_] = pt;
+        max_point_id = std::max(max_point_id, pt->id_);
+
+        if (obs_offsets[i] > obs_offsets[i + 1] || obs_offsets[i + 1] > header.num_observations)
+            throwCorrupted("observations of point " + std::to_string(pt->id_));
+        for (uint64_t j = obs_offsets[i]; j < obs_offsets[i + 1]; j++)
+        {
+            const ObservationRecord &obs = observations[j];
+            if (obs.keyframe_index < 0 || obs.keyframe_index >= (int64_t)keyframes.size() || obs.keypoint_idx < 0 ||
+                obs.keypoint_idx >= (int64_t)keyframes[obs.keyframe_index]->keypoints_.size())
+                throwCorrupted("an observation of point " + std::to_string(pt->id_));
+            const Frame::Ptr &keyframe = keyframes[obs.keyframe_index];
+            keyframe->inliers_to_mappt_connections_[obs.keypoint_idx] = PtConn{-1, pt->id_};
+            pt->addObservation(keyframe->id_, obs.keypoint_idx);
+        }
+    }
+
+    // New frames and points should not reuse the loaded ids.
+    Frame::factory_id_ = std::max(Frame::factory_id_, max_frame_id + 1);
+    MapPoint::factory_id_ = std::max(MapPoint::factory_id_, max_point_id + 1);
+    printf("Loaded map of %d keyframes and %d points%s from %s\n",
+           (int)header.num_keyframes, (int)header.num_points, header.bow_key != 0 ? " with BoW" : "", filename.c_str());
+    return map;
+}
+
 } // namespace vo
 } // namespace my_slam
\ No newline at end of file
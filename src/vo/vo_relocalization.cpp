@@ -0,0 +1,215 @@
+// The member functions of class VisualOdometry for relocalization are defined here.
+
+#include "my_slam/vo/vo.h"
+#include "my_slam/optimization/motion_only_ba.h"
+
+namespace my_slam
+{
+namespace vo
+{
+
+bool VisualOdometry::relocalize_()
+{
+    static const int relocalization_num_candidates = basics::Config::get<int>("relocalization_num_candidates");
+    static const int relocalization_min_matches = basics::Config::get<int>("relocalization_min_matches");
+    static const int relocalization_min_inliers = basics::Config::get<int>("relocalization_min_inliers");
+    static const double relocalization_search_radius = basics::Config::get<double>("relocalization_search_radius");
+    static const int motion_only_ba_iters = basics::Config::get<int>("motion_only_ba_iters");
+
+    // -- Candidate keyframes: the most similar ones in the BoW database, or else the latest ones.
+    vector<Frame::Ptr> candidates;
+    if (vocabulary_ != nullptr)
+    {
+        curr_->computeBoW(*vocabulary_);
+        for (const std::pair<int, double> &result : keyframe_database_.query(curr_->bow_vec_, relocalization_num_candidates))
+        {
+            Frame::Ptr keyframe = map_->findKeyFrame(result.first);
+            if (keyframe != nullptr)
+                candidates.push_back(keyframe);
+        }
+    }
+    else
+    {
+        for (auto it = keyframes_buff_.rbegin();
+             it != keyframes_buff_.rend() && candidates.size() < relocalization_num_candidates; it++)
+            candidates.push_back(*it);
+    }
+
+    // -- Descriptors spilled to disk are needed again. They can be spilled again later.
+    for (Frame::Ptr keyframe : candidates)
+        if (keyframe->isDescriptorsSpilled())
+        {
+            keyframe->restoreDescriptors();
+            keyframes_with_descriptors_.push_back(keyframe);
+        }
+
+    // -- Try all candidates in parallel. They only read the map and the current frame.
+    vector<std::future<RelocalizationResult>> futures;
+    for (Frame::Ptr keyframe : candidates)
+        futures.push_back(std::async(std::launch::async, &VisualOdometry::relocalizeByKeyFrame_, this, keyframe,
+                                     relocalization_min_matches, relocalization_search_radius, motion_only_ba_iters));
+    RelocalizationResult best;
+    for (std::future<RelocalizationResult> &future : futures)
+    {
+        RelocalizationResult result = future.get();
+        if (result.inliers.size() > best.inliers.size())
+            best = result;
+    }
+    printf("Relocalization: %d candidate keyframes, best has %d inliers.\n",
+           (int)candidates.size(), (int)best.inliers.size());
+
+    curr_->inliers_to_mappt_connections_.clear();
+    curr_->matches_with_map_.clear();
+    if (best.inliers.size() < relocalization_min_inliers)
+        return false;
+
+    // -- Output: pose, and the 2d-3d associations, the same as PnP in tracking.
+    curr_->T_w_c_ = best.T_w_c;
+    for (const std::pair<int, int> &inlier : best.inliers)
+    {
+        const int kpt_idx = inlier.first, pt_id = inlier.second;
+        map_->map_points_[pt_id]->matched_times_++;
+        curr_->inliers_to_mappt_connections_[kpt_idx] = PtConn{-1, pt_id};
+        curr_->matches_with_map_.push_back(cv::DMatch(pt_id, kpt_idx, 0)); // queryIdx is map point id here
+    }
+    ref_ = best.keyframe;
+    printf("Relocalized against keyframe %d.\n", ref_->id_);
+    return true;
+}
+
+VisualOdometry::RelocalizationResult VisualOdometry::relocalizeByKeyFrame_(
+    Frame::Ptr keyframe, int min_matches, double search_radius, int motion_only_ba_iters) const
+{
+    constexpr int kMaxDescriptorDist = 50; // of ORB, for the guided search
+    constexpr float kRatio = 0.75;
+    RelocalizationResult result;
+    result.keyframe = keyframe;
+    const cv::Mat &K = curr_->camera_->K_;
+
+    // -- The keyframe's map points which still exist
+    vector<const MapPoint *> pts;
+    cv::Mat pts_descriptors;
+    std::unordered_map<int, int> kpt_to_row;
+    for (const auto &it : keyframe->inliers_to_mappt_connections_)
+    {
+        auto it_pt = map_->map_points_.find(it.second.pt_map_idx);
+        if (it_pt == map_->map_points_.end())
+            continue;
+        kpt_to_row[it.first] = pts.size();
+        pts.push_back(it_pt->second.get());
+        pts_descriptors.push_back(keyframe->descriptors_.row(it.first));
+    }
+    if (pts.size() < min_matches)
+        return result;
+
+    // -- Match them with the current keypoints, by BoW or brute force.
+    vector<cv::DMatch> matches; // query: point, train: keypoint in curr_
+    if (vocabulary_ != nullptr)
+    {
+        geometry::FeatureVector feat_vec;
+        for (const auto &it : keyframe->feat_vec_)
+            for (int kpt_idx : it.second)
+            {
+                auto it_row = kpt_to_row.find(kpt_idx);
+                if (it_row != kpt_to_row.end())
+                    feat_vec[it.first].push_back(it_row->second);
+            }
+        geometry::matchFeaturesByBoW(pts_descriptors, feat_vec, curr_->descriptors_, curr_->feat_vec_, matches, kRatio);
+    }
+    else
+    {
+        cv::BFMatcher matcher(cv::NORM_HAMMING);
+        vector<vector<cv::DMatch>> knn_matches;
+        matcher.knnMatch(pts_descriptors, curr_->descriptors_, knn_matches, 2);
+        for (const vector<cv::DMatch> &knn : knn_matches)
+            if (knn.size() == 2 && knn[0].distance < kRatio * knn[1].distance)
+                matches.push_back(knn[0]);
+        geometry::removeDuplicatedMatches(matches);
+    }
+    if (matches.size() < min_matches)
+        return result;
+
+    // -- PnP RANSAC, and then refine by motion-only BA on its inliers.
+    vector<cv::Point3f> pts_3d;
+    vector<cv::Point2f> pts_2d;
+    for (const cv::DMatch &m : matches)
+    {
+        pts_3d.push_back(pts[m.queryIdx]->pos_);
+        pts_2d.push_back(curr_->keypoints_[m.trainIdx].pt);
+    }
+    cv::Mat R_vec, t, pnp_inliers;
+    cv::solvePnPRansac(pts_3d, pts_2d, K, cv::Mat(), R_vec, t, false, 100, 4.0, 0.99, pnp_inliers);
+    if (pnp_inliers.rows < min_matches / 2)
+        return result;
+    cv::Mat R;
+    cv::Rodrigues(R_vec, R);
+    cv::Mat T_w_c = basics::convertRt2T(R, t).inv();
+
+    std::unordered_map<int, int> row_of_kpt; // matched keypoint in curr_ -> point
+    vector<bool> is_inlier;
+    auto refine = [&]() {
+        vector<cv::Point2f> refine_pts_2d;
+        vector<cv::Point3f> refine_pts_3d;
+        vector<int> kpts;
+        for (const auto &it : row_of_kpt)
+        {
+            kpts.push_back(it.first);
+            refine_pts_2d.push_back(curr_->keypoints_[it.first].pt);
+            refine_pts_3d.push_back(pts[it.second]->pos_);
+        }
+        constexpr int kMinPtsForPnP = 5;
+        if (kpts.size() < kMinPtsForPnP)
+        {
+            row_of_kpt.clear();
+            return;
+        }
+        optimization::optimizePoseOnly(refine_pts_2d, refine_pts_3d, K, T_w_c, is_inlier, motion_only_ba_iters);
+        for (int i = 0; i < kpts.size(); i++)
+            if (!is_inlier[i])
+                row_of_kpt.erase(kpts[i]);
+    };
+    for (int i = 0; i < pnp_inliers.rows; i++)
+    {
+        const cv::DMatch &m = matches[pnp_inliers.at<int>(i, 0)];
+        row_of_kpt[m.trainIdx] = m.queryIdx;
+    }
+    refine();
+
+    // -- Guided search: project the other points by the refined pose, and match them to the keypoints nearby.
+    std::unordered_set<int> matched_rows;
+    for (const auto &it : row_of_kpt)
+        matched_rows.insert(it.second);
+    const cv::Mat T_c_w = T_w_c.inv();
+    const double r2 = search_radius * search_radius;
+    for (int row = 0; row < pts.size(); row++)
+    {
+        if (matched_rows.count(row))
+            continue;
+        const cv::Point3f p_cam = basics::preTranslatePoint3f(pts[row]->pos_, T_c_w);
+        if (p_cam.z <= 0)
+            continue;
+        const cv::Point2f pixel = geometry::cam2pixel(p_cam, K);
+        int best_kpt = -1, best_dist = kMaxDescriptorDist + 1;
+        for (int j = 0; j < curr_->keypoints_.size(); j++)
+        {
+            const cv::Point2f &pt = curr_->keypoints_[j].pt;
+            if ((pt.x - pixel.x) * (pt.x - pixel.x) + (pt.y - pixel.y) * (pt.y - pixel.y) > r2 || row_of_kpt.count(j))
+                continue;
+            const int dist = cv::norm(pts_descriptors.row(row), curr_->descriptors_.row(j), cv::NORM_HAMMING);
+            if (dist < best_dist)
+                best_kpt = j, best_dist = dist;
+        }
+        if (best_kpt >= 0)
+            row_of_kpt[best_kpt] = row;
+    }
+    refine();
+
+    // -- Output
+    result.T_w_c = T_w_c;
+    for (const auto &it : row_of_kpt)
+        result.inliers.push_back(std::make_pair(it.first, pts[it.second]->id_));
+    return result;
+}
+
+} // namespace vo
+} // namespace my_slam
@@ -0,0 +1,65 @@
+// Test sparse direct image alignment on synthetic images:
+//      A smooth random texture on a plane is seen by two cameras. The current image is rendered by the plane's homography.
+//      Then the current pose is aligned from a perturbed guess, using only the points' depths in the reference image.
+
+#include <iostream>
+#include <random>
+
+#include <opencv2/imgproc/imgproc.hpp>
+
+#include "my_slam/optimization/direct_alignment.h"
+
+using namespace std;
+using namespace my_slam;
+
+int main(int argc, char **argv)
+{
+    const double fx = 500, fy = 500, cx = 320, cy = 240, depth = 3.0;
+    const int kNumLevels = 4, kGridStep = 16;
+
+    // Reference image: blurred noise
+    cv::Mat ref_img(480, 640, CV_8U);
+    cv::RNG rng(0);
+    rng.fill(ref_img, cv::RNG::UNIFORM, cv::Scalar(0), cv::Scalar(256));
+    cv::GaussianBlur(ref_img, ref_img, cv::Size(0, 0), 3.0);
+    cv::normalize(ref_img, ref_img, 0, 255, cv::NORM_MINMAX);
+
+    // True motion, and the current image by the homography of the plane z = depth in the reference frame
+    optimization::Vector6d xi_truth;
+    xi_truth << 0.05, -0.03, 0.04, 0.01, -0.015, 0.02;
+    const Sophus::SE3 T_curr_ref = Sophus::SE3::exp(xi_truth);
+    Eigen::Matrix3d K_eig;
+    K_eig << fx, 0, cx, 0, fy, cy, 0, 0, 1;
+    const Eigen::Matrix3d H_eig = K_eig *
+                                  (T_curr_ref.rotation_matrix() + T_curr_ref.translation() * Eigen::Vector3d(0, 0, 1).transpose() / depth) *
+                                  K_eig.inverse();
+    cv::Mat H(3, 3, CV_64F);
+    for (int i = 0; i < 9; i++)
+        H.at<double>(i / 3, i % 3) = H_eig(i / 3, i % 3);
+    cv::Mat curr_img;
+    cv::warpPerspective(ref_img, curr_img, H, ref_img.size(), cv::INTER_LINEAR);
+
+    vector<cv::Mat> ref_pyramid, curr_pyramid;
+    cv::buildPyramid(ref_img, ref_pyramid, kNumLevels - 1);
+    cv::buildPyramid(curr_img, curr_pyramid, kNumLevels - 1);
+
+    // Points on a grid of the reference image, in the reference camera frame
+    vector<Eigen::Vector3d> pts_ref;
+    for (int v = kGridStep; v < ref_img.rows - kGridStep; v += kGridStep)
+        for (int u = kGridStep; u < ref_img.cols - kGridStep; u += kGridStep)
+            pts_ref.push_back(Eigen::Vector3d((u - cx) / fx * depth, (v - cy) / fy * depth, depth));
+
+    // Align from a perturbed pose
+    optimization::Vector6d xi_noise;
+    xi_noise << 0.02, 0.02, -0.02, 0.01, 0.01, -0.01;
+    Sophus::SE3 T = Sophus::SE3::exp(xi_noise) * T_curr_ref;
+    const double err_before = (T.inverse() * T_curr_ref).log().norm();
+    optimization::DirectAlignmentSummary summary = optimization::alignSparseDirect(
+        ref_pyramid, curr_pyramid, pts_ref, fx, fy, cx, cy, T);
+    const double err_after = (T.inverse() * T_curr_ref).log().norm();
+
+    cout << "Points: " << summary.num_points << " / " << pts_ref.size()
+         << ", iterations: " << summary.num_iterations << ", rms error: " << summary.rms_error << endl;
+    cout << "Pose error before: " << err_before << ", after: " << err_after << endl;
+    return err_after < 2e-3 && summary.rms_error < 5.0 ? 0 : 1;
+}
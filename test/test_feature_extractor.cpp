@@ -0,0 +1,114 @@
+// Test the keypoint extractor with adaptive FAST thresholds on a grid:
+//      A synthetic image has texture on its left part and is flat on its right part.
+//      The extractor should not extract more than wanted, and keypoints should be inside the border.
+//      Over several frames, the thresholds of textured cells go up, and the ones of flat cells go down to the lowest.
+//      Changing the number of keypoints takes effect on the next image.
+//      With a mask, no keypoints are in its zero part, which is like the car's hood at the bottom of the image.
+// Test the quadtree distribution:
+//      Most keypoints are strong and clustered in a corner. The selected ones should still spread over the image.
+
+#include <iostream>
+#include <random>
+
+#include "my_slam/geometry/feature_extractor.h"
+
+using namespace std;
+using namespace my_slam;
+
+int main(int argc, char **argv)
+{
+    const int kNumKeypoints = 1500, kNumLevels = 4, kCellSize = 32;
+    const int kInitThreshold = 20, kMinThreshold = 7, kMaxThreshold = 80, kFlatFromX = 430;
+    const double kScaleFactor = 1.2;
+
+    // Blocks of pseudo random gray levels, and a flat right part
+    cv::Mat image(480, 640, CV_8U);
+    for (int y = 0; y < image.rows; y++)
+        for (int x = 0; x < image.cols; x++)
+            image.at<uchar>(y, x) = x >= kFlatFromX ? 128 : (x / 6 * 7919 + y / 6 * 104729) % 251;
+
+    geometry::GridFastExtractor extractor(kNumKeypoints, kScaleFactor, kNumLevels,
+                                          kCellSize, kInitThreshold, kMinThreshold, kMaxThreshold);
+    int num_errors = 0;
+    vector<cv::KeyPoint> keypoints;
+    for (int frame = 0; frame < 5; frame++)
+    {
+        extractor.detect(image, keypoints);
+        num_errors += keypoints.empty() || keypoints.size() > kNumKeypoints;
+        for (const cv::KeyPoint &kpt : keypoints)
+        {
+            const double border = geometry::GridFastExtractor::kBorder;
+            num_errors += kpt.octave < 0 || kpt.octave >= kNumLevels;
+            num_errors += kpt.pt.x < border || kpt.pt.y < border ||
+                          kpt.pt.x >= image.cols - border || kpt.pt.y >= image.rows - border;
+            num_errors += kpt.angle < 0 || kpt.angle >= 360;
+            num_errors += kpt.pt.x > kFlatFromX + 10;
+        }
+    }
+
+    // Thresholds at level 0. Cells are in row major order, so the first cell is textured, and the last one of a row is flat.
+    const int num_cols = cvRound((image.cols - 2.0 * geometry::GridFastExtractor::kBorder) / kCellSize);
+    const int first_cell_threshold = extractor.threshold(0, 0);
+    const int last_cell_threshold = extractor.threshold(0, num_cols - 1);
+    num_errors += first_cell_threshold <= kInitThreshold || last_cell_threshold != kMinThreshold;
+
+    // A smaller budget keeps the thresholds.
+    extractor.setNumKeypoints(kNumKeypoints / 3);
+    extractor.detect(image, keypoints);
+    num_errors += keypoints.empty() || keypoints.size() > kNumKeypoints / 3;
+    num_errors += extractor.threshold(0, num_cols - 1) != kMinThreshold;
+    extractor.setNumKeypoints(kNumKeypoints);
+
+    // A mask excludes the bottom of the image.
+    const int kHoodFromY = 360;
+    cv::Mat mask(image.rows, image.cols, CV_8U);
+    for (int y = 0; y < mask.rows; y++)
+        for (int x = 0; x < mask.cols; x++)
+            mask.at<uchar>(y, x) = y < kHoodFromY ? 255 : 0;
+    extractor.detect(image, keypoints, mask);
+    num_errors += keypoints.empty() || keypoints.size() > kNumKeypoints;
+    for (const cv::KeyPoint &kpt : keypoints)
+        num_errors += kpt.pt.y >= kHoodFromY;
+
+    // A different image size resets the grid.
+    cv::Mat small(240, 320, CV_8U);
+    for (int y = 0; y < small.rows; y++)
+        for (int x = 0; x < small.cols; x++)
+            small.at<uchar>(y, x) = image.at<uchar>(y, x);
+    extractor.detect(small, keypoints);
+    num_errors += keypoints.empty() || keypoints.size() > kNumKeypoints;
+
+    // -- Quadtree: 2000 keypoints in the top left 100x100 corner, and 100 over the whole image.
+    const int kNumWanted = 200;
+    std::mt19937 rng(0);
+    std::uniform_real_distribution<float> uniform(0, 1);
+    vector<cv::KeyPoint> candidates;
+    for (int i = 0; i < 2000; i++)
+        candidates.push_back(cv::KeyPoint(100 * uniform(rng), 100 * uniform(rng), 7, -1, 100 + uniform(rng)));
+    for (int i = 0; i < 100; i++)
+        candidates.push_back(cv::KeyPoint(640 * uniform(rng), 480 * uniform(rng), 7, -1, uniform(rng)));
+    const vector<cv::KeyPoint> selected = geometry::distributeKeypointsByQuadtree(
+        candidates, cv::Rect(0, 0, 640, 480), kNumWanted);
+    num_errors += selected.size() != kNumWanted;
+
+    // Most of the weak keypoints outside the corner are selected, though the ones in the corner are stronger.
+    auto isOutsideCorner = [](const cv::KeyPoint &kpt) { return kpt.pt.x > 100 || kpt.pt.y > 100; };
+    const int num_outside = std::count_if(candidates.begin(), candidates.end(), isOutsideCorner);
+    const int num_selected_outside = std::count_if(selected.begin(), selected.end(), isOutsideCorner);
+    num_errors += num_selected_outside < 0.8 * num_outside;
+
+    // The strongest candidate is always selected.
+    float max_response = 0, max_selected_response = 0;
+    for (const cv::KeyPoint &kpt : candidates)
+        max_response = std::max(max_response, kpt.response);
+    for (const cv::KeyPoint &kpt : selected)
+        max_selected_response = std::max(max_selected_response, kpt.response);
+    num_errors += max_selected_response != max_response;
+
+    cout << "Keypoints: " << keypoints.size() << ", thresholds of a textured cell: " << first_cell_threshold
+         << ", of a flat cell: " << last_cell_threshold << "." << endl;
+    cout << "Quadtree selected " << selected.size() << " of " << candidates.size() << " keypoints, and "
+         << num_selected_outside << " / " << num_outside << " of the ones outside the corner. "
+         << num_errors << " errors." << endl;
+    return num_errors == 0 ? 0 : 1;
+}
@@ -0,0 +1,116 @@
+// Test saving a map to the binary file and loading it back by mmap:
+//      Build a random map of keyframes and points, save it, load it,
+//      and check the poses, keypoints, descriptors, BoW, points, their scale ranges and observations are the same.
+
+#include <iostream>
+#include <random>
+
+#include "my_slam/vo/vo_io.h"
+
+using namespace std;
+using namespace my_slam;
+
+int main(int argc, char **argv)
+{
+    const int kNumKeyFrames = 20, kNumKeypoints = 300, kNumPoints = 2000;
+    std::mt19937 rng(0);
+    std::uniform_real_distribution<float> uniform(-10, 10);
+
+    cv::Mat K = (cv::Mat_<double>(3, 3) << 500, 0, 320, 0, 500, 240, 0, 0, 1);
+    geometry::Camera::Ptr camera(new geometry::Camera(K));
+    vo::Map::Ptr map(new vo::Map);
+    for (int i = 0; i < kNumPoints; i++)
+    {
+        cv::Mat descriptor(1, 32, CV_8U);
+        for (int j = 0; j < 32; j++)
+            descriptor.at<uchar>(0, j) = rng() % 256;
+        cv::Mat norm = (cv::Mat_<double>(3, 1) << 0, 0, 1);
+        vo::MapPoint::Ptr pt = vo::MapPoint::create(
+            cv::Point3f(uniform(rng), uniform(rng), uniform(rng)), descriptor, norm, rng() % 256, rng() % 256, rng() % 256);
+        pt->matched_times_ = rng() % 10;
+        pt->min_distance_ = 1 + uniform(rng) * 0.01f;
+        pt->max_distance_ = 20 + uniform(rng);
+        map->insertMapPoint(pt);
+    }
+    for (int i = 0; i < kNumKeyFrames; i++)
+    {
+        vo::Frame::Ptr kf = vo::Frame::create();
+        kf->id_ = vo::Frame::factory_id_++;
+        kf->camera_ = camera;
+        kf->T_w_c_ = cv::Mat::eye(4, 4, CV_64F);
+        kf->T_w_c_.at<double>(0, 3) = uniform(rng);
+        kf->descriptors_ = cv::Mat(kNumKeypoints, 32, CV_8U);
+        for (int j = 0; j < kNumKeypoints; j++)
+        {
+            kf->keypoints_.push_back(cv::KeyPoint(uniform(rng) + 320, uniform(rng) + 240, 31, uniform(rng), 1, j % 8));
+            for (int k = 0; k < 32; k++)
+                kf->descriptors_.at<uchar>(j, k) = rng() % 256;
+            if (rng() % 2)
+                kf->inliers_to_mappt_connections_[j] = vo::PtConn{-1, (int)(rng() % kNumPoints)};
+            kf->bow_vec_[rng() % 1000] += 1.0 / kNumKeypoints;
+            kf->feat_vec_[rng() % 100].push_back(j);
+        }
+        map->insertKeyFrame(kf);
+    }
+
+    // Save and load
+    const string kFilename = "test_map_io.bin";
+    const uint64_t kBoWKey = 12345;
+    vo::saveMap(kFilename, map, kBoWKey);
+    vo::Map::Ptr loaded = vo::loadMap(kFilename);
+
+    // Compare
+    int num_errors = 0;
+    if (loaded->keyframes_.size() != map->keyframes_.size() || loaded->map_points_.size() != map->map_points_.size())
+        num_errors++;
+    num_errors += loaded->bow_key_ != kBoWKey;
+    for (const auto &it : map->keyframes_)
+    {
+        const vo::Frame::Ptr &kf = it.second, kf2 = loaded->findKeyFrame(it.first);
+        if (kf2 == nullptr)
+        {
+            num_errors++;
+            continue;
+        }
+        num_errors += cv::norm(kf->T_w_c_, kf2->T_w_c_) > 1e-12;
+        num_errors += cv::norm(kf->descriptors_, kf2->descriptors_, cv::NORM_HAMMING) != 0;
+        num_errors += cv::norm(kf->camera_->K_, kf2->camera_->K_) > 1e-12;
+        num_errors += kf->keypoints_.size() != kf2->keypoints_.size();
+        for (int j = 0; j < kf->keypoints_.size() && j < kf2->keypoints_.size(); j++)
+            num_errors += kf->keypoints_[j].pt != kf2->keypoints_[j].pt || kf->keypoints_[j].octave != kf2->keypoints_[j].octave;
+        num_errors += kf->bow_vec_ != kf2->bow_vec_ || kf->feat_vec_ != kf2->feat_vec_;
+        num_errors += kf->inliers_to_mappt_connections_.size() != kf2->inliers_to_mappt_connections_.size();
+        for (const auto &conn : kf->inliers_to_mappt_connections_)
+        {
+            auto it2 = kf2->inliers_to_mappt_connections_.find(conn.first);
+            num_errors += it2 == kf2->inliers_to_mappt_connections_.end() ||
+                          it2->second.pt_map_idx != conn.second.pt_map_idx;
+        }
+    }
+    for (const auto &it : map->map_points_)
+    {
+        auto it2 = loaded->map_points_.find(it.first);
+        if (it2 == loaded->map_points_.end())
+        {
+            num_errors++;
+            continue;
+        }
+        const vo::MapPoint::Ptr &pt = it.second, &pt2 = it2->second;
+        num_errors += pt->pos_ != pt2->pos_ || pt->color_ != pt2->color_ || pt->matched_times_ != pt2->matched_times_;
+        num_errors += pt->min_distance_ != pt2->min_distance_ || pt->max_distance_ != pt2->max_distance_;
+        num_errors += cv::norm(pt->descriptor_, pt2->descriptor_, cv::NORM_HAMMING) != 0;
+        for (const auto &obs : pt2->observations_) // Observations of the loaded point, from the keyframes' connections.
+        {
+            auto it_conn = loaded->findKeyFrame(obs.first)->inliers_to_mappt_connections_.find(obs.second);
+            num_errors += it_conn == loaded->findKeyFrame(obs.first)->inliers_to_mappt_connections_.end() ||
+                          it_conn->second.pt_map_idx != pt2->id_;
+        }
+    }
+
+    // New ids should not collide with the loaded ones.
+    num_errors += vo::Frame::factory_id_ < kNumKeyFrames || vo::MapPoint::factory_id_ < kNumPoints;
+
+    cout << "Loaded " << loaded->keyframes_.size() << " keyframes and " << loaded->map_points_.size()
+         << " points, " << num_errors << " errors." << endl;
+    return num_errors == 0 ? 0 : 1;
+}
@@ -0,0 +1,56 @@
+// Test motion-only BA on synthetic data:
+//      Project random points by a true pose, add some outliers,
+//      and then refine a perturbed pose.
+
+#include <iostream>
+#include <random>
+
+#include "my_slam/optimization/motion_only_ba.h"
+
+using namespace std;
+using namespace my_slam;
+
+int main(int argc, char **argv)
+{
+    const double fx = 615, fy = 615, cx = 320, cy = 240;
+    const int kNumPoints = 200, kNumOutliers = 20;
+
+    // True pose
+    optimization::Vector6d xi_truth;
+    xi_truth << 0.1, -0.05, 0.2, 0.02, -0.03, 0.01;
+    Sophus::SE3 T_truth = Sophus::SE3::exp(xi_truth);
+
+    // Random points in front of the camera, and their projections
+    std::mt19937 rng(0);
+    std::uniform_real_distribution<double> uniform(-1.0, 1.0);
+    std::normal_distribution<double> noise(0.0, 0.5);
+    vector<Eigen::Vector3d> pts_3d;
+    vector<Eigen::Vector2d> pts_2d;
+    for (int i = 0; i < kNumPoints; i++)
+    {
+        Eigen::Vector3d p_cam(uniform(rng), uniform(rng), 3.0 + uniform(rng));
+        pts_3d.push_back(T_truth.inverse() * p_cam);
+        Eigen::Vector2d uv(fx * p_cam(0) / p_cam(2) + cx, fy * p_cam(1) / p_cam(2) + cy);
+        if (i < kNumOutliers)
+            uv += Eigen::Vector2d(50 * uniform(rng), 50 * uniform(rng));
+        else
+            uv += Eigen::Vector2d(noise(rng), noise(rng));
+        pts_2d.push_back(uv);
+    }
+
+    // Perturbed initial pose
+    optimization::Vector6d xi_noise;
+    xi_noise << 0.05, 0.05, -0.05, 0.02, 0.02, -0.02;
+    Sophus::SE3 T_c_w = Sophus::SE3::exp(xi_noise) * T_truth;
+
+    // Optimize
+    vector<bool> is_inlier;
+    int num_inliers = optimization::optimizePoseOnly(
+        pts_2d, pts_3d, fx, fy, cx, cy, T_c_w, is_inlier);
+
+    // Print result
+    double err = (T_c_w.inverse() * T_truth).log().norm();
+    cout << "Number of inliers: " << num_inliers << " / " << kNumPoints << endl;
+    cout << "Pose error before: " << xi_noise.norm() << ", after: " << err << endl;
+    return err < 1e-2 ? 0 : 1;
+}
@@ -0,0 +1,75 @@
+// Test the native bundle adjuster on synthetic data:
+//      Several cameras observe random points.
+//      Perturb all poses except the first one, and all points,
+//      and then check whether the reprojection error goes back to the noise level.
+
+#include <iostream>
+#include <random>
+
+#include "my_slam/optimization/native_ba.h"
+
+using namespace std;
+using namespace my_slam;
+
+int main(int argc, char **argv)
+{
+    typedef optimization::NativeBundleAdjuster<6, 3, 2> Adjuster;
+    typedef Eigen::Matrix<double, 6, 1> Vector6d;
+    const double fx = 615, fy = 615, cx = 320, cy = 240;
+    const int kNumPoses = 30, kNumPoints = 1000;
+
+    std::mt19937 rng(0);
+    std::uniform_real_distribution<double> uniform(-1.0, 1.0);
+    std::normal_distribution<double> noise(0.0, 0.5);
+
+    // True states: cameras move along x-axis, and look at points at z = 4
+    vector<Sophus::SE3> T_truth;
+    for (int i = 0; i < kNumPoses; i++)
+    {
+        Vector6d xi;
+        xi << -0.05 * i, 0.01 * uniform(rng), 0.01 * uniform(rng), 0.02 * uniform(rng), 0.02 * uniform(rng), 0.02 * uniform(rng);
+        T_truth.push_back(Sophus::SE3::exp(xi)); // T_c_w
+    }
+    vector<Eigen::Vector3d> pts_truth;
+    for (int j = 0; j < kNumPoints; j++)
+        pts_truth.push_back(Eigen::Vector3d(0.8 * kNumPoses * 0.05 * (uniform(rng) + 1), uniform(rng), 4.0 + uniform(rng)));
+
+    // Build the problem from perturbed states
+    Adjuster adjuster(fx, fy, cx, cy, Eigen::Matrix2d::Identity());
+    for (int i = 0; i < kNumPoses; i++)
+    {
+        Vector6d xi_noise;
+        xi_noise << 0.02 * uniform(rng), 0.02 * uniform(rng), 0.02 * uniform(rng),
+            0.01 * uniform(rng), 0.01 * uniform(rng), 0.01 * uniform(rng);
+        adjuster.addPose(i == 0 ? T_truth[i] : Sophus::SE3::exp(xi_noise) * T_truth[i], i == 0);
+    }
+    for (int j = 0; j < kNumPoints; j++)
+        adjuster.addPoint(pts_truth[j] + 0.05 * Eigen::Vector3d(uniform(rng), uniform(rng), uniform(rng)));
+
+    int num_obs = 0;
+    for (int i = 0; i < kNumPoses; i++)
+        for (int j = 0; j < kNumPoints; j++)
+        {
+            const Eigen::Vector3d pc = T_truth[i] * pts_truth[j];
+            const Eigen::Vector2d uv(fx * pc(0) / pc(2) + cx + noise(rng), fy * pc(1) / pc(2) + cy + noise(rng));
+            if (uv(0) < 0 || uv(0) > 2 * cx || uv(1) < 0 || uv(1) > 2 * cy)
+                continue;
+            adjuster.addObservation(i, j, uv);
+            num_obs++;
+        }
+
+    // Optimize by each linear solver
+    for (optimization::LinearSolverType type : {optimization::LinearSolverType::DENSE,
+                                                optimization::LinearSolverType::EIGEN,
+                                                optimization::LinearSolverType::PCG})
+    {
+        Adjuster problem = adjuster;
+        const optimization::BASummary summary = problem.optimize(optimization::BATermination(), type);
+        const double rms = sqrt(summary.final_cost / num_obs);
+        cout << "Solver " << optimization::linearSolverType2str(type)
+             << ": " << summary.toString() << ", rms error = " << rms << endl;
+        if (rms > 1.0) // The pixel noise has a std of 0.5 on each axis.
+            return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,92 @@
+// Test the object pool:
+//      Create and destroy objects in a random order, and check that
+//      live handles always find their objects, and stale handles never do, even after their slots are reused.
+//      Also, a constructor which throws gives its slot back, and shared objects go back to the pool with the last copy.
+
+#include <iostream>
+#include <random>
+
+#include "my_slam/basics/object_pool.h"
+
+using namespace std;
+using namespace my_slam;
+
+const int kThrowingValue = -2; // Item's constructor throws for it.
+
+struct Item
+{
+    static int num_alive;
+    int value;
+    Item(int v) : value(v)
+    {
+        if (v == kThrowingValue)
+            throw std::runtime_error("Item: constructor throws");
+        num_alive++;
+    }
+    ~Item() { num_alive--; }
+};
+int Item::num_alive = 0;
+
+int main(int argc, char **argv)
+{
+    const int kNumSteps = 100000;
+    std::mt19937 rng(0);
+    basics::ObjectPool<Item> pool(64);
+
+    vector<std::pair<basics::PoolHandle, int>> alive; // handle, value
+    vector<basics::PoolHandle> stale;
+    int num_errors = 0;
+    for (int step = 0; step < kNumSteps; step++)
+    {
+        if (alive.empty() || rng() % 3 != 0)
+        {
+            const basics::PoolHandle h = pool.create(step);
+            alive.push_back(std::make_pair(h, step));
+        }
+        else
+        {
+            const int i = rng() % alive.size();
+            pool.destroy(alive[i].first);
+            stale.push_back(alive[i].first);
+            alive[i] = alive.back();
+            alive.pop_back();
+        }
+    }
+    for (const auto &it : alive)
+    {
+        const Item *item = pool.get(it.first);
+        num_errors += item == nullptr || item->value != it.second;
+    }
+    for (const basics::PoolHandle &h : stale)
+        num_errors += pool.get(h) != nullptr;
+    num_errors += pool.size() != alive.size() || Item::num_alive != alive.size();
+
+    // A failed construction doesn't leak its slot: the next object takes it, instead of a new one.
+    const size_t size_before = pool.size();
+    bool is_thrown = false;
+    try
+    {
+        pool.create(kThrowingValue);
+    }
+    catch (const std::runtime_error &)
+    {
+        is_thrown = true;
+    }
+    num_errors += !is_thrown || pool.size() != size_before;
+    const basics::PoolHandle h_after_throw = pool.create(0);
+    num_errors += pool.size() != size_before + 1;
+    pool.destroy(h_after_throw);
+
+    // Objects shared by shared_ptr go back to the pool with the last copy.
+    basics::PoolHandle h = pool.create(-1);
+    {
+        std::shared_ptr<Item> p1 = pool.share(h), p2 = p1;
+        p1.reset();
+        num_errors += !pool.isValid(h);
+    }
+    num_errors += pool.isValid(h);
+
+    cout << "Pool: " << pool.size() << " alive objects, capacity " << pool.capacity()
+         << ", " << stale.size() << " stale handles, " << num_errors << " errors." << endl;
+    return num_errors == 0 ? 0 : 1;
+}
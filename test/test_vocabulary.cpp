@@ -0,0 +1,97 @@
+// Test the vocabulary and the keyframe database on synthetic binary descriptors:
+//      Each "place" is seen as a random subset of prototype descriptors.
+//      Train a vocabulary on one image of each place, save and load it,
+//      and then check whether a new noisy image of a place is recognized, and its descriptors are matched by BoW.
+
+#include <iostream>
+#include <random>
+
+#include "my_slam/geometry/vocabulary.h"
+#include "my_slam/geometry/feature_match.h"
+#include "my_slam/vo/keyframe_database.h"
+
+using namespace std;
+using namespace my_slam;
+
+int main(int argc, char **argv)
+{
+    const int kNumPrototypes = 2000, kNumPlaces = 40, kDescriptorsPerImage = 150, kBitsOfNoise = 4;
+    std::mt19937 rng(0);
+
+    cv::Mat prototypes(kNumPrototypes, 32, CV_8U);
+    for (int i = 0; i < kNumPrototypes; i++)
+        for (int j = 0; j < 32; j++)
+            prototypes.at<uchar>(i, j) = rng() % 256;
+
+    // Descriptors of a place, with some bits flipped.
+    vector<vector<int>> places;
+    for (int p = 0; p < kNumPlaces; p++)
+    {
+        places.push_back(vector<int>());
+        for (int i = 0; i < kDescriptorsPerImage; i++)
+            places.back().push_back(rng() % kNumPrototypes);
+    }
+    auto takeImage = [&](int place) {
+        cv::Mat descriptors;
+        for (int idx : places[place])
+        {
+            cv::Mat d = prototypes.row(idx).clone();
+            for (int k = 0; k < kBitsOfNoise; k++)
+            {
+                const int bit = rng() % 256;
+                d.at<uchar>(0, bit / 8) ^= 1 << (bit % 8);
+            }
+            descriptors.push_back(d);
+        }
+        return descriptors;
+    };
+
+    // Train, save, and load
+    vector<cv::Mat> training_descriptors;
+    for (int p = 0; p < kNumPlaces; p++)
+        training_descriptors.push_back(takeImage(p));
+    geometry::Vocabulary trained(8, 4);
+    trained.create(training_descriptors);
+    const string kFilename = "test_vocabulary.voc";
+    trained.save(kFilename);
+    geometry::Vocabulary vocabulary;
+    vocabulary.load(kFilename);
+    cout << "Vocabulary: " << trained.numWords() << " words, loaded " << vocabulary.numWords() << " words" << endl;
+    if (vocabulary.numWords() != trained.numWords() || vocabulary.empty())
+        return 1;
+
+    // Database of the training images
+    vo::KeyFrameDatabase database;
+    vector<geometry::FeatureVector> feat_vecs(kNumPlaces);
+    for (int p = 0; p < kNumPlaces; p++)
+    {
+        geometry::BowVector bow_vec;
+        vocabulary.transform(training_descriptors[p], bow_vec, feat_vecs[p], 2);
+        database.add(p, bow_vec);
+    }
+
+    // Recognize new images of each place, and match their descriptors by BoW
+    int num_recognized = 0, num_matches = 0, num_correct_matches = 0;
+    for (int p = 0; p < kNumPlaces; p++)
+    {
+        const cv::Mat descriptors = takeImage(p);
+        geometry::BowVector bow_vec;
+        geometry::FeatureVector feat_vec;
+        vocabulary.transform(descriptors, bow_vec, feat_vec, 2);
+        const vector<pair<int, double>> results = database.query(bow_vec, 1);
+        num_recognized += !results.empty() && results[0].first == p;
+
+        vector<cv::DMatch> matches;
+        geometry::matchFeaturesByBoW(descriptors, feat_vec, training_descriptors[p], feat_vecs[p], matches);
+        num_matches += matches.size();
+        for (const cv::DMatch &m : matches)
+            num_correct_matches += places[p][m.queryIdx] == places[p][m.trainIdx];
+    }
+    cout << "Recognized " << num_recognized << "/" << kNumPlaces << " places. "
+         << "Matches: " << num_correct_matches << "/" << num_matches << " correct, out of "
+         << kNumPlaces * kDescriptorsPerImage << " descriptors." << endl;
+    if (num_recognized < 0.9 * kNumPlaces || num_matches < 0.5 * kNumPlaces * kDescriptorsPerImage ||
+        num_correct_matches < 0.95 * num_matches)
+        return 1;
+    return 0;
+}
@@ -0,0 +1,65 @@
+// Train a vocabulary of ORB descriptors offline from local image folders, and save it to a binary file.
+//      Usage: bin/train_vocabulary config/config.yaml output.voc image_folder_1 [image_folder_2 ...]
+//      Keypoints and descriptors are computed by the same settings in config.yaml as the VO.
+
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <opencv2/core/core.hpp>
+#include <opencv2/highgui/highgui.hpp>
+
+#include "my_slam/common_include.h"
+#include "my_slam/basics/config.h"
+#include "my_slam/geometry/feature_match.h"
+#include "my_slam/geometry/vocabulary.h"
+
+using namespace my_slam;
+
+int main(int argc, char **argv)
+{
+    if (argc < 4)
+    {
+        cout << "Usage: bin/train_vocabulary config/config.yaml output.voc image_folder_1 [image_folder_2 ...]" << endl;
+        return 1;
+    }
+    basics::Config::setParameterFile(argv[1]);
+    const string output_file = argv[2];
+    const int branching = basics::Config::get<int>("vocabulary_branching");
+    const int depth = basics::Config::get<int>("vocabulary_depth");
+
+    // -- Descriptors of all images
+    vector<cv::Mat> training_descriptors;
+    for (int i = 3; i < argc; i++)
+    {
+        vector<cv::String> image_paths;
+        for (const string &ext : {"png", "jpg", "jpeg", "bmp"})
+        {
+            vector<cv::String> paths;
+            cv::glob(string(argv[i]) + "/*." + ext, paths, false);
+            image_paths.insert(image_paths.end(), paths.begin(), paths.end());
+        }
+        for (const cv::String &path : image_paths)
+        {
+            cv::Mat image = cv::imread(path);
+            if (image.empty())
+                continue;
+            vector<cv::KeyPoint> keypoints;
+            cv::Mat descriptors;
+            geometry::calcKeyPoints(image, keypoints);
+            geometry::calcDescriptors(image, keypoints, descriptors);
+            if (!descriptors.empty())
+                training_descriptors.push_back(descriptors);
+        }
+        printf("Read %d images from %s\n", (int)image_paths.size(), argv[i]);
+    }
+    printf("Training a vocabulary of branching %d and depth %d on %d images ...\n",
+           branching, depth, (int)training_descriptors.size());
+
+    // -- Train and save
+    geometry::Vocabulary vocabulary(branching, depth);
+    vocabulary.create(training_descriptors);
+    vocabulary.save(output_file);
+    printf("Saved vocabulary of %d words to %s\n", vocabulary.numWords(), output_file.c_str());
+    return 0;
+}